@@ -1,479 +1,9027 @@
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+
+#include "clutch.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <lauxlib.h>
+#include <limits.h>
 #include <lua.h>
+#include <math.h>
+#include <pthread.h>
+#include <regex.h>
 #include <sqlite3.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VEC_X86 1
+#define VEC_TARGET(arch) __attribute__((target(arch)))
+#endif
+
+#define COLUMN_JSON 0x01
+#define COLUMN_COMPRESSED 0x02
+
+#define COMPRESS_MIN 128
+#define COMPRESS_HEADER 8
+
+#define ARCHIVE_VFS "clutch-zlib"
+#define ARCHIVE_MAGIC "CLUTCHZ1"
+#define ARCHIVE_HEADER 32
+#define ARCHIVE_ENTRY 12
+
+#define JSON_MAX_DEPTH 128
+
+#define PACK_MAX_ITEMS 256
+#define PACK_MAX_ALIGN 8
+
+#define TDIGEST_DELTA 100
+#define TDIGEST_CENTROIDS (2 * TDIGEST_DELTA)
+#define TDIGEST_BUFFER (5 * TDIGEST_DELTA)
+
+#define HLL_BITS 10
+#define HLL_REGISTERS (1 << HLL_BITS)
+#define HLL_MAX_DEPTH (64 - HLL_BITS + 1)
+
+#define HISTOGRAM_MAX_BOUNDS 256
+
+#define RECORD_MAGIC "CLUTCHR1"
+
+#define DETECT_MAX_ENTRIES 1024
+
+#define STRICT_SCAN 0x01
+#define STRICT_TEMP_BTREE 0x02
+#define STRICT_MAX_CURSORS 64
+
+#define PART_COLUMNS 0
+#define PART_KEYS 1
+#define PART_NEW_KEYS 2
+#define PART_SELECT_KEYS 3
+#define PART_GROUP_BY 4
+#define PART_MATCH_NEW 5
+#define PART_MATCH_OLD 6
+#define PART_INDEX 7
+#define PART_AGGREGATE_COLUMNS 8
+#define PART_TARGETS 9
+#define PART_SELECT 10
+#define PART_ADD 11
+#define PART_REMOVE 12
+#define PART_ENSURE 13
+#define PART_PRUNE 14
+#define MATERIALIZE_PARTS 15
+
+#define PARTITION_KEY_MAX 16
+
+#define RTREE_MAX_DIMS 5
+
+#define WRITER_BATCH 1000
+#define WRITER_CACHE 32
+
+#define VEC_DOT 0
+#define VEC_COSINE 1
+#define VEC_L2 2
+
+struct db
+{
+  sqlite3 *handle;
+  int detect_threshold;
+  double detect_window;
+  int detect_entries;
+  struct recorder *recorder;
+  int strict;
+  char *collate_error;
+  struct stmt *stmts;
+};
+
+struct strict_cursor
+{
+  int cursor;
+  int root;
+  int schema;
+  int rewound;
+  int seeked;
+};
+
+struct record_params
+{
+  sqlite3_stmt *handle;
+  int count;
+  unsigned char *data;
+  size_t len;
+  size_t size;
+};
+
+struct recorder
+{
+  FILE *file;
+  double start;
+  sqlite3_uint64 *ids;
+  size_t nids;
+  size_t ids_size;
+  struct record_params *params;
+  size_t nparams;
+  size_t params_size;
+};
+
+struct materialize
+{
+  sqlite3_str *parts[MATERIALIZE_PARTS];
+};
+
+struct replay_stmt
+{
+  sqlite3_uint64 id;
+  const char *sql;
+  size_t len;
+};
+
+struct replay_event
+{
+  sqlite3_uint64 id;
+  size_t stmt;
+  sqlite3_uint64 start_us;
+  sqlite3_uint64 duration_ns;
+  unsigned int nparams;
+  const unsigned char *params;
+};
+
+struct replay
+{
+  struct replay_stmt *stmts;
+  size_t nstmts;
+  struct replay_event *events;
+  size_t nevents;
+  double *latencies;
+  double speed;
+  double start;
+  int threads;
+};
+
+struct replay_worker
+{
+  struct replay *replay;
+  sqlite3 *handle;
+  pthread_t thread;
+  int index;
+  int errors;
+};
+
+struct stmt
+{
+  sqlite3_stmt *handle;
+  struct db *db;
+  unsigned char *columns;
+  unsigned char *params;
+  size_t compress_min;
+  struct stmt *prev;
+  struct stmt *next;
+  unsigned long runs;
+  double used;
+  unsigned long yield_rows;
+  unsigned long since_yield;
+  double yield_ms;
+  double last_yield;
+};
+
+struct rtree_entry
+{
+  double center[RTREE_MAX_DIMS];
+  double key;
+  int row;
+};
+
+struct buffer
+{
+  char *data;
+  size_t len;
+  size_t size;
+  int index;
+};
+
+struct archive_page
+{
+  sqlite3_uint64 offset;
+  unsigned int size;
+};
+
+struct archive_file
+{
+  sqlite3_file base;
+  sqlite3_file *real;
+  unsigned int page_size;
+  unsigned int page_count;
+  struct archive_page *pages;
+  unsigned char *cache;
+  unsigned char *scratch;
+  sqlite3_int64 cached;
+};
+
+struct centroid
+{
+  double mean;
+  double weight;
+};
+
+struct tdigest
+{
+  int init;
+  double q;
+  double total;
+  double min;
+  double max;
+  int min_count;
+  int max_count;
+  int count;
+  int merged;
+  struct centroid points[TDIGEST_CENTROIDS + TDIGEST_BUFFER];
+};
+
+struct hll_entry
+{
+  unsigned char rank;
+  unsigned int seq;
+};
+
+/* Each HyperLogLog register keeps the ranks that may become its maximum as
+ * rows leave a window: newer entries always have lower ranks, so there are
+ * at most HLL_MAX_DEPTH of them. The lists grow as needed and are freed by
+ * hll_final(). */
+struct hll
+{
+  unsigned int added;
+  unsigned int removed;
+  unsigned char len[HLL_REGISTERS];
+  unsigned char size[HLL_REGISTERS];
+  struct hll_entry *entries[HLL_REGISTERS];
+};
+
+struct histogram
+{
+  int nbounds;
+  double bounds[HISTOGRAM_MAX_BOUNDS];
+  sqlite3_int64 counts[HISTOGRAM_MAX_BOUNDS + 1];
+};
+
+struct vec_hit
+{
+  sqlite3_int64 id;
+  double score;
+};
+
+struct vec_topk_vtab
+{
+  sqlite3_vtab base;
+  sqlite3 *db;
+};
+
+struct vec_topk_cursor
+{
+  sqlite3_vtab_cursor base;
+  struct vec_hit *hits;
+  int count;
+  int pos;
+};
 
-static void init_db_metatable(lua_State *L);
-static void init_statement_metatable(lua_State *L);
+struct pack_item
+{
+  char type;
+  unsigned char size;
+  unsigned char align;
+  unsigned char little;
+};
+
+struct pack_format
+{
+  int count;
+  int fields;
+  struct pack_item items[PACK_MAX_ITEMS];
+};
+
+struct collation
+{
+  lua_State *thread;
+  struct db *db;
+};
+
+struct sort_key
+{
+  int type;
+  sqlite3_int64 integer;
+  double number;
+  const char *text;
+  size_t len;
+};
+
+struct sorted_row
+{
+  int row;
+  int nkeys;
+  struct sort_key *keys;
+};
+
+struct writer_job
+{
+  struct writer_job *next;
+  struct writer_client *client;
+  char *error;
+  const char *sql;
+  const unsigned char *params;
+  unsigned int nparams;
+};
+
+struct writer_cache
+{
+  char *sql;
+  sqlite3_stmt *stmt;
+  unsigned long used;
+};
+
+struct writer
+{
+  struct writer *next;
+  char *path;
+  int refs;
+  int batch;
+  int closing;
+  sqlite3 *handle;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  struct writer_job *head;
+  struct writer_cache cache[WRITER_CACHE];
+  unsigned long ticks;
+};
+
+struct writer_client
+{
+  struct writer *writer;
+  unsigned long pending;
+  char *error;
+};
+
+struct json_parser
+{
+  const char *start;
+  const char *pos;
+  const char *end;
+  int depth;
+};
+
+static void init_metatable(lua_State *L, const char *name,
+                           const struct luaL_Reg *methods);
 
 static int clutch_open(lua_State *L);
+static int clutch_opener(lua_State *L);
+static int clutch_writer_thread(lua_State *L);
+static int clutch_replay(lua_State *L);
 
+static int db_archive(lua_State *L);
 static int db_close(lua_State *L);
+static int db_create_collation(lua_State *L);
+static int db_detect(lua_State *L);
+static int db_hotspots(lua_State *L);
+static int db_kv(lua_State *L);
+static int db_loader(lua_State *L);
+static int db_partitioned(lua_State *L);
 static int db_prepare(lua_State *L);
 static int db_query_all(lua_State *L);
 static int db_query_one(lua_State *L);
+static int db_materialize(lua_State *L);
 static int db_query(lua_State *L);
+static int db_record(lua_State *L);
+static int db_rtree_load(lua_State *L);
+static int db_rtree_within(lua_State *L);
+static int db_statements(lua_State *L);
+static int db_strict(lua_State *L);
 static int db_tostring(lua_State *L);
 static int db_transaction(lua_State *L);
+static int db_trim(lua_State *L);
 static int db_update(lua_State *L);
+static int db_warm(lua_State *L);
 
 static int prep_stmt_all(lua_State *L);
 static int prep_stmt_close(lua_State *L);
+static int prep_stmt_insert_columns(lua_State *L);
 static int prep_stmt_iter(lua_State *L);
 static int prep_stmt_one(lua_State *L);
+static int prep_stmt_pack_all(lua_State *L);
+static int prep_stmt_pack_fetch(lua_State *L);
 static int prep_stmt_tostring(lua_State *L);
 static int prep_stmt_update(lua_State *L);
+static int prep_stmt_update_many(lua_State *L);
+static int prep_stmt_update_packed(lua_State *L);
+
+static int loader_dispatch(lua_State *L);
+static int loader_load(lua_State *L);
+
+static int materialized_refresh(lua_State *L);
+static int materialized_tostring(lua_State *L);
+
+static int kv_delete(lua_State *L);
+static int kv_get(lua_State *L);
+static int kv_get_many(lua_State *L);
+static int kv_put(lua_State *L);
+static int kv_put_many(lua_State *L);
+static int kv_scan(lua_State *L);
+static int kv_scan_iter(lua_State *L);
+static int kv_tostring(lua_State *L);
+
+static int opener_close(lua_State *L);
+static int opener_get(lua_State *L);
+static int opener_tostring(lua_State *L);
 
-static sqlite3_stmt *rebind_stmt(lua_State *L);
-static sqlite3_stmt *prepare_query(lua_State *L);
-static sqlite3_stmt *prepare_stmt(lua_State *L, sqlite3 *db);
-static int bind_stmt(lua_State *L, sqlite3_stmt *stmt, int nargs);
-static int bind_params(lua_State *L, sqlite3_stmt *stmt);
-static int bind_varargs(lua_State *L, int nargs, sqlite3_stmt *stmt);
-static int bind_lua_vars(lua_State *L, sqlite3_stmt *stmt);
-static int bind_one_param(lua_State *L, sqlite3_stmt *stmt, int index);
+static int writer_close(lua_State *L);
+static int writer_flush(lua_State *L);
+static int writer_gc(lua_State *L);
+static int writer_write(lua_State *L);
+static int writer_tostring(lua_State *L);
+
+static int partitioned_insert(lua_State *L);
+static int partitioned_partitions(lua_State *L);
+static int partitioned_retire(lua_State *L);
+static int partitioned_view(lua_State *L);
+static int partitioned_tostring(lua_State *L);
+
+static struct db *check_db(lua_State *L, int index);
+static struct db *new_db(lua_State *L);
+static struct stmt *check_stmt(lua_State *L, int index);
+static struct stmt *rebind_stmt(lua_State *L, int nargs);
+static struct stmt *prepare_query(lua_State *L);
+static struct stmt *prepare_stmt(lua_State *L, int db);
+static struct stmt *new_stmt(lua_State *L, int db, const char *sql);
+static struct stmt *alloc_stmt(lua_State *L, int db);
+static void push_stmt_db(lua_State *L, int index);
+static void init_columns(struct stmt *stmt);
+static void set_stmt_options(lua_State *L, int index, int options);
+static int same_options(lua_State *L, int a, int b);
+static void flag_columns(lua_State *L, struct stmt *stmt, int index, int flag);
+static void set_column_flag(struct stmt *stmt, int column, int flag);
+static void flag_compressed(lua_State *L, struct stmt *stmt, int index);
+static int bind_stmt(lua_State *L, struct stmt *stmt, int nargs);
+static int bind_params(lua_State *L, struct stmt *stmt);
+static int bind_varargs(lua_State *L, int nargs, struct stmt *stmt);
+static int bind_lua_vars(lua_State *L, struct stmt *stmt);
+static int bind_one_param(lua_State *L, struct stmt *stmt, int index);
 static int is_named_parameter(const char *name);
 static void find_var(lua_State *L, const char *name);
 
 static int iter(lua_State *L);
-static int step(lua_State *L, sqlite3_stmt *stmt);
-static int step_one(lua_State *L, sqlite3_stmt *stmt);
-static int step_all(lua_State *L, sqlite3_stmt *stmt);
-static void handle_row(lua_State *L, sqlite3_stmt *stmt);
-static int update(lua_State *L, sqlite3_stmt *stmt);
+static int yield_iter(lua_State *L);
+#if LUA_VERSION_NUM >= 503
+static int resume_iter(lua_State *L, int status, lua_KContext ctx);
+#else
+static int resume_iter(lua_State *L);
+#endif
+static int continue_iter(lua_State *L);
+static int step(lua_State *L, struct stmt *stmt);
+static int step_one(lua_State *L, struct stmt *stmt);
+static int step_all(lua_State *L, struct stmt *stmt);
+static void handle_row(lua_State *L, struct stmt *stmt);
+static void push_column(lua_State *L, struct stmt *stmt, int column);
+static void push_text(lua_State *L, struct stmt *stmt, int column);
+static int update(lua_State *L, struct stmt *stmt);
+static int step_stmt(struct stmt *stmt);
+static void raise_collate_error(lua_State *L, struct db *db);
+
+static struct stmt *kv_stmt(lua_State *L, int kv, const char *op);
+static void kv_write(lua_State *L, int kv, int key, int value);
+static int put_all(lua_State *L);
+static int kv_cache_get(lua_State *L, int uv, int key);
+static void kv_cache_set(lua_State *L, int uv, int key, int value);
+static void kv_cache_drop(lua_State *L, int uv, int key);
+static void opener_evict(lua_State *L, int uv, double before, int force);
+static int db_in_use(sqlite3 *handle);
+static struct writer_client *check_writer(lua_State *L, int index);
+static struct writer *writer_open(const char *path, int batch, char **error);
+static struct writer *writer_find(const char *path);
+static void writer_release(struct writer *w);
+static void writer_free(struct writer *w);
+static char *writer_wait(struct writer_client *client);
+static void writer_push(struct writer *w, struct writer_job *job);
+static void *writer_main(void *arg);
+static struct writer_job *writer_take(struct writer *w);
+static struct writer_job *writer_commit(struct writer *w,
+                                        struct writer_job *queue);
+static char *writer_run(struct writer *w, struct writer_job *job);
+static sqlite3_stmt *writer_prepare(struct writer *w, const char *sql,
+                                    char **error);
+static int is_transaction_sql(const char *sql);
+static void partition_key(char *key, time_t t, int by, int offset);
+static int partition_attach(lua_State *L, int uv, const char *key);
+static void partition_detach(lua_State *L, int uv, const char *schema);
+static int partition_retire(lua_State *L, int uv, time_t now,
+                            const char *except);
+static int partition_list(lua_State *L, int uv, const char *from,
+                          const char *to);
+static int compare_partition_key(const void *a, const void *b);
+static char *partition_insert_sql(sqlite3 *handle, const char *schema,
+                                  const char *name);
+static void exec_partition(lua_State *L, sqlite3 *handle, char *sql);
+static sqlite3_int64 pragma_int(sqlite3 *handle, const char *sql);
+static void check_materialize(lua_State *L, int group, int aggregates);
+static void build_materialize(lua_State *L, struct materialize *m,
+                              const char *name, const char *source, int group,
+                              int aggregates);
+static void add_materialize_aggregate(struct materialize *m, int fn,
+                                      const char *column, const char *source);
+static char *exec_script(sqlite3 *handle, const char *sql);
+static int warm_btree(sqlite3 *handle, const char *sql, int misses,
+                      sqlite3_int64 max_pages);
+static void read_ahead(sqlite3 *handle, sqlite3_int64 budget);
+static int cache_misses(sqlite3 *handle);
+static int insert_columns(lua_State *L);
+static int insert_rtree(lua_State *L);
+static char *rtree_sql(sqlite3 *handle, const char *table, int within,
+                       int *dims);
+static struct stmt *rtree_stmt(lua_State *L, int db, const char *table);
+static void str_sort(struct rtree_entry *entries, size_t n, int dim, int dims,
+                     size_t capacity);
+static int compare_rtree_entry(const void *a, const void *b);
+static int update_many(lua_State *L);
+static int update_packed(lua_State *L);
+static void sort_rows(lua_State *L, int rows, int by);
+static void set_sort_key(lua_State *L, struct sort_key *key);
+static int compare_sorted_row(const void *a, const void *b);
+static int in_savepoint(lua_State *L, lua_CFunction f);
+
+static void parse_pack_format(lua_State *L, const char *fmt,
+                              struct pack_format *format);
+static int read_pack_size(const char **fmt, int size);
+static void check_pack_columns(lua_State *L, struct stmt *stmt,
+                               struct pack_format *format);
+static int pack_iter(lua_State *L);
+static int pack_rows(lua_State *L, struct stmt *stmt,
+                     struct pack_format *format, lua_Integer limit);
+static void pack_column(lua_State *L, struct buffer *b, struct stmt *stmt,
+                        int column, struct pack_item *item);
+static int is_little_endian(void);
+static size_t pack_padding(size_t pos, int align);
+static sqlite3_uint64 unpack_int(const unsigned char *p, int size, int little,
+                                 int is_signed);
+static void pack_int(unsigned char *p, sqlite3_uint64 value, int size,
+                     int little);
+
+static void close_sqlite(struct db *db);
+static void close_sqlite_stmt(struct stmt *stmt);
+static void touch_stmt(struct stmt *stmt);
 
-static void close_sqlite(sqlite3 **db);
-static void close_sqlite_stmt(sqlite3_stmt **stmt);
+static int is_yieldable(lua_State *L);
+static int resume_thread(lua_State *L, lua_State *co, int nargs);
+
+static int loader_fetch_all(lua_State *L);
+static void loader_fetch(lua_State *L, int loader, int keys);
+static void loader_fetch_chunk(lua_State *L, int loader, int keys, int first,
+                               int count, int rows);
+static const char *find_placeholder(const char *sql);
+
+static void detect_stmt(lua_State *L, int index);
+static int sweep_detect(lua_State *L, int detect, double before);
+static void report_hotspot(lua_State *L, int entry);
+static void push_fingerprint(lua_State *L, const char *sql);
+static void add_fingerprint_param(lua_State *L, struct buffer *b);
+static void push_call_site(lua_State *L);
+static double now_ms(void);
+
+static void check_strict(lua_State *L, int index);
+static void push_strict_verdict(lua_State *L, struct stmt *stmt, int strict);
+static sqlite3_int64 strict_table_rows(lua_State *L, sqlite3 *handle,
+                                       int strict, struct strict_cursor *c);
+static int is_dml(const char *sql);
+
+static void record_stop(struct db *db);
+static int record_trace(unsigned type, void *ctx, void *p, void *x);
+static sqlite3_uint64 record_define(struct recorder *r, const char *sql);
+static size_t record_slot(struct recorder *r, sqlite3_stmt *handle);
+static struct record_params *record_find(struct recorder *r,
+                                         sqlite3_stmt *handle, int create);
+static void record_begin(struct stmt *stmt);
+static void record_param(struct stmt *stmt, int index, char type,
+                         const void *data, size_t len);
+static void record_forget(struct stmt *stmt);
+static int record_reserve(unsigned char **data, size_t *size, size_t n);
+static void parse_replay(lua_State *L, const unsigned char *data, size_t len,
+                         struct replay *replay);
+static int compare_replay_stmt(const void *a, const void *b);
+static void *replay_worker(void *arg);
+static int replay_event(sqlite3 *handle, sqlite3_stmt **prepared,
+                        struct replay_stmt *stmt, struct replay_event *event);
+static int bind_packed(sqlite3_stmt *s, const unsigned char *p,
+                       unsigned int nparams);
+static void push_percentiles(lua_State *L, double *values, size_t n);
+static int compare_double(const void *a, const void *b);
+
+static void buffer_init(lua_State *L, struct buffer *b);
+static void buffer_reserve(lua_State *L, struct buffer *b, size_t n);
+static void buffer_add(lua_State *L, struct buffer *b, const char *s, size_t n);
+static void buffer_addchar(lua_State *L, struct buffer *b, char c);
+static void buffer_push(lua_State *L, struct buffer *b);
+
+static void json_encode(lua_State *L, int index);
+static void json_encode_value(lua_State *L, struct buffer *b, int index,
+                              int depth);
+static void json_encode_string(lua_State *L, struct buffer *b, int index);
+static void json_encode_table(lua_State *L, struct buffer *b, int index,
+                              int depth);
+static int json_is_array(lua_State *L, int index);
+static void json_decode(lua_State *L, const char *text, size_t len);
+static void json_decode_value(lua_State *L, struct json_parser *p);
+static void json_decode_object(lua_State *L, struct json_parser *p);
+static void json_decode_array(lua_State *L, struct json_parser *p);
+static void json_decode_string(lua_State *L, struct json_parser *p);
+static void json_decode_number(lua_State *L, struct json_parser *p);
+static void json_decode_literal(lua_State *L, struct json_parser *p,
+                                const char *literal);
+static unsigned long json_decode_hex(lua_State *L, struct json_parser *p);
+static void json_add_utf8(luaL_Buffer *b, unsigned long code);
+static void json_skip_space(struct json_parser *p);
+static int json_error(lua_State *L, struct json_parser *p, const char *msg);
+
+static void register_functions(sqlite3 *handle);
+static void sql_compress(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void sql_decompress(sqlite3_context *ctx, int argc,
+                           sqlite3_value **argv);
+static int is_compressed(const void *data, size_t len);
+static unsigned char *compress_value(const void *data, size_t len, char type,
+                                     int level, size_t *outlen);
+static unsigned char *decompress_value(const void *data, size_t len,
+                                       size_t *outlen);
+
+static void quantile_step(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void quantile_inverse(sqlite3_context *ctx, int argc,
+                             sqlite3_value **argv);
+static void quantile_value(sqlite3_context *ctx);
+static void tdigest_merge(struct tdigest *td);
+static int centroid_compare(const void *a, const void *b);
+static void hll_step(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void hll_inverse(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void hll_value(sqlite3_context *ctx);
+static void hll_final(sqlite3_context *ctx);
+static sqlite3_uint64 hll_hash(sqlite3_value *value);
+static void hll_expire(struct hll *hll, int reg);
+static void histogram_step(sqlite3_context *ctx, int argc,
+                           sqlite3_value **argv);
+static void histogram_inverse(sqlite3_context *ctx, int argc,
+                              sqlite3_value **argv);
+static void histogram_value(sqlite3_context *ctx);
+static int histogram_bounds(struct histogram *h, const char *json);
+static int histogram_bucket(struct histogram *h, double x);
+
+static void sql_regexp(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static void free_regex(void *regex);
+
+static int collate_lua(void *arg, int len1, const void *s1, int len2,
+                       const void *s2);
+static int collate_unicode_nocase(void *arg, int len1, const void *s1,
+                                  int len2, const void *s2);
+static int collate_natural(void *arg, int len1, const void *s1, int len2,
+                           const void *s2);
+static unsigned long decode_utf8(const unsigned char **pos,
+                                 const unsigned char *end);
+static unsigned long fold_case(unsigned long c);
+
+static void init_vec_kernels(void);
+static void sql_vec(sqlite3_context *ctx, int argc, sqlite3_value **argv);
+static const void *vec_value(sqlite3_value *value, size_t *n,
+                             const char **error);
+static double vec_score(int metric, const void *a, const void *b, size_t n);
+static float vec_dot_scalar(const void *a, const void *b, size_t n);
+static float vec_l2_scalar(const void *a, const void *b, size_t n);
+#ifdef VEC_X86
+VEC_TARGET("sse") static float vec_dot_sse(const void *a, const void *b,
+                                           size_t n);
+VEC_TARGET("sse") static float vec_l2_sse(const void *a, const void *b,
+                                          size_t n);
+VEC_TARGET("avx2,fma") static float vec_dot_avx2(const void *a,
+                                                 const void *b, size_t n);
+VEC_TARGET("avx2,fma") static float vec_l2_avx2(const void *a, const void *b,
+                                                size_t n);
+#endif
+static int vec_topk_connect(sqlite3 *db, void *aux, int argc,
+                            const char *const *argv, sqlite3_vtab **vtab,
+                            char **error);
+static int vec_topk_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info);
+static int vec_topk_disconnect(sqlite3_vtab *vtab);
+static int vec_topk_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor);
+static int vec_topk_close(sqlite3_vtab_cursor *cursor);
+static int vec_topk_filter(sqlite3_vtab_cursor *cursor, int index,
+                           const char *index_str, int argc,
+                           sqlite3_value **argv);
+static int vec_topk_scan(struct vec_topk_cursor *cursor, sqlite3_stmt *stmt,
+                         int metric, const void *query, size_t n,
+                         sqlite3_int64 k);
+static void vec_heap_push(struct vec_hit *heap, int *count, int k,
+                          struct vec_hit hit);
+static int vec_hit_compare(const void *a, const void *b);
+static int vec_topk_next(sqlite3_vtab_cursor *cursor);
+static int vec_topk_eof(sqlite3_vtab_cursor *cursor);
+static int vec_topk_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx,
+                           int column);
+static int vec_topk_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid);
+
+static int write_archive(sqlite3 *handle, FILE *out, sqlite3_int64 *size);
+static void register_archive_vfs(void);
+static int archive_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file,
+                        int flags, int *out_flags);
+static int archive_load_map(struct archive_file *file);
+static int archive_load_page(struct archive_file *file, sqlite3_int64 page);
+static int archive_close(sqlite3_file *file);
+static int archive_read(sqlite3_file *file, void *buf, int amount,
+                        sqlite3_int64 offset);
+static int archive_write(sqlite3_file *file, const void *buf, int amount,
+                         sqlite3_int64 offset);
+static int archive_truncate(sqlite3_file *file, sqlite3_int64 size);
+static int archive_sync(sqlite3_file *file, int flags);
+static int archive_file_size(sqlite3_file *file, sqlite3_int64 *size);
+static int archive_lock(sqlite3_file *file, int lock);
+static int archive_unlock(sqlite3_file *file, int lock);
+static int archive_check_reserved_lock(sqlite3_file *file, int *out);
+static int archive_file_control(sqlite3_file *file, int op, void *arg);
+static int archive_sector_size(sqlite3_file *file);
+static int archive_device_characteristics(sqlite3_file *file);
+static int archive_delete(sqlite3_vfs *vfs, const char *name, int sync);
+static int archive_access(sqlite3_vfs *vfs, const char *name, int flags,
+                          int *out);
+static int archive_full_pathname(sqlite3_vfs *vfs, const char *name, int n,
+                                 char *out);
+static void *archive_dlopen(sqlite3_vfs *vfs, const char *name);
+static void archive_dlerror(sqlite3_vfs *vfs, int n, char *msg);
+static void (*archive_dlsym(sqlite3_vfs *vfs, void *lib,
+                            const char *sym))(void);
+static void archive_dlclose(sqlite3_vfs *vfs, void *lib);
+static int archive_randomness(sqlite3_vfs *vfs, int n, char *out);
+static int archive_sleep(sqlite3_vfs *vfs, int usec);
+static int archive_current_time(sqlite3_vfs *vfs, double *now);
+static int archive_get_last_error(sqlite3_vfs *vfs, int n, char *msg);
+static int archive_current_time_int64(sqlite3_vfs *vfs, sqlite3_int64 *now);
+static void put_u32(unsigned char *p, sqlite3_uint64 v);
+static void put_u64(unsigned char *p, sqlite3_uint64 v);
+static unsigned int get_u32(const unsigned char *p);
+static sqlite3_uint64 get_u64(const unsigned char *p);
 
 static const struct luaL_Reg clutch_funcs[] = {{"open", clutch_open},
+                                               {"opener", clutch_opener},
+                                               {"replay", clutch_replay},
+                                               {"writerthread",
+                                                clutch_writer_thread},
                                                {NULL, NULL}};
 
 static const struct luaL_Reg clutch_db_methods[] = {
-    {"close", db_close}, {"prepare", db_prepare}, {"query", db_query}, {"queryall", db_query_all}, {"queryone", db_query_one}, {"transaction", db_transaction}, {"update", db_update}, {"__gc", db_close}, {"__tostring", db_tostring}, {NULL, NULL}};
+    {"archive", db_archive},
+    {"close", db_close},
+    {"createcollation", db_create_collation},
+    {"detect", db_detect},
+    {"hotspots", db_hotspots},
+    {"kv", db_kv},
+    {"loader", db_loader},
+    {"materialize", db_materialize},
+    {"partitioned", db_partitioned},
+    {"prepare", db_prepare},
+    {"query", db_query},
+    {"queryall", db_query_all},
+    {"queryone", db_query_one},
+    {"record", db_record},
+    {"rtreeload", db_rtree_load},
+    {"rtreewithin", db_rtree_within},
+    {"statements", db_statements},
+    {"strict", db_strict},
+    {"transaction", db_transaction},
+    {"trim", db_trim},
+    {"update", db_update},
+    {"warm", db_warm},
+    {"__gc", db_close},
+    {"__tostring", db_tostring},
+    {NULL, NULL}};
 
 static const struct luaL_Reg clutch_stmt_methods[] = {
+    {"insertcolumns", prep_stmt_insert_columns},
+    {"packall", prep_stmt_pack_all},
+    {"packfetch", prep_stmt_pack_fetch},
     {"query", prep_stmt_iter},
     {"queryall", prep_stmt_all},
     {"queryone", prep_stmt_one},
     {"update", prep_stmt_update},
+    {"updatemany", prep_stmt_update_many},
+    {"updatepacked", prep_stmt_update_packed},
     {"__gc", prep_stmt_close},
     {"__tostring", prep_stmt_tostring},
     {NULL, NULL}};
 
+static const struct luaL_Reg clutch_loader_methods[] = {
+    {"dispatch", loader_dispatch}, {"load", loader_load}, {NULL, NULL}};
+
+static const struct luaL_Reg clutch_materialized_methods[] = {
+    {"refresh", materialized_refresh},
+    {"__tostring", materialized_tostring},
+    {NULL, NULL}};
+
+static const struct luaL_Reg clutch_kv_methods[] = {
+    {"delete", kv_delete},   {"get", kv_get},       {"getmany", kv_get_many},
+    {"put", kv_put},         {"putmany", kv_put_many}, {"scan", kv_scan},
+    {"__tostring", kv_tostring}, {NULL, NULL}};
+
+static const struct luaL_Reg clutch_opener_methods[] = {
+    {"close", opener_close},
+    {"get", opener_get},
+    {"__tostring", opener_tostring},
+    {NULL, NULL}};
+
+static const struct luaL_Reg clutch_writer_methods[] = {
+    {"close", writer_close},
+    {"flush", writer_flush},
+    {"write", writer_write},
+    {"__gc", writer_gc},
+    {"__tostring", writer_tostring},
+    {NULL, NULL}};
+
+static const struct luaL_Reg clutch_partitioned_methods[] = {
+    {"insert", partitioned_insert},
+    {"partitions", partitioned_partitions},
+    {"retire", partitioned_retire},
+    {"view", partitioned_view},
+    {"__tostring", partitioned_tostring},
+    {NULL, NULL}};
+
+static const char *const partition_units[] = {"hour", "day", "month", NULL};
+
+static const char attached_count[] =
+    "SELECT count(*) FROM pragma_database_list "
+    "WHERE name NOT IN ('main', 'temp')";
+
+static const char *const materialize_funcs[] = {"count", "sum", "min", "max",
+                                                NULL};
+
+static const sqlite3_io_methods archive_io_methods = {
+    1,
+    archive_close,
+    archive_read,
+    archive_write,
+    archive_truncate,
+    archive_sync,
+    archive_file_size,
+    archive_lock,
+    archive_unlock,
+    archive_check_reserved_lock,
+    archive_file_control,
+    archive_sector_size,
+    archive_device_characteristics,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+    NULL};
+
+static float (*vec_dot)(const void *, const void *, size_t) = vec_dot_scalar;
+static float (*vec_l2)(const void *, const void *, size_t) = vec_l2_scalar;
+
+static const char *vec_metrics[] = {"dot", "cosine", "l2", NULL};
+
+/* Writer threads are shared by every Lua state in the process and looked up
+ * by the full path of their database. */
+static struct writer *writers = NULL;
+static pthread_mutex_t writers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sqlite3_module vec_topk_module = {0,
+                                         NULL,
+                                         vec_topk_connect,
+                                         vec_topk_best_index,
+                                         vec_topk_disconnect,
+                                         NULL,
+                                         vec_topk_open,
+                                         vec_topk_close,
+                                         vec_topk_filter,
+                                         vec_topk_next,
+                                         vec_topk_eof,
+                                         vec_topk_column,
+                                         vec_topk_rowid,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL,
+                                         NULL};
+
+static sqlite3_vfs archive_vfs = {2,
+                                  0,
+                                  0,
+                                  NULL,
+                                  ARCHIVE_VFS,
+                                  NULL,
+                                  archive_open,
+                                  archive_delete,
+                                  archive_access,
+                                  archive_full_pathname,
+                                  archive_dlopen,
+                                  archive_dlerror,
+                                  archive_dlsym,
+                                  archive_dlclose,
+                                  archive_randomness,
+                                  archive_sleep,
+                                  archive_current_time,
+                                  archive_get_last_error,
+                                  archive_current_time_int64,
+                                  NULL,
+                                  NULL,
+                                  NULL};
+
+sqlite3 *clutch_checkdb(lua_State *L, int index)
+{
+  return check_db(L, index)->handle;
+}
+
+sqlite3_stmt *clutch_checkstmt(lua_State *L, int index)
+{
+  return check_stmt(L, index)->handle;
+}
+
+int clutch_bind(lua_State *L, sqlite3_stmt *handle, int first)
+{
+  struct stmt stmt;
+  memset(&stmt, 0, sizeof(stmt));
+  stmt.handle = handle;
+  stmt.compress_min = COMPRESS_MIN;
+  sqlite3_reset(handle);
+  return bind_stmt(L, &stmt, lua_absindex(L, first) - 1);
+}
+
+void clutch_pushrow(lua_State *L, sqlite3_stmt *handle)
+{
+  struct stmt stmt;
+  memset(&stmt, 0, sizeof(stmt));
+  stmt.handle = handle;
+  stmt.compress_min = COMPRESS_MIN;
+  handle_row(L, &stmt);
+}
+
+void clutch_pushdb(lua_State *L, sqlite3 *handle)
+{
+  struct db *db = new_db(L);
+  db->handle = handle;
+  register_functions(handle);
+}
+
+void clutch_pushstmt(lua_State *L, int db, sqlite3_stmt *handle)
+{
+  /* Finalize the statement before raising, as the caller cannot. */
+  struct db *owner = (struct db *)luaL_testudata(L, db, "sqlite3.db");
+  if (!owner || !owner->handle || owner->handle != sqlite3_db_handle(handle))
+  {
+    sqlite3_finalize(handle);
+    check_db(L, db);
+    luaL_argerror(L, db, "statement belongs to another connection");
+  }
+
+  struct stmt *stmt = alloc_stmt(L, db);
+  stmt->handle = handle;
+  init_columns(stmt);
+}
+
 int luaopen_clutch(lua_State *L)
 {
-  init_db_metatable(L);
-  init_statement_metatable(L);
+  init_metatable(L, "sqlite3.db", clutch_db_methods);
+  init_metatable(L, "sqlite3.stmt", clutch_stmt_methods);
+  init_metatable(L, "sqlite3.loader", clutch_loader_methods);
+  init_metatable(L, "sqlite3.materialized", clutch_materialized_methods);
+  init_metatable(L, "sqlite3.kv", clutch_kv_methods);
+  init_metatable(L, "sqlite3.partitioned", clutch_partitioned_methods);
+  init_metatable(L, "sqlite3.opener", clutch_opener_methods);
+  init_metatable(L, "sqlite3.writer", clutch_writer_methods);
+
+  register_archive_vfs();
+  init_vec_kernels();
 
   luaL_newlib(L, clutch_funcs);
   return 1;
 }
 
-static void init_db_metatable(lua_State *L)
+static void init_metatable(lua_State *L, const char *name,
+                           const struct luaL_Reg *methods)
 {
-  luaL_newmetatable(L, "sqlite3.db");
+  luaL_newmetatable(L, name);
 
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
 
-  luaL_setfuncs(L, clutch_db_methods, 0);
+  luaL_setfuncs(L, methods, 0);
+  lua_pop(L, 1);
 }
 
-static void init_statement_metatable(lua_State *L)
+static int clutch_open(lua_State *L)
 {
-  luaL_newmetatable(L, "sqlite3.stmt");
+  const char *filename = luaL_checkstring(L, 1);
+  const char *vfs = NULL;
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
 
-  lua_pushvalue(L, -1);
-  lua_setfield(L, -2, "__index");
+  if (!lua_isnoneornil(L, 2))
+  {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "vfs");
+    vfs = lua_tostring(L, -1);
+    lua_getfield(L, 2, "readonly");
+    if (lua_toboolean(L, -1))
+      flags = SQLITE_OPEN_READONLY;
+    lua_pop(L, 2);
+    if (vfs && !sqlite3_vfs_find(vfs))
+      return luaL_error(L, "no such vfs: %s", vfs);
+  }
+
+  struct db *db = new_db(L);
+  if (sqlite3_open_v2(filename, &db->handle, flags, vfs) != SQLITE_OK)
+  {
+    lua_pushfstring(L, "%s: %s", filename, sqlite3_errmsg(db->handle));
+    close_sqlite(db);
+    return lua_error(L);
+  }
+  register_functions(db->handle);
+  return 1;
+}
+
+static int clutch_opener(lua_State *L)
+{
+  lua_Integer max_open = 64;
+  lua_Number idle_ms = 0;
+
+  lua_settop(L, 1);
+  if (!lua_isnil(L, 1))
+  {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "max_open");
+    lua_getfield(L, 1, "idle_ms");
+    max_open = luaL_optinteger(L, 2, max_open);
+    idle_ms = luaL_optnumber(L, 3, 0);
+    luaL_argcheck(L, max_open > 0, 1, "max_open must be positive");
+    luaL_argcheck(L, idle_ms >= 0, 1, "idle_ms must not be negative");
+    lua_settop(L, 1);
+  }
+
+  lua_newuserdata(L, 0);
+  luaL_getmetatable(L, "sqlite3.opener");
+  lua_setmetatable(L, -2);
 
-  luaL_setfuncs(L, clutch_stmt_methods, 0);
+  lua_createtable(L, 0, 7);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "options");
+  lua_newtable(L);
+  lua_setfield(L, -2, "dbs");
+  lua_newtable(L);
+  lua_setfield(L, -2, "used");
+  lua_pushinteger(L, 0);
+  lua_setfield(L, -2, "count");
+  lua_pushinteger(L, max_open);
+  lua_setfield(L, -2, "max_open");
+  lua_pushnumber(L, idle_ms);
+  lua_setfield(L, -2, "idle_ms");
+  lua_pushnumber(L, now_ms());
+  lua_setfield(L, -2, "swept");
+  lua_setuservalue(L, -2);
+  return 1;
 }
 
-static int clutch_open(lua_State *L)
+static int clutch_replay(lua_State *L)
 {
-  const char *filename = luaL_checkstring(L, 1);
+  const char *path = luaL_checkstring(L, 1);
+  struct db *db = check_db(L, 2);
+  double speed = 0;
+  int threads = 1;
 
-  sqlite3 **db = (sqlite3 **)lua_newuserdata(L, sizeof(sqlite3 *));
-  *db = NULL;
+  lua_settop(L, 3);
+  if (!lua_isnil(L, 3))
+  {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "speed");
+    lua_getfield(L, 3, "threads");
+    speed = luaL_optnumber(L, 4, 0);
+    threads = (int)luaL_optinteger(L, 5, 1);
+    luaL_argcheck(L, speed >= 0, 3, "speed must not be negative");
+    luaL_argcheck(L, threads > 0, 3, "threads must be positive");
+    lua_settop(L, 3);
+  }
 
-  luaL_getmetatable(L, "sqlite3.db");
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return luaL_error(L, "cannot open %s", path);
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  unsigned char *data =
+      (unsigned char *)lua_newuserdata(L, size > 0 ? (size_t)size : 1);
+  size_t len = size > 0 ? fread(data, 1, (size_t)size, file) : 0;
+  fclose(file);
+
+  struct replay replay;
+  memset(&replay, 0, sizeof(replay));
+  parse_replay(L, data, len, &replay);
+  replay.latencies = (double *)lua_newuserdata(
+      L, (replay.nevents ? replay.nevents : 1) * sizeof(double));
+  replay.speed = speed;
+  replay.threads = threads;
+
+  struct replay_worker *workers = (struct replay_worker *)lua_newuserdata(
+      L, threads * sizeof(struct replay_worker));
+  memset(workers, 0, threads * sizeof(struct replay_worker));
+  for (int i = 0; i < threads; ++i)
+  {
+    workers[i].replay = &replay;
+    workers[i].index = i;
+  }
+
+  if (threads == 1)
+  {
+    workers[0].handle = db->handle;
+    replay.start = now_ms();
+    replay_worker(&workers[0]);
+  }
+  else
+  {
+    const char *filename = sqlite3_db_filename(db->handle, "main");
+    if (!filename || !*filename)
+      return luaL_error(L, "cannot replay a temporary or in-memory database "
+                           "with more than one thread");
+
+    for (int i = 0; i < threads; ++i)
+    {
+      if (sqlite3_open_v2(filename, &workers[i].handle,
+                          SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX,
+                          NULL) != SQLITE_OK)
+      {
+        lua_pushstring(L, sqlite3_errmsg(workers[i].handle));
+        for (int j = 0; j <= i; ++j)
+          sqlite3_close_v2(workers[j].handle);
+        return lua_error(L);
+      }
+      sqlite3_busy_timeout(workers[i].handle, 5000);
+      register_functions(workers[i].handle);
+    }
+
+    replay.start = now_ms();
+    int *started = (int *)lua_newuserdata(L, threads * sizeof(int));
+    for (int i = 0; i < threads; ++i)
+      started[i] = !pthread_create(&workers[i].thread, NULL, replay_worker,
+                                   &workers[i]);
+    for (int i = 0; i < threads; ++i)
+    {
+      if (started[i])
+        pthread_join(workers[i].thread, NULL);
+      else
+        replay_worker(&workers[i]);
+      sqlite3_close_v2(workers[i].handle);
+    }
+  }
+  double elapsed = now_ms() - replay.start;
+
+  int errors = 0;
+  for (int i = 0; i < threads; ++i)
+    errors += workers[i].errors;
+
+  lua_createtable(L, 0, 5);
+  lua_pushinteger(L, replay.nevents);
+  lua_setfield(L, -2, "count");
+  lua_pushinteger(L, errors);
+  lua_setfield(L, -2, "errors");
+  lua_pushnumber(L, elapsed);
+  lua_setfield(L, -2, "ms");
+  push_percentiles(L, replay.latencies, replay.nevents);
+  lua_setfield(L, -2, "latency");
+  for (size_t i = 0; i < replay.nevents; ++i)
+    replay.latencies[i] = replay.events[i].duration_ns / 1e6;
+  push_percentiles(L, replay.latencies, replay.nevents);
+  lua_setfield(L, -2, "recorded");
+  return 1;
+}
+
+static int clutch_writer_thread(lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  lua_Integer batch = WRITER_BATCH;
+  int given = 0;
+  if (!lua_isnoneornil(L, 2))
+  {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "batch");
+    given = !lua_isnil(L, -1);
+    batch = luaL_optinteger(L, -1, batch);
+    luaL_argcheck(L, batch > 0 && batch <= INT_MAX, 2,
+                  "batch must be positive");
+    lua_pop(L, 1);
+  }
+
+  struct writer_client *client = (struct writer_client *)lua_newuserdata(
+      L, sizeof(struct writer_client));
+  memset(client, 0, sizeof(*client));
+  luaL_getmetatable(L, "sqlite3.writer");
   lua_setmetatable(L, -2);
 
-  if (sqlite3_open(filename, db) != SQLITE_OK)
+  char resolved[PATH_MAX];
+  char *error = NULL;
+  struct writer *fresh = NULL;
+
+  pthread_mutex_lock(&writers_lock);
+  struct writer *w = realpath(path, resolved) ? writer_find(resolved) : NULL;
+  if (!w)
+  {
+    /* Open the connection without holding the lock, then look again in case
+     * another handle started a writer for the file meanwhile. */
+    pthread_mutex_unlock(&writers_lock);
+    fresh = writer_open(path, (int)batch, &error);
+    pthread_mutex_lock(&writers_lock);
+    if (fresh && !(w = writer_find(fresh->path)))
+    {
+      if (pthread_create(&fresh->thread, NULL, writer_main, fresh) == 0)
+      {
+        fresh->next = writers;
+        writers = w = fresh;
+        fresh = NULL;
+      }
+      else
+        error = sqlite3_mprintf("cannot start writer thread for %s",
+                                fresh->path);
+    }
+  }
+
+  /* The batch size is fixed by the first handle for a file, so a handle
+   * asking for another one gets an error. */
+  if (w && given && w->batch != batch)
+  {
+    error = sqlite3_mprintf("writer for %s already runs with batch %d", w->path,
+                            w->batch);
+    w = NULL;
+  }
+  if (w)
+    w->refs++;
+  pthread_mutex_unlock(&writers_lock);
+  if (fresh)
+    writer_free(fresh);
+
+  if (!w)
+  {
+    lua_pushstring(L, error ? error : "out of memory");
+    sqlite3_free(error);
+    return lua_error(L);
+  }
+  client->writer = w;
+  return 1;
+}
+
+static int db_archive(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+
+  const char *filename = sqlite3_db_filename(db->handle, "main");
+  if (!filename || !*filename)
+    return luaL_error(L, "cannot archive a temporary or in-memory database");
+  if (!sqlite3_get_autocommit(db->handle))
+    return luaL_error(L, "cannot archive inside a transaction");
+
+  /* Pages are read directly from the database file, so move any committed
+   * changes out of the write-ahead log first. */
+  if (sqlite3_wal_checkpoint_v2(db->handle, "main",
+                                SQLITE_CHECKPOINT_TRUNCATE, NULL,
+                                NULL) != SQLITE_OK)
+    return luaL_error(L, "%s", sqlite3_errmsg(db->handle));
+
+  /* A writer may have committed since the checkpoint, so check that the log
+   * is still empty once the read transaction holds the snapshot. */
+  struct stat wal;
+  if (sqlite3_exec(db->handle, "BEGIN; SELECT count(*) FROM main.sqlite_master",
+                   NULL, NULL, NULL) != SQLITE_OK)
+  {
+    lua_pushstring(L, sqlite3_errmsg(db->handle));
+    sqlite3_exec(db->handle, "ROLLBACK", NULL, NULL, NULL);
+    return lua_error(L);
+  }
+  if (!stat(sqlite3_filename_wal(filename), &wal) && wal.st_size > 0)
+  {
+    sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+    return luaL_error(L, "cannot archive while the write-ahead log has "
+                         "changes that are not checkpointed");
+  }
+
+  FILE *out = fopen(path, "wb");
+  if (!out)
+  {
+    sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+    return luaL_error(L, "%s: cannot open file for writing", path);
+  }
+
+  sqlite3_int64 size = 0;
+  int status = write_archive(db->handle, out, &size);
+  sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+  if (fclose(out) && status == SQLITE_OK)
+    status = SQLITE_IOERR;
+
+  if (status != SQLITE_OK)
+  {
+    remove(path);
+    return luaL_error(L, "%s: %s", path, sqlite3_errstr(status));
+  }
+  lua_pushinteger(L, size);
+  return 1;
+}
+
+static int db_warm(lua_State *L)
+{
+  sqlite3 *handle = check_db(L, 1)->handle;
+  int indexes = 0, readahead = 1;
+  sqlite3_int64 budget = -1;
+
+  lua_settop(L, 2);
+  lua_pushnil(L);
+  if (!lua_isnil(L, 2))
+  {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "tables");
+    if (!lua_isnil(L, -1))
+    {
+      luaL_argcheck(L, lua_istable(L, -1), 2, "tables is not a table");
+      lua_newtable(L);
+      lua_replace(L, 3);
+      for (int i = 1; lua_rawgeti(L, -1, i), !lua_isnil(L, -1); ++i)
+      {
+        luaL_argcheck(L, lua_isstring(L, -1), 2, "table name is not a string");
+        char *sql = sqlite3_mprintf("SELECT count(*) FROM main.sqlite_master "
+                                    "WHERE type = 'table' AND name = %Q",
+                                    lua_tostring(L, -1));
+        int found = sql && pragma_int(handle, sql) > 0;
+        sqlite3_free(sql);
+        if (!found)
+          return luaL_error(L, "no such table: %s", lua_tostring(L, -1));
+        lua_pushboolean(L, 1);
+        lua_rawset(L, 3);
+      }
+    }
+    lua_settop(L, 3);
+
+    lua_getfield(L, 2, "indexes");
+    indexes = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "readahead");
+    readahead = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_getfield(L, 2, "max_bytes");
+    if (!lua_isnil(L, -1))
+      budget = (sqlite3_int64)luaL_checknumber(L, -1);
+    lua_settop(L, 3);
+  }
+
+  double start = now_ms();
+  int page_size = (int)pragma_int(handle, "PRAGMA main.page_size");
+  if (readahead)
+    read_ahead(handle, budget);
+
+  sqlite3_stmt *schema;
+  int status = sqlite3_prepare_v2(
+      handle,
+      "SELECT type, name, tbl_name FROM main.sqlite_master "
+      "WHERE type IN ('table', 'index') AND rootpage > 0 ORDER BY rootpage",
+      -1, &schema, NULL);
+  if (status != SQLITE_OK)
+    return luaL_error(L, "%s", sqlite3_errmsg(handle));
+
+  int misses = cache_misses(handle);
+  int btrees = 0;
+  while (status == SQLITE_OK && (status = sqlite3_step(schema)) == SQLITE_ROW)
+  {
+    status = SQLITE_OK;
+    const char *type = (const char *)sqlite3_column_text(schema, 0);
+    const char *name = (const char *)sqlite3_column_text(schema, 1);
+    const char *table = (const char *)sqlite3_column_text(schema, 2);
+
+    if (lua_istable(L, 3))
+    {
+      lua_getfield(L, 3, table);
+      int wanted = lua_toboolean(L, -1);
+      lua_pop(L, 1);
+      if (!wanted)
+        continue;
+    }
+
+    char *sql;
+    if (type[0] == 't')
+      sql = sqlite3_mprintf("SELECT 1 FROM main.\"%w\" NOT INDEXED", name);
+    else if (indexes)
+      sql = sqlite3_mprintf("SELECT 1 FROM main.\"%w\" INDEXED BY \"%w\"",
+                            table, name);
+    else
+      continue;
+
+    status = warm_btree(handle, sql, misses,
+                        budget >= 0 ? budget / page_size : -1);
+    sqlite3_free(sql);
+    btrees++;
+  }
+  if (status != SQLITE_OK && status != SQLITE_DONE)
+  {
+    lua_pushstring(L, sqlite3_errmsg(handle));
+    sqlite3_finalize(schema);
+    return luaL_error(L, "warm: %s", lua_tostring(L, -1));
+  }
+  sqlite3_finalize(schema);
+
+  sqlite3_int64 pages = cache_misses(handle) - misses;
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, btrees);
+  lua_setfield(L, -2, "btrees");
+  lua_pushinteger(L, pages);
+  lua_setfield(L, -2, "pages");
+  lua_pushinteger(L, pages * page_size);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, now_ms() - start);
+  lua_setfield(L, -2, "ms");
+  return 1;
+}
+
+static int db_materialize(lua_State *L)
+{
+  sqlite3 *handle = check_db(L, 1)->handle;
+  const char *name = luaL_checkstring(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+
+  lua_getfield(L, 3, "source");
+  lua_getfield(L, 3, "group");
+  lua_getfield(L, 3, "aggregates");
+  luaL_argcheck(L, lua_type(L, 4) == LUA_TSTRING, 3, "source is not a string");
+  check_materialize(L, 5, 6);
+
+  struct materialize m;
+  for (int i = 0; i < MATERIALIZE_PARTS; ++i)
+    m.parts[i] = sqlite3_str_new(handle);
+  build_materialize(L, &m, name, lua_tostring(L, 4), 5, 6);
+
+  char *parts[MATERIALIZE_PARTS];
+  for (int i = 0; i < MATERIALIZE_PARTS; ++i)
+  {
+    char *part = sqlite3_str_finish(m.parts[i]);
+    parts[i] = part ? part : sqlite3_mprintf("");
+  }
+
+  char *refresh = sqlite3_mprintf(
+      "DELETE FROM \"%w\";"
+      "INSERT INTO \"%w\" (%s%s) SELECT count(*)%s%s FROM \"%w\"%s%s;"
+      "DELETE FROM \"%w\" WHERE \"count\" = 0;",
+      name, name, parts[PART_KEYS], parts[PART_TARGETS], parts[PART_SELECT_KEYS],
+      parts[PART_SELECT], lua_tostring(L, 4), *parts[PART_GROUP_BY] ? " GROUP BY " : "",
+      parts[PART_GROUP_BY], name);
+
+  /* The triggers are created without IF NOT EXISTS so that their text in
+   * sqlite_master matches what is generated here, which is how an existing
+   * summary table is checked against the requested spec. */
+  char *triggers[3];
+  triggers[0] = sqlite3_mprintf(
+      "CREATE TRIGGER \"%w_insert\" AFTER INSERT ON \"%w\" BEGIN %s %s END",
+      name, lua_tostring(L, 4), parts[PART_ENSURE], parts[PART_ADD]);
+  triggers[1] = sqlite3_mprintf(
+      "CREATE TRIGGER \"%w_delete\" AFTER DELETE ON \"%w\" BEGIN %s %s END",
+      name, lua_tostring(L, 4), parts[PART_REMOVE], parts[PART_PRUNE]);
+  triggers[2] = sqlite3_mprintf(
+      "CREATE TRIGGER \"%w_update\" AFTER UPDATE ON \"%w\" "
+      "BEGIN %s %s %s %s END",
+      name, lua_tostring(L, 4), parts[PART_REMOVE], parts[PART_ENSURE],
+      parts[PART_ADD], parts[PART_PRUNE]);
+
+  char *sql = sqlite3_mprintf(
+      "SELECT count(*) FROM main.sqlite_master WHERE type = 'table' AND "
+      "name = %Q",
+      name);
+  int exists = sql && pragma_int(handle, sql) > 0;
+  sqlite3_free(sql);
+
+  int matches = 1;
+  for (int i = 0; exists && i < 3; ++i)
+  {
+    static const char *const events[] = {"insert", "delete", "update"};
+    sql = sqlite3_mprintf("SELECT count(*) FROM main.sqlite_master WHERE "
+                          "type = 'trigger' AND name = '%q_%s' AND sql = %Q",
+                          name, events[i], triggers[i]);
+    matches = matches && sql && pragma_int(handle, sql) > 0;
+    sqlite3_free(sql);
+  }
+
+  sql = exists ? NULL
+               : sqlite3_mprintf(
+                     "CREATE TABLE \"%w\" (%s\"count\" INTEGER NOT NULL "
+                     "DEFAULT 0%s);%s%s;%s;%s;%s",
+                     name, parts[PART_COLUMNS], parts[PART_AGGREGATE_COLUMNS],
+                     parts[PART_INDEX], triggers[0], triggers[1], triggers[2],
+                     refresh ? refresh : "");
+
+  for (int i = 0; i < MATERIALIZE_PARTS; ++i)
+    sqlite3_free(parts[i]);
+  int oom = !refresh || (!exists && !sql);
+  for (int i = 0; i < 3; ++i)
+  {
+    oom = oom || !triggers[i];
+    sqlite3_free(triggers[i]);
+  }
+  if (oom || !matches)
+  {
+    sqlite3_free(sql);
+    sqlite3_free(refresh);
+    if (oom)
+      return luaL_error(L, "out of memory");
+    return luaL_error(L, "materialized table %s exists with a different "
+                         "definition", name);
+  }
+
+  lua_newuserdata(L, 0);
+  luaL_getmetatable(L, "sqlite3.materialized");
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 0, 3);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "db");
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "name");
+  lua_pushstring(L, refresh);
+  lua_setfield(L, -2, "refresh");
+  lua_setuservalue(L, -2);
+  sqlite3_free(refresh);
+
+  char *error = sql ? exec_script(handle, sql) : NULL;
+  sqlite3_free(sql);
+  if (error)
+  {
+    lua_pushstring(L, error);
+    sqlite3_free(error);
+    return lua_error(L);
+  }
+  return 1;
+}
+
+static int db_close(lua_State *L)
+{
+  struct db *db = (struct db *)luaL_checkudata(L, 1, "sqlite3.db");
+  if (lua_istable(L, 2))
+  {
+    lua_getfield(L, 2, "force");
+    if (lua_toboolean(L, -1))
+    {
+      while (db->stmts)
+        close_sqlite_stmt(db->stmts);
+    }
+  }
+  close_sqlite(db);
+  return 0;
+}
+
+static int db_create_collation(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  sqlite3 *handle = db->handle;
+  const char *name = luaL_checkstring(L, 2);
+  lua_settop(L, 3);
+
+  struct collation *collation = NULL;
+  if (!lua_isnil(L, 3))
+  {
+    luaL_checktype(L, 3, LUA_TFUNCTION);
+    collation = (struct collation *)malloc(sizeof(struct collation));
+    if (!collation)
+      return luaL_error(L, "out of memory");
+    collation->db = db;
+    collation->thread = lua_newthread(L);
+    lua_pushvalue(L, 3);
+    lua_xmove(L, collation->thread, 1);
+  }
+  else
+    lua_pushnil(L);
+
+  if (sqlite3_create_collation_v2(handle, name, SQLITE_UTF8, collation,
+                                  collation ? collate_lua : NULL,
+                                  free) != SQLITE_OK)
+  {
+    free(collation);
+    return luaL_error(L, "%s", sqlite3_errmsg(handle));
+  }
+
+  /* The thread running the comparator lives as long as the collation. */
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 5, "collations");
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, 5, "collations");
+  }
+  lua_pushvalue(L, 4);
+  lua_setfield(L, -2, name);
+  return 0;
+}
+
+static int db_detect(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+
+  if (!lua_toboolean(L, 2))
+  {
+    db->detect_threshold = 0;
+    return 0;
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  lua_getfield(L, 2, "threshold");
+  lua_getfield(L, 2, "window_ms");
+  luaL_argcheck(L, lua_isnil(L, 4) || lua_isnumber(L, 4), 2,
+                "threshold must be a number");
+  luaL_argcheck(L, lua_isnil(L, 5) || lua_isnumber(L, 5), 2,
+                "window_ms must be a number");
+  int threshold = lua_isnil(L, 4) ? 50 : (int)lua_tointeger(L, 4);
+  double window = lua_isnil(L, 5) ? 100 : lua_tonumber(L, 5);
+  luaL_argcheck(L, threshold > 0, 2, "threshold must be positive");
+
+  lua_newtable(L);
+  lua_setfield(L, 3, "detect");
+  db->detect_entries = 0;
+  lua_getfield(L, 2, "log");
+  lua_setfield(L, 3, "detect_log");
+
+  db->detect_threshold = threshold;
+  db->detect_window = window;
+  return 0;
+}
+
+static int db_hotspots(lua_State *L)
+{
+  check_db(L, 1);
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  lua_newtable(L);
+
+  lua_getfield(L, 2, "detect");
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    return 1;
+  }
+
+  int count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, 4))
+  {
+    lua_getfield(L, -1, "flagged");
+    int flagged = (int)lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (flagged > 0)
+    {
+      report_hotspot(L, lua_gettop(L));
+      lua_getfield(L, -1, "count");
+      lua_Number peak = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+
+      int i = count++;
+      for (; i > 0; --i)
+      {
+        lua_rawgeti(L, 3, i);
+        lua_getfield(L, -1, "count");
+        lua_Number other = lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        if (other >= peak)
+        {
+          lua_pop(L, 1);
+          break;
+        }
+        lua_rawseti(L, 3, i + 1);
+      }
+      lua_rawseti(L, 3, i + 1);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  return 1;
+}
+
+static int db_loader(lua_State *L)
+{
+  check_db(L, 1);
+  const char *sql = luaL_checkstring(L, 2);
+  luaL_checkstring(L, 3);
+
+  struct stmt *stmt = new_stmt(L, 1, sql);
+  if (sqlite3_bind_parameter_count(stmt->handle) != 1 ||
+      sqlite3_bind_parameter_name(stmt->handle, 1) || !find_placeholder(sql))
+  {
+    return luaL_error(L, "loader query must have exactly one '?' parameter");
+  }
+  close_sqlite_stmt(stmt);
+  lua_pop(L, 1);
+
+  lua_newuserdata(L, 0);
+  luaL_getmetatable(L, "sqlite3.loader");
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 0, 5);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "db");
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "sql");
+  lua_pushvalue(L, 3);
+  lua_setfield(L, -2, "key");
+  lua_newtable(L);
+  lua_setfield(L, -2, "keys");
+  lua_newtable(L);
+  lua_setfield(L, -2, "threads");
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+static int db_prepare(lua_State *L)
+{
+  check_db(L, 1);
+  luaL_checkstring(L, 2);
+  lua_settop(L, 3);
+
+  /* Cached statements are kept in the connection by their SQL text, along
+   * with the options they were prepared with. */
+  int cached = 0;
+  if (lua_istable(L, 3))
+  {
+    lua_getfield(L, 3, "cached");
+    cached = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+  }
+  if (cached)
+  {
+    lua_getuservalue(L, 1);
+    lua_getfield(L, 4, "cache");
+    if (lua_istable(L, 5))
+    {
+      lua_pushvalue(L, 2);
+      lua_rawget(L, 5);
+      struct stmt *stmt = (struct stmt *)lua_touserdata(L, -1);
+      if (stmt && stmt->handle)
+      {
+        lua_getuservalue(L, 6);
+        lua_getfield(L, 7, "options");
+        if (!same_options(L, 3, 8))
+          return luaL_error(L, "statement is cached with different options");
+        lua_settop(L, 6);
+        return 1;
+      }
+    }
+    lua_settop(L, 3);
+  }
+
+  prepare_stmt(L, 1);
+  if (!lua_isnil(L, 4))
+    set_stmt_options(L, 3, 4);
+  if (cached)
+  {
+    lua_getuservalue(L, 3);
+    lua_pushvalue(L, 4);
+    lua_setfield(L, -2, "options");
+    lua_pop(L, 1);
+    lua_getuservalue(L, 1);
+    lua_getfield(L, -1, "cache");
+    if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, -3, "cache");
+    }
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, -3);
+  }
+  lua_settop(L, 3);
+  return 1;
+}
+
+static int db_query_all(lua_State *L) { return step_all(L, prepare_query(L)); }
+
+static int db_query_one(lua_State *L) { return step_one(L, prepare_query(L)); }
+
+static int db_query(lua_State *L)
+{
+  prepare_query(L);
+  lua_pushcclosure(L, iter, 1);
+  return 1;
+}
+
+static int db_tostring(lua_State *L)
+{
+  struct db *db = (struct db *)luaL_checkudata(L, 1, "sqlite3.db");
+  const char *name =
+      db->handle ? sqlite3_db_filename(db->handle, "main") : "(closed)";
+  lua_pushfstring(L, "sqlite3: %s", name);
+  return 1;
+}
+
+static int db_record(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  record_stop(db);
+  if (!lua_toboolean(L, 2))
+    return 0;
+
+  const char *path = luaL_checkstring(L, 2);
+  struct recorder *r = (struct recorder *)calloc(1, sizeof(struct recorder));
+  if (!r)
+    return luaL_error(L, "out of memory");
+  r->file = fopen(path, "wb");
+  if (!r->file)
+  {
+    free(r);
+    return luaL_error(L, "cannot open %s", path);
+  }
+  fwrite(RECORD_MAGIC, 1, 8, r->file);
+  r->start = now_ms();
+
+  db->recorder = r;
+  sqlite3_trace_v2(db->handle, SQLITE_TRACE_PROFILE, record_trace, r);
+  return 0;
+}
+
+static int db_rtree_load(lua_State *L)
+{
+  sqlite3 *handle = check_db(L, 1)->handle;
+  const char *table = luaL_checkstring(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+
+  int dims;
+  char *sql = rtree_sql(handle, table, 0, &dims);
+  if (!sql)
+    return luaL_error(L, "%s", sqlite3_errmsg(handle));
+  lua_pushstring(L, sql);
+  sqlite3_free(sql);
+  if (!dims)
+    return luaL_error(L, "%s is not an R*Tree table", table);
+
+  size_t count = lua_rawlen(L, 3);
+  struct rtree_entry *entries = (struct rtree_entry *)lua_newuserdata(
+      L, count * sizeof(struct rtree_entry));
+  for (size_t i = 0; i < count; ++i)
+  {
+    lua_rawgeti(L, 3, (lua_Integer)i + 1);
+    if (!lua_istable(L, -1))
+      return luaL_error(L, "row %d is not a table", (int)i + 1);
+    for (int k = 0; k < dims; ++k)
+    {
+      lua_rawgeti(L, -1, 2 * k + 2);
+      lua_rawgeti(L, -2, 2 * k + 3);
+      if (!lua_isnumber(L, -2) || !lua_isnumber(L, -1))
+        return luaL_error(L, "row %d has no bounds for dimension %d",
+                          (int)i + 1, k + 1);
+      entries[i].center[k] = (lua_tonumber(L, -2) + lua_tonumber(L, -1)) / 2;
+      lua_pop(L, 2);
+    }
+    entries[i].row = (int)i + 1;
+    lua_pop(L, 1);
+  }
+
+  /* R*Tree nodes fill a page less 64 bytes, with a 4 byte header and
+   * entries of a 64-bit id and two 32-bit floats per dimension. */
+  size_t capacity =
+      (size_t)(pragma_int(handle, "PRAGMA page_size") - 64 - 4) /
+      (8 + 8 * dims);
+  str_sort(entries, count, 0, dims, capacity > 0 ? capacity : 1);
+
+  new_stmt(L, 1, lua_tostring(L, 4));
+  lua_replace(L, 1);
+  lua_replace(L, 2);
+  lua_settop(L, 3);
+  return in_savepoint(L, insert_rtree);
+}
+
+static int db_rtree_within(lua_State *L)
+{
+  check_db(L, 1);
+  const char *table = luaL_checkstring(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  lua_settop(L, 3);
+
+  struct stmt *stmt = rtree_stmt(L, 1, table);
+  int count = sqlite3_bind_parameter_count(stmt->handle);
+  luaL_argcheck(L, (int)lua_rawlen(L, 3) == count, 3,
+                "bounding box does not match the table");
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, 3, i);
+    luaL_argcheck(L, lua_isnumber(L, -1), 3, "bounds must be numbers");
+    bind_one_param(L, stmt, i);
+  }
+
+  lua_newtable(L);
+  int status, rows = 0;
+  while ((status = sqlite3_step(stmt->handle)) == SQLITE_ROW)
+  {
+    push_column(L, stmt, 0);
+    lua_rawseti(L, -2, ++rows);
+  }
+  sqlite3_reset(stmt->handle);
+  sqlite3_clear_bindings(stmt->handle);
+  if (status != SQLITE_DONE)
+    return luaL_error(L, "%s", sqlite3_errmsg(sqlite3_db_handle(stmt->handle)));
+  return 1;
+}
+
+static int db_statements(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  double now = now_ms();
+  lua_newtable(L);
+
+  int i = 0;
+  for (struct stmt *stmt = db->stmts; stmt; stmt = stmt->next)
+  {
+    if (!stmt->handle)
+      continue;
+
+    lua_createtable(L, 0, 5);
+    lua_pushstring(L, sqlite3_sql(stmt->handle));
+    lua_setfield(L, -2, "sql");
+    lua_pushinteger(L, sqlite3_stmt_status(stmt->handle,
+                                           SQLITE_STMTSTATUS_MEMUSED, 0));
+    lua_setfield(L, -2, "memory");
+    lua_pushinteger(L, stmt->runs);
+    lua_setfield(L, -2, "runs");
+    lua_pushnumber(L, now - stmt->used);
+    lua_setfield(L, -2, "idle_ms");
+    lua_pushboolean(L, sqlite3_stmt_busy(stmt->handle));
+    lua_setfield(L, -2, "busy");
+    lua_rawseti(L, -2, ++i);
+  }
+  return 1;
+}
+
+static int db_strict(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+
+  if (!lua_toboolean(L, 2))
+  {
+    db->strict = 0;
+    return 0;
+  }
+  luaL_checktype(L, 2, LUA_TTABLE);
+
+  lua_getfield(L, 2, "forbid");
+  lua_getfield(L, 2, "min_rows");
+  lua_getfield(L, 2, "action");
+  int forbid = STRICT_SCAN;
+  if (!lua_isnil(L, 4))
+  {
+    luaL_argcheck(L, lua_istable(L, 4), 2, "forbid is not a table");
+    forbid = 0;
+    int count = (int)lua_rawlen(L, 4);
+    for (int i = 1; i <= count; ++i)
+    {
+      lua_rawgeti(L, 4, i);
+      const char *plan = luaL_checkstring(L, -1);
+      if (!strcmp(plan, "scan"))
+        forbid |= STRICT_SCAN;
+      else if (!strcmp(plan, "temp_btree"))
+        forbid |= STRICT_TEMP_BTREE;
+      else
+        return luaL_error(L, "unknown plan: %s", plan);
+      lua_pop(L, 1);
+    }
+  }
+  lua_Integer min_rows = luaL_optinteger(L, 5, 10000);
+  if (lua_isnil(L, 6))
+  {
+    lua_pushliteral(L, "error");
+    lua_replace(L, 6);
+  }
+  luaL_argcheck(L,
+                lua_isfunction(L, 6) ||
+                    (lua_type(L, 6) == LUA_TSTRING &&
+                     (!strcmp(lua_tostring(L, 6), "error") ||
+                      !strcmp(lua_tostring(L, 6), "warn"))),
+                2, "action must be 'error', 'warn' or a function");
+
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, min_rows);
+  lua_setfield(L, -2, "min_rows");
+  lua_pushvalue(L, 6);
+  lua_setfield(L, -2, "action");
+  lua_newtable(L);
+  lua_setfield(L, -2, "verdicts");
+  lua_newtable(L);
+  lua_setfield(L, -2, "rows");
+  lua_setfield(L, 3, "strict");
+
+  db->strict = forbid;
+  return 0;
+}
+
+static int db_transaction(lua_State *L)
+{
+  sqlite3 *db = check_db(L, 1)->handle;
+  luaL_argcheck(L, lua_type(L, 2) == LUA_TFUNCTION, 2,
+                "argument 2 is not a function");
+
+  int status = sqlite3_exec(db, "SAVEPOINT clutch_savepoint", NULL, NULL, NULL);
+  if (status != SQLITE_OK)
+  {
+    return luaL_error(L, "%s", sqlite3_errmsg(db));
+  }
+
+  lua_settop(L, 2);
+  lua_insert(L, -2);
+  status = lua_pcall(L, 1, LUA_MULTRET, 0);
+
+  if (status == LUA_OK)
+  {
+    sqlite3_exec(db, "RELEASE clutch_savepoint", NULL, NULL, NULL);
+  }
+  else
+  {
+    sqlite3_exec(db, "ROLLBACK TO clutch_savepoint", NULL, NULL, NULL);
+  }
+  lua_pushboolean(L, status == LUA_OK);
+
+  lua_insert(L, 1);
+  return lua_gettop(L);
+}
+
+static int db_trim(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  double idle = luaL_optnumber(L, 2, 0);
+  double now = now_ms();
+
+  int count = 0;
+  struct stmt *next;
+  for (struct stmt *stmt = db->stmts; stmt; stmt = next)
+  {
+    next = stmt->next;
+    if (stmt->handle && !sqlite3_stmt_busy(stmt->handle) &&
+        now - stmt->used >= idle)
+    {
+      close_sqlite_stmt(stmt);
+      ++count;
+    }
+  }
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static int db_update(lua_State *L)
+{
+  return update(L, prepare_query(L));
+}
+
+static int prep_stmt_all(lua_State *L) { return step_all(L, rebind_stmt(L, 1)); }
+
+static int prep_stmt_close(lua_State *L)
+{
+  close_sqlite_stmt((struct stmt *)luaL_checkudata(L, 1, "sqlite3.stmt"));
+  return 0;
+}
+
+static int prep_stmt_iter(lua_State *L)
+{
+  rebind_stmt(L, 1);
+  lua_pushcclosure(L, iter, 1);
+  return 1;
+}
+
+static int prep_stmt_one(lua_State *L) { return step_one(L, rebind_stmt(L, 1)); }
+
+static int prep_stmt_pack_all(lua_State *L)
+{
+  struct stmt *stmt = check_stmt(L, 1);
+  struct pack_format format;
+  parse_pack_format(L, luaL_checkstring(L, 2), &format);
+  check_pack_columns(L, stmt, &format);
+
+  rebind_stmt(L, 2);
+  pack_rows(L, stmt, &format, 0);
+  return 1;
+}
+
+static int prep_stmt_pack_fetch(lua_State *L)
+{
+  struct stmt *stmt = check_stmt(L, 1);
+  struct pack_format *format =
+      (struct pack_format *)lua_newuserdata(L, sizeof(struct pack_format));
+  parse_pack_format(L, luaL_checkstring(L, 2), format);
+  check_pack_columns(L, stmt, format);
+  luaL_argcheck(L, luaL_checkinteger(L, 3) > 0, 3,
+                "chunk size must be positive");
+  lua_insert(L, 4);
+
+  rebind_stmt(L, 4);
+  lua_pushboolean(L, 0);
+  lua_pushcclosure(L, pack_iter, 5);
+  return 1;
+}
+
+static int prep_stmt_tostring(lua_State *L)
+{
+  struct stmt *stmt = (struct stmt *)luaL_checkudata(L, 1, "sqlite3.stmt");
+  lua_pushstring(L, stmt->handle ? sqlite3_sql(stmt->handle) : "(closed)");
+  return 1;
+}
+
+static int prep_stmt_insert_columns(lua_State *L)
+{
+  check_stmt(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  return in_savepoint(L, insert_columns);
+}
+
+static int prep_stmt_update(lua_State *L)
+{
+  return update(L, rebind_stmt(L, 1));
+}
+
+static int prep_stmt_update_many(lua_State *L)
+{
+  sqlite3_reset(check_stmt(L, 1)->handle);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 3);
+  if (!lua_isnil(L, 3))
+  {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "sort_by");
+    if (lua_isnil(L, 4))
+      lua_pushnil(L);
+    else
+      sort_rows(L, 2, 4);
+    lua_replace(L, 3);
+    lua_settop(L, 3);
+  }
+  return in_savepoint(L, update_many);
+}
+
+static int prep_stmt_update_packed(lua_State *L)
+{
+  check_stmt(L, 1);
+  luaL_checkstring(L, 2);
+  luaL_checkstring(L, 3);
+  lua_settop(L, 3);
+  return in_savepoint(L, update_packed);
+}
+
+static int loader_dispatch(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.loader");
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 2, "keys");
+  lua_getfield(L, 2, "threads");
+
+  lua_newtable(L);
+  lua_setfield(L, 2, "keys");
+  lua_newtable(L);
+  lua_setfield(L, 2, "threads");
+
+  int count = (int)lua_rawlen(L, 4);
+  if (count == 0)
+  {
+    lua_pushinteger(L, 0);
+    return 1;
+  }
+
+  /* The waiting coroutines must be resumed even if the query fails, so they
+   * get nil and the message, and the error is raised afterwards. */
+  lua_pushcfunction(L, loader_fetch_all);
+  lua_pushvalue(L, 1);
+  lua_pushvalue(L, 3);
+  int failed = lua_pcall(L, 2, 1, 0) != LUA_OK;
+
+  int error = failed ? 5 : 0;
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, 4, i);
+    lua_State *co = lua_tothread(L, -1);
+    lua_pop(L, 1);
+    if (lua_status(co) != LUA_YIELD)
+      continue;
+
+    if (failed)
+    {
+      lua_pushnil(co);
+      lua_pushvalue(L, 5);
+      lua_xmove(L, co, 1);
+    }
+    else
+    {
+      lua_rawgeti(L, 3, i);
+      lua_rawget(L, 5);
+      lua_xmove(L, co, 1);
+    }
+    if (resume_thread(L, co, failed ? 2 : 1) != LUA_OK)
+    {
+      if (error)
+        lua_pop(L, 1);
+      else
+        error = lua_gettop(L);
+    }
+  }
+  if (error)
+  {
+    lua_pushvalue(L, error);
+    return lua_error(L);
+  }
+
+  lua_pushinteger(L, count);
+  return 1;
+}
+
+static int loader_load(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.loader");
+  luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "key expected");
+  lua_settop(L, 2);
+
+  if (is_yieldable(L))
+  {
+    lua_getuservalue(L, 1);
+    lua_getfield(L, 3, "keys");
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+    lua_getfield(L, 3, "threads");
+    lua_pushthread(L);
+    lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+    lua_settop(L, 0);
+    return lua_yield(L, 0);
+  }
+
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, 1);
+  loader_fetch(L, 1, 3);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  return 1;
+}
+
+static int materialized_refresh(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.materialized");
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 2, "db");
+  sqlite3 *handle = check_db(L, -1)->handle;
+  lua_getfield(L, 2, "refresh");
+
+  char *error = exec_script(handle, lua_tostring(L, -1));
+  if (error)
+  {
+    lua_pushstring(L, error);
+    sqlite3_free(error);
+    return lua_error(L);
+  }
+  return 0;
+}
+
+static int materialized_tostring(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.materialized");
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, "name");
+  lua_pushfstring(L, "materialized: %s", lua_tostring(L, -1));
+  return 1;
+}
+
+static int db_kv(lua_State *L)
+{
+  sqlite3 *handle = check_db(L, 1)->handle;
+  const char *table = luaL_checkstring(L, 2);
+  lua_Integer capacity = 0;
+  if (!lua_isnoneornil(L, 3))
+  {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_getfield(L, 3, "cache_entries");
+    capacity = luaL_optinteger(L, -1, 0);
+    luaL_argcheck(L, capacity >= 0, 3, "cache_entries must not be negative");
+  }
+  lua_settop(L, 2);
+
+  char *sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\" (key TEXT "
+                              "PRIMARY KEY NOT NULL, value) WITHOUT ROWID",
+                              table);
+  if (!sql)
+    return luaL_error(L, "out of memory");
+  int status = sqlite3_exec(handle, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  if (status != SQLITE_OK)
+    return luaL_error(L, "%s", sqlite3_errmsg(handle));
+
+  lua_newuserdata(L, 0);
+  luaL_getmetatable(L, "sqlite3.kv");
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 0, 7);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "db");
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "table");
+  lua_newtable(L);
+  lua_setfield(L, -2, "stmts");
+  lua_newtable(L);
+  lua_setfield(L, -2, "young");
+  lua_newtable(L);
+  lua_setfield(L, -2, "old");
+  lua_pushinteger(L, 0);
+  lua_setfield(L, -2, "size");
+  lua_pushinteger(L, capacity);
+  lua_setfield(L, -2, "capacity");
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+static int kv_delete(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.kv");
+  luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  lua_pushnil(L);
+  kv_write(L, 1, 2, 3);
+  return 0;
+}
+
+static int kv_get(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.kv");
+  luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+
+  if (kv_cache_get(L, 3, 2))
+    return 1;
+
+  struct stmt *stmt = kv_stmt(L, 1, "get");
+  lua_pushvalue(L, 2);
+  bind_one_param(L, stmt, 1);
+  int status = sqlite3_step(stmt->handle);
+  if (status == SQLITE_ROW)
+    push_column(L, stmt, 0);
+  else
+    lua_pushnil(L);
+  sqlite3_reset(stmt->handle);
+  if (status != SQLITE_ROW && status != SQLITE_DONE)
+    return luaL_error(L, "%s", sqlite3_errmsg(sqlite3_db_handle(stmt->handle)));
+
+  if (status == SQLITE_ROW)
+    kv_cache_set(L, 3, 2, 4);
+  return 1;
+}
+
+static int kv_get_many(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.kv");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_newtable(L);
+  lua_newtable(L);
+
+  int count = (int)lua_rawlen(L, 2), missing = 0;
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, 2, i);
+    if (lua_type(L, -1) == LUA_TNUMBER)
+      lua_tostring(L, -1);
+    luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 2, "keys must be strings");
+    if (kv_cache_get(L, 3, 6))
+    {
+      lua_rawset(L, 4);
+      continue;
+    }
+    lua_rawseti(L, 5, ++missing);
+  }
+  if (missing == 0)
+  {
+    lua_settop(L, 4);
+    return 1;
+  }
+
+  struct stmt *stmt = kv_stmt(L, 1, "getmany");
+  lua_pushvalue(L, 5);
+  bind_one_param(L, stmt, 1);
+  int status;
+  while ((status = sqlite3_step(stmt->handle)) == SQLITE_ROW)
+  {
+    push_column(L, stmt, 0);
+    push_column(L, stmt, 1);
+    kv_cache_set(L, 3, 6, 7);
+    lua_rawset(L, 4);
+  }
+  sqlite3_reset(stmt->handle);
+  sqlite3_clear_bindings(stmt->handle);
+  if (status != SQLITE_DONE)
+    return luaL_error(L, "%s", sqlite3_errmsg(sqlite3_db_handle(stmt->handle)));
+
+  lua_settop(L, 4);
+  return 1;
+}
+
+static int kv_put(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.kv");
+  luaL_checkstring(L, 2);
+  lua_settop(L, 3);
+  kv_write(L, 1, 2, 3);
+  return 0;
+}
+
+static int kv_put_many(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.kv");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 3, "db");
+  sqlite3 *db = check_db(L, 4)->handle;
+
+  if (sqlite3_exec(db, "SAVEPOINT clutch_savepoint", NULL, NULL, NULL) !=
+      SQLITE_OK)
+    return luaL_error(L, "%s", sqlite3_errmsg(db));
+
+  lua_settop(L, 2);
+  lua_pushcfunction(L, put_all);
+  lua_insert(L, 1);
+  if (lua_pcall(L, 2, 0, 0) != LUA_OK)
+  {
+    sqlite3_exec(db, "ROLLBACK TO clutch_savepoint", NULL, NULL, NULL);
+    sqlite3_exec(db, "RELEASE clutch_savepoint", NULL, NULL, NULL);
+    return lua_error(L);
+  }
+  sqlite3_exec(db, "RELEASE clutch_savepoint", NULL, NULL, NULL);
+  return 0;
+}
+
+static int kv_scan(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.kv");
+  size_t len;
+  const char *prefix = luaL_optlstring(L, 2, "", &len);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 3, "db");
+  check_db(L, 4);
+  lua_getfield(L, 3, "table");
+
+  char *sql = sqlite3_mprintf(
+      "SELECT key, value FROM \"%w\" WHERE key >= ? AND key < ? ORDER BY key",
+      lua_tostring(L, 5));
+  if (!sql)
+    return luaL_error(L, "out of memory");
+  lua_pushstring(L, sql);
+  sqlite3_free(sql);
+  struct stmt *stmt = new_stmt(L, 4, lua_tostring(L, -1));
+  touch_stmt(stmt);
+
+  /* Keys are text, which sorts before any blob, so with no prefix or a
+   * prefix of 0xff bytes the upper bound is an empty blob. */
+  sqlite3_bind_text(stmt->handle, 1, prefix, len, SQLITE_TRANSIENT);
+  while (len > 0 && (unsigned char)prefix[len - 1] == 0xff)
+    --len;
+  if (len > 0)
+  {
+    char *upper = (char *)sqlite3_malloc((int)len);
+    if (!upper)
+      return luaL_error(L, "out of memory");
+    memcpy(upper, prefix, len);
+    upper[len - 1] = (char)((unsigned char)upper[len - 1] + 1);
+    sqlite3_bind_text(stmt->handle, 2, upper, len, sqlite3_free);
+  }
+  else
+    sqlite3_bind_zeroblob(stmt->handle, 2, 0);
+
+  lua_pushcclosure(L, kv_scan_iter, 1);
+  return 1;
+}
+
+static int kv_scan_iter(lua_State *L)
+{
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, lua_upvalueindex(1));
+  if (!stmt->handle)
+    return luaL_error(L, "statement is closed");
+
+  int status = sqlite3_step(stmt->handle);
+  if (status != SQLITE_ROW)
+  {
+    sqlite3_reset(stmt->handle);
+    if (status != SQLITE_DONE)
+      return luaL_error(L, "%s",
+                        sqlite3_errmsg(sqlite3_db_handle(stmt->handle)));
+    return 0;
+  }
+  push_column(L, stmt, 0);
+  push_column(L, stmt, 1);
+  return 2;
+}
+
+static int kv_tostring(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.kv");
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, "table");
+  lua_pushfstring(L, "kv: %s", lua_tostring(L, -1));
+  return 1;
+}
+
+static int db_partitioned(lua_State *L)
+{
+  check_db(L, 1);
+  const char *name = luaL_checkstring(L, 2);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  luaL_argcheck(L, !strchr(name, '/'), 2, "name contains a path separator");
+  lua_settop(L, 3);
+  lua_getfield(L, 3, "by");
+  lua_getfield(L, 3, "dir");
+  lua_getfield(L, 3, "columns");
+  lua_getfield(L, 3, "keep");
+  lua_getfield(L, 3, "time");
+
+  const char *unit = luaL_optstring(L, 4, "day");
+  int by = 0;
+  while (partition_units[by] && strcmp(partition_units[by], unit))
+    ++by;
+  luaL_argcheck(L, partition_units[by], 3, "by must be hour, day or month");
+  luaL_argcheck(L, lua_type(L, 5) == LUA_TSTRING, 3, "dir is not a string");
+  luaL_argcheck(L, lua_type(L, 6) == LUA_TSTRING, 3,
+                "columns is not a string");
+  lua_Integer keep = luaL_optinteger(L, 7, 0);
+  luaL_argcheck(L, keep >= 0, 3, "keep must not be negative");
+  if (lua_isnil(L, 8))
+  {
+    lua_pushliteral(L, "ts");
+    lua_replace(L, 8);
+  }
+
+  lua_newuserdata(L, 0);
+  luaL_getmetatable(L, "sqlite3.partitioned");
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 0, 11);
+  lua_pushvalue(L, 1);
+  lua_setfield(L, -2, "db");
+  lua_pushvalue(L, 2);
+  lua_setfield(L, -2, "name");
+  lua_pushinteger(L, by);
+  lua_setfield(L, -2, "by");
+  lua_pushvalue(L, 5);
+  lua_setfield(L, -2, "dir");
+  lua_pushvalue(L, 6);
+  lua_setfield(L, -2, "columns");
+  lua_pushinteger(L, keep);
+  lua_setfield(L, -2, "keep");
+  lua_pushvalue(L, 8);
+  lua_setfield(L, -2, "time");
+  lua_newtable(L);
+  lua_setfield(L, -2, "attached");
+  lua_newtable(L);
+  lua_setfield(L, -2, "inserts");
+  lua_newtable(L);
+  lua_setfield(L, -2, "viewed");
+  lua_pushinteger(L, 0);
+  lua_setfield(L, -2, "tick");
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+static int partitioned_insert(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.partitioned");
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 3, "db");
+  sqlite3 *handle = check_db(L, 4)->handle;
+  lua_getfield(L, 3, "time");
+  lua_getfield(L, 2, lua_tostring(L, 5));
+  if (lua_type(L, 6) != LUA_TNUMBER)
+    return luaL_error(L, "row has no %s", lua_tostring(L, 5));
+  time_t t = (time_t)lua_tonumber(L, 6);
+  lua_getfield(L, 3, "by");
+  char key[PARTITION_KEY_MAX];
+  partition_key(key, t, (int)lua_tointeger(L, -1), 0);
+  lua_settop(L, 4);
+
+  if (partition_attach(L, 3, key))
+    partition_retire(L, 3, time(NULL), key);
+
+  lua_getfield(L, 3, "inserts");
+  lua_getfield(L, 5, key);
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, 6);
+  if (!stmt || !stmt->handle)
+  {
+    lua_getfield(L, 3, "name");
+    const char *name = lua_tostring(L, -1);
+    const char *schema = lua_pushfstring(L, "%s_%s", name, key);
+    char *sql = partition_insert_sql(handle, schema, name);
+    if (!sql)
+      return luaL_error(L, "%s", sqlite3_errmsg(handle));
+    lua_pushstring(L, sql);
+    sqlite3_free(sql);
+    stmt = new_stmt(L, 4, lua_tostring(L, -1));
+    lua_setfield(L, 5, key);
+  }
+  touch_stmt(stmt);
+
+  lua_pushvalue(L, 2);
+  record_begin(stmt);
+  bind_params(L, stmt);
+  int status = sqlite3_step(stmt->handle);
+  sqlite3_reset(stmt->handle);
+  sqlite3_clear_bindings(stmt->handle);
+  if (status != SQLITE_DONE)
+    return luaL_error(L, "%s", sqlite3_errmsg(handle));
+  return 0;
+}
+
+static int partitioned_partitions(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.partitioned");
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  partition_list(L, 2, NULL, NULL);
+  return 1;
+}
+
+static int partitioned_retire(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.partitioned");
+  time_t now = (time_t)luaL_optnumber(L, 2, (lua_Number)time(NULL));
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  lua_pushinteger(L, partition_retire(L, 2, now, NULL));
+  return 1;
+}
+
+static int partitioned_view(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.partitioned");
+  lua_settop(L, 3);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 4, "db");
+  sqlite3 *handle = check_db(L, 5)->handle;
+  lua_getfield(L, 4, "by");
+  int by = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+
+  char from[PARTITION_KEY_MAX], to[PARTITION_KEY_MAX];
+  if (!lua_isnil(L, 2))
+    partition_key(from, (time_t)luaL_checknumber(L, 2), by, 0);
+  if (!lua_isnil(L, 3))
+    partition_key(to, (time_t)luaL_checknumber(L, 3), by, 0);
+  int count = partition_list(L, 4, lua_isnil(L, 2) ? NULL : from,
+                             lua_isnil(L, 3) ? NULL : to);
+  lua_getfield(L, 4, "name");
+  const char *name = lua_tostring(L, 7);
+
+  /* Every partition in the range has to be attached at once, alongside the
+   * databases attached by others. */
+  int attached = 0;
+  lua_getfield(L, 4, "attached");
+  lua_pushnil(L);
+  while (lua_next(L, 8))
+  {
+    ++attached;
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  int limit = sqlite3_limit(handle, SQLITE_LIMIT_ATTACHED, -1) -
+              (int)pragma_int(handle, attached_count) + attached;
+  if (count > limit)
+    return luaL_error(L,
+                      "view spans %d partitions but only %d databases can "
+                      "be attached",
+                      count, limit);
+
+  /* The partitions of the previous view may be detached to make room, but
+   * those of the new one must stay attached while it exists. */
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, 4, "viewed");
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, 6, i);
+    partition_attach(L, 4, lua_tostring(L, -1));
+    lua_pushfstring(L, "%s_%s", name, lua_tostring(L, -1));
+    lua_pushboolean(L, 1);
+    lua_rawset(L, 8);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+
+  sqlite3_str *sql = sqlite3_str_new(handle);
+  sqlite3_str_appendf(sql, "DROP VIEW IF EXISTS temp.\"%w\";", name);
+  if (count == 0)
+  {
+    lua_getfield(L, 4, "columns");
+    sqlite3_str_appendf(sql,
+                        "CREATE TEMP TABLE IF NOT EXISTS \"%w_empty\" (%s);"
+                        "CREATE TEMP VIEW \"%w\" AS SELECT * FROM "
+                        "temp.\"%w_empty\"",
+                        name, lua_tostring(L, -1), name, name);
+    lua_pop(L, 1);
+  }
+  else
+    sqlite3_str_appendf(sql, "CREATE TEMP VIEW \"%w\" AS ", name);
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, 6, i);
+    sqlite3_str_appendf(sql, "%sSELECT * FROM \"%w_%w\".\"%w\"",
+                        i > 1 ? " UNION ALL " : "", name, lua_tostring(L, -1),
+                        name);
+    lua_pop(L, 1);
+  }
+
+  char *text = sqlite3_str_finish(sql);
+  if (!text)
+    return luaL_error(L, "out of memory");
+  int status = sqlite3_exec(handle, text, NULL, NULL, NULL);
+  sqlite3_free(text);
+  if (status != SQLITE_OK)
+    return luaL_error(L, "%s", sqlite3_errmsg(handle));
+
+  lua_pushvalue(L, 7);
+  return 1;
+}
+
+static int partitioned_tostring(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.partitioned");
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, "name");
+  lua_pushfstring(L, "partitioned: %s", lua_tostring(L, -1));
+  return 1;
+}
+
+static int opener_close(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.opener");
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  opener_evict(L, 2, HUGE_VAL, 1);
+  return 0;
+}
+
+static int opener_get(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.opener");
+  luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 3, "dbs");
+  lua_getfield(L, 3, "used");
+  double now = now_ms();
+
+  lua_getfield(L, 3, "idle_ms");
+  lua_getfield(L, 3, "swept");
+  double idle_ms = lua_tonumber(L, -2), swept = lua_tonumber(L, -1);
+  lua_pop(L, 2);
+  if (idle_ms > 0 && now - swept >= idle_ms)
+  {
+    opener_evict(L, 3, now - idle_ms, 0);
+    lua_pushnumber(L, now);
+    lua_setfield(L, 3, "swept");
+  }
+
+  lua_pushvalue(L, 2);
+  lua_rawget(L, 4);
+  struct db *db = (struct db *)lua_touserdata(L, 6);
+  if (!db || !db->handle)
+  {
+    lua_getfield(L, 3, "count");
+    lua_getfield(L, 3, "max_open");
+    if (db || lua_tointeger(L, -2) >= lua_tointeger(L, -1))
+      opener_evict(L, 3, -1, 0);
+    lua_settop(L, 5);
+
+    lua_pushcfunction(L, clutch_open);
+    lua_pushvalue(L, 2);
+    lua_getfield(L, 3, "options");
+    lua_call(L, 2, 1);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 6);
+    lua_rawset(L, 4);
+    lua_getfield(L, 3, "count");
+    lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+    lua_setfield(L, 3, "count");
+    lua_pop(L, 1);
+  }
+
+  lua_pushvalue(L, 2);
+  lua_pushnumber(L, now);
+  lua_rawset(L, 5);
+  lua_settop(L, 6);
+  return 1;
+}
+
+static int opener_tostring(lua_State *L)
+{
+  luaL_checkudata(L, 1, "sqlite3.opener");
+  lua_getuservalue(L, 1);
+  lua_getfield(L, -1, "count");
+  lua_pushfstring(L, "opener: %d open", (int)lua_tointeger(L, -1));
+  return 1;
+}
+
+/* Wait for this handle's writes and give up its share of the writer. Any
+ * failure that flush() has not reported yet is raised here. */
+static int writer_close(lua_State *L)
+{
+  struct writer_client *client =
+      (struct writer_client *)luaL_checkudata(L, 1, "sqlite3.writer");
+  if (!client->writer)
+    return 0;
+
+  char *error = writer_wait(client);
+  writer_release(client->writer);
+  client->writer = NULL;
+  if (error)
+  {
+    lua_pushstring(L, error);
+    sqlite3_free(error);
+    return lua_error(L);
+  }
+  return 0;
+}
+
+static int writer_gc(lua_State *L)
+{
+  struct writer_client *client =
+      (struct writer_client *)luaL_checkudata(L, 1, "sqlite3.writer");
+  if (client->writer)
+  {
+    sqlite3_free(writer_wait(client));
+    writer_release(client->writer);
+    client->writer = NULL;
+  }
+  return 0;
+}
+
+static int writer_flush(lua_State *L)
+{
+  struct writer_client *client = check_writer(L, 1);
+  char *error = writer_wait(client);
+  if (error)
+  {
+    lua_pushstring(L, error);
+    sqlite3_free(error);
+    return lua_error(L);
+  }
+  return 0;
+}
+
+/* Copy the statement and its parameters into a single allocation, using the
+ * same packed layout as recorded workloads, and hand it to the writer. */
+static int writer_write(lua_State *L)
+{
+  struct writer_client *client = check_writer(L, 1);
+  size_t len;
+  const char *sql = luaL_checklstring(L, 2, &len);
+  int top = lua_gettop(L);
+
+  size_t size = sizeof(struct writer_job) + len + 1;
+  for (int i = 3; i <= top; ++i)
+  {
+    if (lua_istable(L, i))
+    {
+      json_encode(L, i);
+      lua_replace(L, i);
+    }
+
+    size += 5;
+    switch (lua_type(L, i))
+    {
+    case LUA_TSTRING:
+      size += 4 + lua_rawlen(L, i);
+      break;
+    case LUA_TNUMBER:
+      size += 8;
+      break;
+    case LUA_TNIL:
+      break;
+    default:
+      return luaL_error(L, "unsupported lua type '%s' at position %d",
+                        luaL_typename(L, i), i - 2);
+    }
+  }
+
+  struct writer_job *job = (struct writer_job *)malloc(size);
+  if (!job)
+    return luaL_error(L, "out of memory");
+  char *text = (char *)(job + 1);
+  memcpy(text, sql, len + 1);
+  unsigned char *p = (unsigned char *)text + len + 1;
+  job->client = client;
+  job->error = NULL;
+  job->sql = text;
+  job->params = p;
+  job->nparams = top >= 3 ? (unsigned int)(top - 2) : 0;
+
+  for (int i = 3; i <= top; ++i)
+  {
+    put_u32(p, i - 2);
+    p += 5;
+    if (lua_type(L, i) == LUA_TSTRING)
+    {
+      size_t n;
+      const char *s = lua_tolstring(L, i, &n);
+      p[-1] = 't';
+      put_u32(p, n);
+      memcpy(p + 4, s, n);
+      p += 4 + n;
+    }
+    else if (lua_type(L, i) == LUA_TNUMBER)
+    {
+      sqlite3_uint64 bits;
+#if LUA_VERSION_NUM >= 503
+      if (lua_isinteger(L, i))
+      {
+        p[-1] = 'i';
+        bits = (sqlite3_uint64)lua_tointeger(L, i);
+      }
+      else
+#endif
+      {
+        double value = lua_tonumber(L, i);
+        p[-1] = 'f';
+        memcpy(&bits, &value, sizeof(bits));
+      }
+      put_u64(p, bits);
+      p += 8;
+    }
+    else
+      p[-1] = 'n';
+  }
+
+  writer_push(client->writer, job);
+  return 0;
+}
+
+static int writer_tostring(lua_State *L)
+{
+  struct writer_client *client =
+      (struct writer_client *)luaL_checkudata(L, 1, "sqlite3.writer");
+  if (!client->writer)
+    lua_pushliteral(L, "writer: closed");
+  else
+    lua_pushfstring(L, "writer: %s", client->writer->path);
+  return 1;
+}
+
+static struct db *check_db(lua_State *L, int index)
+{
+  struct db *db = (struct db *)luaL_checkudata(L, index, "sqlite3.db");
+  if (!db->handle)
+    luaL_error(L, "database is closed");
+  return db;
+}
+
+static struct stmt *check_stmt(lua_State *L, int index)
+{
+  struct stmt *stmt = (struct stmt *)luaL_checkudata(L, index, "sqlite3.stmt");
+  if (!stmt->handle)
+    luaL_error(L, "statement is closed");
+  return stmt;
+}
+
+static struct stmt *rebind_stmt(lua_State *L, int nargs)
+{
+  struct stmt *stmt = check_stmt(L, 1);
+  sqlite3_reset(stmt->handle);
+  touch_stmt(stmt);
+  if (stmt->db->detect_threshold)
+    detect_stmt(L, 1);
+  bind_stmt(L, stmt, nargs);
+  return stmt;
+}
+
+static struct stmt *prepare_query(lua_State *L)
+{
+  struct db *db = check_db(L, 1);
+  struct stmt *stmt = prepare_stmt(L, 1);
+  touch_stmt(stmt);
+  if (db->detect_threshold)
+    detect_stmt(L, 3);
+
+  int status = bind_stmt(L, stmt, 3);
+  if (status != SQLITE_OK)
+  {
+    luaL_error(L, "%s", sqlite3_errmsg(db->handle));
+  }
+
+  return stmt;
+}
+
+static struct stmt *prepare_stmt(lua_State *L, int db)
+{
+  const char *sql = luaL_checkstring(L, 2);
+  struct stmt *stmt = new_stmt(L, db, sql);
+  lua_insert(L, 3);
+  return stmt;
+}
+
+static struct db *new_db(lua_State *L)
+{
+  struct db *db = (struct db *)lua_newuserdata(L, sizeof(struct db));
+  memset(db, 0, sizeof(struct db));
+
+  luaL_getmetatable(L, "sqlite3.db");
+  lua_setmetatable(L, -2);
+
+  lua_newtable(L);
+  lua_setuservalue(L, -2);
+  return db;
+}
+
+static struct stmt *new_stmt(lua_State *L, int db, const char *sql)
+{
+  struct stmt *stmt = alloc_stmt(L, db);
+
+  sqlite3 *handle = stmt->db->handle;
+  int status =
+      sqlite3_prepare_v2(handle, sql, strlen(sql), &stmt->handle, NULL);
+  if (status != SQLITE_OK)
+  {
+    luaL_error(L, "%s", sqlite3_errmsg(handle));
+  }
+
+  init_columns(stmt);
+  if (stmt->db->strict)
+    check_strict(L, -1);
+  return stmt;
+}
+
+static struct stmt *alloc_stmt(lua_State *L, int db)
+{
+  db = lua_absindex(L, db);
+
+  struct stmt *stmt = (struct stmt *)lua_newuserdata(L, sizeof(struct stmt));
+  stmt->handle = NULL;
+  stmt->db = (struct db *)lua_touserdata(L, db);
+  stmt->columns = NULL;
+  stmt->params = NULL;
+  stmt->compress_min = COMPRESS_MIN;
+  stmt->runs = 0;
+  stmt->used = now_ms();
+  stmt->yield_rows = 0;
+  stmt->since_yield = 0;
+  stmt->yield_ms = 0;
+  stmt->last_yield = stmt->used;
+
+  stmt->prev = NULL;
+  stmt->next = stmt->db->stmts;
+  if (stmt->next)
+    stmt->next->prev = stmt;
+  stmt->db->stmts = stmt;
+
+  luaL_getmetatable(L, "sqlite3.stmt");
+  lua_setmetatable(L, -2);
+
+  /* Lua 5.2 only takes a table as a uservalue. */
+  lua_createtable(L, 0, 1);
+  lua_pushvalue(L, db);
+  lua_setfield(L, -2, "db");
+  lua_setuservalue(L, -2);
+  return stmt;
+}
+
+/* Push the connection that a statement was prepared on. */
+static void push_stmt_db(lua_State *L, int index)
+{
+  lua_getuservalue(L, index);
+  lua_getfield(L, -1, "db");
+  lua_remove(L, -2);
+}
+
+static void init_columns(struct stmt *stmt)
+{
+  int count = sqlite3_column_count(stmt->handle);
+  for (int i = 0; i < count; ++i)
+  {
+    const char *decltype = sqlite3_column_decltype(stmt->handle, i);
+    if (decltype && !sqlite3_stricmp(decltype, "JSON"))
+      set_column_flag(stmt, i, COLUMN_JSON);
+  }
+}
+
+static void set_stmt_options(lua_State *L, int index, int options)
+{
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, index);
+  luaL_checktype(L, options, LUA_TTABLE);
+
+  lua_getfield(L, options, "json");
+  if (!lua_isnil(L, -1))
+    flag_columns(L, stmt, lua_gettop(L), COLUMN_JSON);
+  lua_pop(L, 1);
+
+  lua_getfield(L, options, "compress");
+  if (!lua_isnil(L, -1))
+    flag_compressed(L, stmt, lua_gettop(L));
+  lua_pop(L, 1);
+
+  lua_getfield(L, options, "compress_min");
+  if (!lua_isnil(L, -1))
+  {
+    lua_Number min = luaL_checknumber(L, -1);
+    luaL_argcheck(L, min >= 0, 3, "compress_min must not be negative");
+    stmt->compress_min = (size_t)min;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, options, "yield_every_rows");
+  if (!lua_isnil(L, -1))
+  {
+    lua_Integer rows = luaL_checkinteger(L, -1);
+    luaL_argcheck(L, rows >= 0, 3, "yield_every_rows must not be negative");
+    stmt->yield_rows = (unsigned long)rows;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, options, "yield_every_ms");
+  if (!lua_isnil(L, -1))
+  {
+    lua_Number ms = luaL_checknumber(L, -1);
+    luaL_argcheck(L, ms >= 0, 3, "yield_every_ms must not be negative");
+    stmt->yield_ms = ms;
+  }
+  lua_pop(L, 1);
+
+  /* Scheduler hooks are kept in a weak table of the connection, keyed by
+   * the statement. */
+  lua_getfield(L, options, "yield");
+  if (!lua_isnil(L, -1))
+  {
+    luaL_argcheck(L, lua_isfunction(L, -1), 3, "yield is not a function");
+    int top = lua_gettop(L);
+    push_stmt_db(L, index);
+    lua_getuservalue(L, top + 1);
+    lua_getfield(L, top + 2, "yield");
+    if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 1);
+      lua_newtable(L);
+      lua_createtable(L, 0, 1);
+      lua_pushliteral(L, "k");
+      lua_setfield(L, -2, "__mode");
+      lua_setmetatable(L, -2);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, top + 2, "yield");
+    }
+    lua_pushvalue(L, index);
+    lua_pushvalue(L, top);
+    lua_rawset(L, -3);
+    lua_settop(L, top);
+  }
+  lua_pop(L, 1);
+}
+
+/*
+ * Whether two option tables of prepare() hold the same options, other than
+ * cached. Column lists are compared by their contents, other values by
+ * identity.
+ */
+static int same_options(lua_State *L, int a, int b)
+{
+  int count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, b))
+  {
+    lua_pop(L, 1);
+    if (lua_type(L, -1) != LUA_TSTRING || strcmp(lua_tostring(L, -1), "cached"))
+      ++count;
+  }
+
+  lua_pushnil(L);
+  while (lua_next(L, a))
+  {
+    if (lua_type(L, -2) == LUA_TSTRING && !strcmp(lua_tostring(L, -2), "cached"))
+    {
+      lua_pop(L, 1);
+      continue;
+    }
+    --count;
+    lua_pushvalue(L, -2);
+    lua_rawget(L, b);
+    int same = lua_rawequal(L, -1, -2);
+    if (!same && lua_istable(L, -1) && lua_istable(L, -2) &&
+        lua_rawlen(L, -1) == lua_rawlen(L, -2))
+    {
+      same = 1;
+      for (int i = 1; same && i <= (int)lua_rawlen(L, -1); ++i)
+      {
+        lua_rawgeti(L, -1, i);
+        lua_rawgeti(L, -3, i);
+        same = lua_rawequal(L, -1, -2);
+        lua_pop(L, 2);
+      }
+    }
+    lua_pop(L, 2);
+    if (!same)
+    {
+      lua_pop(L, 1);
+      return 0;
+    }
+  }
+  return count == 0;
+}
+
+static void flag_columns(lua_State *L, struct stmt *stmt, int index, int flag)
+{
+  luaL_argcheck(L, lua_istable(L, index), 3, "column list is not a table");
+
+  int count = sqlite3_column_count(stmt->handle);
+  for (int n = 1;; ++n)
+  {
+    lua_rawgeti(L, index, n);
+    const char *name = lua_tostring(L, -1);
+    if (!name)
+      break;
+
+    int i = 0;
+    while (i < count && strcmp(name, sqlite3_column_name(stmt->handle, i)))
+      ++i;
+    if (i == count)
+      luaL_error(L, "no such column: %s", name);
+
+    set_column_flag(stmt, i, flag);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+static void set_column_flag(struct stmt *stmt, int column, int flag)
+{
+  if (!stmt->columns)
+  {
+    stmt->columns = calloc(sqlite3_column_count(stmt->handle), 1);
+    if (!stmt->columns)
+      return;
+  }
+  stmt->columns[column] |= flag;
+}
+
+static void flag_compressed(lua_State *L, struct stmt *stmt, int index)
+{
+  luaL_argcheck(L, lua_istable(L, index), 3, "column list is not a table");
+
+  int ncolumns = sqlite3_column_count(stmt->handle);
+  int nparams = sqlite3_bind_parameter_count(stmt->handle);
+  for (int n = 1;; ++n)
+  {
+    lua_rawgeti(L, index, n);
+    const char *name = lua_tostring(L, -1);
+    if (!name)
+      break;
+
+    int found = 0;
+    for (int i = 0; i < ncolumns; ++i)
+    {
+      if (!strcmp(name, sqlite3_column_name(stmt->handle, i)))
+      {
+        set_column_flag(stmt, i, COLUMN_COMPRESSED);
+        found = 1;
+      }
+    }
+    for (int i = 1; i <= nparams; ++i)
+    {
+      const char *param = sqlite3_bind_parameter_name(stmt->handle, i);
+      if (param && is_named_parameter(param) && !strcmp(name, param + 1))
+      {
+        if (!stmt->params && !(stmt->params = calloc(nparams, 1)))
+          luaL_error(L, "out of memory");
+        stmt->params[i - 1] = 1;
+        found = 1;
+      }
+    }
+    if (!found)
+      luaL_error(L, "no such column or parameter: %s", name);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+static int bind_stmt(lua_State *L, struct stmt *stmt, int nargs)
+{
+  int top = lua_gettop(L);
+  record_begin(stmt);
+  if (top < nargs + 1)
+    return bind_lua_vars(L, stmt);
+  else if (lua_istable(L, nargs + 1))
+    return bind_params(L, stmt);
+  else
+    return bind_varargs(L, top - nargs, stmt);
+}
+
+static int bind_params(lua_State *L, struct stmt *stmt)
+{
+  int count = sqlite3_bind_parameter_count(stmt->handle);
+  int status = SQLITE_OK;
+
+  for (int i = 1; i <= count; ++i)
+  {
+    const char *name = sqlite3_bind_parameter_name(stmt->handle, i);
+    if (!name || name[0] == '?')
+    {
+#if LUA_VERSION_NUM >= 503
+      lua_geti(L, -1, i);
+#else
+      lua_pushinteger(L, i);
+      lua_gettable(L, -2);
+#endif
+    }
+    else
+    {
+      lua_getfield(L, -1, name + 1);
+    }
+    status = bind_one_param(L, stmt, i);
+    if (status != SQLITE_OK)
+      break;
+  }
+  lua_pop(L, 1);
+  return status;
+}
+
+static int bind_one_param(lua_State *L, struct stmt *stmt, int index)
+{
+  int status = SQLITE_OK;
+
+  if (lua_istable(L, -1))
+  {
+    json_encode(L, -1);
+    lua_replace(L, -2);
+  }
+
+  if (lua_isstring(L, -1))
+  {
+    size_t len;
+    const char *text = lua_tolstring(L, -1, &len);
+    if (stmt->params && stmt->params[index - 1] && len >= stmt->compress_min)
+    {
+      size_t outlen;
+      unsigned char *data =
+          compress_value(text, len, 't', Z_DEFAULT_COMPRESSION, &outlen);
+      if (!data)
+        return luaL_error(L, "failed to compress parameter %d", index);
+      if (outlen < len)
+      {
+        record_param(stmt, index, 'b', data, outlen);
+        status = sqlite3_bind_blob64(stmt->handle, index, data, outlen,
+                                     sqlite3_free);
+      }
+      else
+      {
+        sqlite3_free(data);
+        record_param(stmt, index, 't', text, len);
+        status =
+            sqlite3_bind_text(stmt->handle, index, text, len, SQLITE_TRANSIENT);
+      }
+    }
+    else
+    {
+      record_param(stmt, index, 't', text, len);
+      status =
+          sqlite3_bind_text(stmt->handle, index, text, len, SQLITE_TRANSIENT);
+    }
+#if LUA_VERSION_NUM >= 503
+  }
+  else if (lua_isinteger(L, -1))
+  {
+    sqlite3_int64 value = lua_tointeger(L, -1);
+    record_param(stmt, index, 'i', &value, sizeof(value));
+    status = sqlite3_bind_int64(stmt->handle, index, value);
+#endif
+  }
+  else if (lua_isnumber(L, -1))
+  {
+    double value = lua_tonumber(L, -1);
+    record_param(stmt, index, 'f', &value, sizeof(value));
+    status = sqlite3_bind_double(stmt->handle, index, value);
+  }
+  else if (lua_isnil(L, -1))
+  {
+    record_param(stmt, index, 'n', NULL, 0);
+    status = sqlite3_bind_null(stmt->handle, index);
+  }
+  else
+  {
+    return luaL_error(L, "unsupported lua type '%s' at position %d",
+                      lua_typename(L, lua_type(L, -1)), index);
+  }
+
+  lua_pop(L, 1);
+  return status;
+}
+
+static int bind_varargs(lua_State *L, int nparams, struct stmt *stmt)
+{
+  int count = sqlite3_bind_parameter_count(stmt->handle);
+
+  lua_settop(L, lua_gettop(L) + (count - nparams));
+
+  int status = SQLITE_OK;
+  while (count > 0)
+  {
+    status = bind_one_param(L, stmt, count--);
+    if (status != SQLITE_OK)
+      break;
+  }
+  return status;
+}
+
+static int bind_lua_vars(lua_State *L, struct stmt *stmt)
+{
+  int count = sqlite3_bind_parameter_count(stmt->handle);
+  int status = SQLITE_OK;
+
+  for (int i = 1; i <= count; ++i)
+  {
+    const char *name = sqlite3_bind_parameter_name(stmt->handle, i);
+    if (!name || !is_named_parameter(name))
+    {
+      return luaL_error(L, "anonymous and numbered parameters not supported");
+    }
+
+    find_var(L, name + 1);
+    status = bind_one_param(L, stmt, i);
+    if (status != SQLITE_OK)
+      break;
+  }
+  return status;
+}
+
+static int is_named_parameter(const char *name)
+{
+  return name[0] == ':' || name[0] == '@' || name[0] == '$';
+}
+
+static void find_var(lua_State *L, const char *name)
+{
+  lua_Debug debug;
+  for (int level = 1; lua_getstack(L, level, &debug); ++level)
+  {
+    int index = 1;
+    const char *lname;
+    while ((lname = lua_getlocal(L, &debug, index++)))
+    {
+      if (!strcmp(name, lname))
+        return;
+      lua_pop(L, 1);
+    }
+  }
+  lua_getglobal(L, name);
+}
+
+static int iter(lua_State *L)
+{
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, lua_upvalueindex(1));
+  if (stmt->yield_rows || stmt->yield_ms > 0)
+  {
+    if ((stmt->yield_rows && stmt->since_yield >= stmt->yield_rows) ||
+        (stmt->yield_ms > 0 && now_ms() - stmt->last_yield >= stmt->yield_ms))
+      return yield_iter(L);
+    stmt->since_yield++;
+  }
+  return step(L, stmt);
+}
+
+/*
+ * Let other work run before stepping to the next row, by calling the
+ * scheduler hook of the statement or else yielding the running coroutine.
+ * The statement stays positioned, and the row is returned once control
+ * comes back.
+ */
+static int yield_iter(lua_State *L)
+{
+  push_stmt_db(L, lua_upvalueindex(1));
+  lua_getuservalue(L, -1);
+  lua_getfield(L, -1, "yield");
+  if (lua_istable(L, -1))
+  {
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_rawget(L, -2);
+    if (lua_isfunction(L, -1))
+    {
+      lua_callk(L, 0, 0, 0, resume_iter);
+      return continue_iter(L);
+    }
+  }
+  if (is_yieldable(L))
+    return lua_yieldk(L, 0, 0, resume_iter);
+  return continue_iter(L);
+}
+
+#if LUA_VERSION_NUM >= 503
+static int resume_iter(lua_State *L, int status, lua_KContext ctx)
+{
+  return continue_iter(L);
+}
+#else
+static int resume_iter(lua_State *L) { return continue_iter(L); }
+#endif
+
+static int continue_iter(lua_State *L)
+{
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, lua_upvalueindex(1));
+  stmt->since_yield = 1;
+  stmt->last_yield = now_ms();
+  return step(L, stmt);
+}
+
+static int step_one(lua_State *L, struct stmt *stmt)
+{
+  if (step(L, stmt) == 0)
+    luaL_error(L, "no results");
+
+  if (step(L, stmt) != 0)
+  {
+    luaL_error(L, "too many results");
+  }
+  return 1;
+}
+
+static int step_all(lua_State *L, struct stmt *stmt)
+{
+  lua_newtable(L);
+  for (int i = 1; step(L, stmt); ++i)
+    lua_rawseti(L, -2, i);
+  return 1;
+}
+
+static int step(lua_State *L, struct stmt *stmt)
+{
+  if (!stmt->handle)
+    luaL_error(L, "statement is closed");
+  int status = step_stmt(stmt);
+  if (status != SQLITE_ROW)
+  {
+    if (status != SQLITE_DONE)
+    {
+      raise_collate_error(L, stmt->db);
+      luaL_error(L, "step: %s",
+                 sqlite3_errmsg(sqlite3_db_handle(stmt->handle)));
+    }
+    return 0;
+  }
+
+  handle_row(L, stmt);
+  return 1;
+}
+
+static void handle_row(lua_State *L, struct stmt *stmt)
+{
+  int count = sqlite3_data_count(stmt->handle);
+
+  lua_createtable(L, 0, count);
+  for (int i = 0; i < count; ++i)
+  {
+    lua_pushstring(L, sqlite3_column_name(stmt->handle, i));
+    push_column(L, stmt, i);
+    lua_rawset(L, -3);
+  }
+}
+
+static void push_column(lua_State *L, struct stmt *stmt, int column)
+{
+  sqlite3_stmt *handle = stmt->handle;
+
+  switch (sqlite3_column_type(handle, column))
+  {
+  case SQLITE_INTEGER:
+    lua_pushinteger(L, sqlite3_column_int64(handle, column));
+    break;
+  case SQLITE_FLOAT:
+    lua_pushnumber(L, sqlite3_column_double(handle, column));
+    break;
+  case SQLITE_TEXT:
+  case SQLITE_BLOB:
+    push_text(L, stmt, column);
+    break;
+  case SQLITE_NULL:
+  default:
+    lua_pushnil(L);
+    break;
+  }
+}
+
+static void push_text(lua_State *L, struct stmt *stmt, int column)
+{
+  sqlite3_stmt *handle = stmt->handle;
+  int flags = stmt->columns ? stmt->columns[column] : 0;
+  int type = sqlite3_column_type(handle, column);
+  const char *data = (const char *)sqlite3_column_blob(handle, column);
+  size_t len = sqlite3_column_bytes(handle, column);
+
+  if ((flags & COLUMN_COMPRESSED) && type == SQLITE_BLOB &&
+      is_compressed(data, len))
+  {
+    unsigned char *text = decompress_value(data, len, &len);
+    if (!text)
+      luaL_error(L, "corrupt compressed value in column '%s'",
+                 sqlite3_column_name(handle, column));
+    lua_pushlstring(L, (const char *)text, len);
+    sqlite3_free(text);
+    if (flags & COLUMN_JSON)
+    {
+      data = lua_tolstring(L, -1, &len);
+      json_decode(L, data, len);
+      lua_remove(L, -2);
+    }
+  }
+  else if ((flags & COLUMN_JSON) && type == SQLITE_TEXT)
+    json_decode(L, data, len);
+  else
+    lua_pushlstring(L, data, len);
+}
+
+static int insert_columns(lua_State *L)
+{
+  struct stmt *stmt = check_stmt(L, 1);
+  int count = sqlite3_bind_parameter_count(stmt->handle);
+  luaL_checkstack(L, count + 1, "too many parameters");
+
+  lua_rawgeti(L, 2, 1);
+  int named = lua_isnil(L, -1);
+  lua_pop(L, 1);
+
+  size_t rows = 0;
+  for (int i = 1; i <= count; ++i)
+  {
+    const char *name = sqlite3_bind_parameter_name(stmt->handle, i);
+    if (named)
+    {
+      if (!name || !is_named_parameter(name))
+        return luaL_error(L, "anonymous and numbered parameters need "
+                             "column arrays in parameter order");
+      lua_getfield(L, 2, name + 1);
+    }
+    else
+      lua_rawgeti(L, 2, i);
+
+    if (!lua_istable(L, -1))
+      return luaL_error(L, "no column array for parameter %d", i);
+    size_t len = lua_rawlen(L, -1);
+    if (i > 1 && len != rows)
+      return luaL_error(L, "column arrays have different lengths");
+    rows = len;
+  }
+
+  sqlite3 *db = sqlite3_db_handle(stmt->handle);
+  lua_Integer changes = 0;
+  for (size_t row = 1; row <= rows; ++row)
+  {
+    sqlite3_reset(stmt->handle);
+    for (int i = 1; i <= count; ++i)
+    {
+      lua_rawgeti(L, 2 + i, row);
+      if (bind_one_param(L, stmt, i) != SQLITE_OK)
+        return luaL_error(L, "%s", sqlite3_errmsg(db));
+    }
+    if (step_stmt(stmt) != SQLITE_DONE)
+    {
+      raise_collate_error(L, stmt->db);
+      return luaL_error(L, "%s", sqlite3_errmsg(db));
+    }
+    changes += sqlite3_changes(db);
+  }
+
+  lua_pushinteger(L, changes);
+  return 1;
+}
+
+static int update_many(lua_State *L)
+{
+  struct stmt *stmt = check_stmt(L, 1);
+  struct sorted_row *sorted = (struct sorted_row *)lua_touserdata(L, 3);
+  size_t count = lua_rawlen(L, 2);
+  sqlite3 *db = sqlite3_db_handle(stmt->handle);
+
+  lua_Integer changes = 0;
+  for (size_t i = 0; i < count; ++i)
+  {
+    lua_rawgeti(L, 2, sorted ? sorted[i].row : (lua_Integer)i + 1);
+    if (!lua_istable(L, -1))
+      return luaL_error(L, "row %d is not a table", (int)i + 1);
+    record_begin(stmt);
+    if (bind_params(L, stmt) != SQLITE_OK || step_stmt(stmt) != SQLITE_DONE)
+    {
+      raise_collate_error(L, stmt->db);
+      return luaL_error(L, "%s", sqlite3_errmsg(db));
+    }
+    changes += sqlite3_changes(db);
+    sqlite3_reset(stmt->handle);
+  }
+
+  lua_pushinteger(L, changes);
+  return 1;
+}
+
+static int update_packed(lua_State *L)
+{
+  struct stmt *stmt = check_stmt(L, 1);
+  struct pack_format format;
+  parse_pack_format(L, lua_tostring(L, 2), &format);
+
+  int count = sqlite3_bind_parameter_count(stmt->handle);
+  if (format.fields != count)
+    return luaL_error(L, "format has %d fields but statement has %d parameters",
+                      format.fields, count);
+
+  size_t len;
+  const unsigned char *data = (const unsigned char *)lua_tolstring(L, 3, &len);
+  const unsigned char *end = data + len;
+  sqlite3 *db = sqlite3_db_handle(stmt->handle);
+  lua_Integer changes = 0;
+
+  for (const unsigned char *pos = data; pos < end;)
+  {
+    const unsigned char *record = pos;
+    sqlite3_reset(stmt->handle);
+
+    int param = 0, status = SQLITE_OK;
+    for (int i = 0; i < format.count && status == SQLITE_OK; ++i)
+    {
+      struct pack_item *item = &format.items[i];
+      pos += pack_padding(pos - record, item->align);
+      size_t size = item->type == 'z' ? 0 : item->size;
+      if (pos > end || size > (size_t)(end - pos))
+        return luaL_error(L, "data string too short");
+
+      sqlite3_uint64 bits;
+      switch (item->type)
+      {
+      case 'i':
+      case 'u':
+        bits = unpack_int(pos, size, item->little, item->type == 'i');
+        status = sqlite3_bind_int64(stmt->handle, ++param, (sqlite3_int64)bits);
+        break;
+      case 'f':
+      {
+        unsigned int u = unpack_int(pos, size, item->little, 0);
+        float f;
+        memcpy(&f, &u, sizeof(f));
+        status = sqlite3_bind_double(stmt->handle, ++param, f);
+        break;
+      }
+      case 'd':
+      {
+        bits = unpack_int(pos, size, item->little, 0);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        status = sqlite3_bind_double(stmt->handle, ++param, d);
+        break;
+      }
+      case 's':
+        bits = unpack_int(pos, size, item->little, 0);
+        pos += size;
+        if (bits > (sqlite3_uint64)(end - pos))
+          return luaL_error(L, "data string too short");
+        size = bits;
+        /* fall through */
+      case 'c':
+        status = sqlite3_bind_text(stmt->handle, ++param, (const char *)pos,
+                                   size, SQLITE_STATIC);
+        break;
+      case 'z':
+      {
+        const unsigned char *zero = memchr(pos, 0, end - pos);
+        if (!zero)
+          return luaL_error(L, "unfinished string for format 'z'");
+        size = zero - pos;
+        status = sqlite3_bind_text(stmt->handle, ++param, (const char *)pos,
+                                   size, SQLITE_STATIC);
+        ++size;
+        break;
+      }
+      }
+      pos += size;
+    }
+
+    if (status != SQLITE_OK || sqlite3_step(stmt->handle) != SQLITE_DONE)
+      return luaL_error(L, "%s", sqlite3_errmsg(db));
+    changes += sqlite3_changes(db);
+    if (pos == record)
+      return luaL_error(L, "format does not consume any data");
+  }
+
+  lua_pushinteger(L, changes);
+  return 1;
+}
+
+static int insert_rtree(lua_State *L)
+{
+  struct stmt *stmt = check_stmt(L, 1);
+  struct rtree_entry *entries = (struct rtree_entry *)lua_touserdata(L, 2);
+  size_t count = lua_rawlen(L, 2) / sizeof(struct rtree_entry);
+  int columns = sqlite3_bind_parameter_count(stmt->handle);
+  sqlite3 *db = sqlite3_db_handle(stmt->handle);
+
+  for (size_t i = 0; i < count; ++i)
+  {
+    lua_rawgeti(L, 3, entries[i].row);
+    for (int c = 1; c <= columns; ++c)
+    {
+      lua_rawgeti(L, -1, c);
+      bind_one_param(L, stmt, c);
+    }
+    if (sqlite3_step(stmt->handle) != SQLITE_DONE)
+      return luaL_error(L, "%s", sqlite3_errmsg(db));
+    sqlite3_reset(stmt->handle);
+    lua_pop(L, 1);
+  }
+
+  lua_pushinteger(L, (lua_Integer)count);
+  return 1;
+}
+
+/*
+ * Build the statement inserting into an R*Tree table, or selecting the ids
+ * of the entries within a bounding box, storing the number of dimensions in
+ * dims. Tables that are not R*Tree tables with 1 to 5 pairs of coordinates
+ * after the id get 0 dimensions. Auxiliary columns follow the coordinates;
+ * their number is that of the extra columns of the %_rowid shadow table.
+ * Returns NULL if the table cannot be read.
+ */
+static char *rtree_sql(sqlite3 *handle, const char *table, int within,
+                       int *dims)
+{
+  sqlite3_stmt *stmt;
+  char *sql = sqlite3_mprintf("SELECT * FROM \"%w\"", table);
+  int status = sql ? sqlite3_prepare_v2(handle, sql, -1, &stmt, NULL)
+                   : SQLITE_NOMEM;
+  sqlite3_free(sql);
+  if (status != SQLITE_OK)
+    return NULL;
+
+  int columns = sqlite3_column_count(stmt), coordinates = 0;
+  sqlite3_stmt *schema;
+  if (sqlite3_prepare_v2(handle,
+                         "SELECT 1 FROM sqlite_master WHERE name = ? "
+                         "AND sql LIKE 'CREATE VIRTUAL TABLE %USING rtree%'",
+                         -1, &schema, NULL) == SQLITE_OK)
+  {
+    sqlite3_bind_text(schema, 1, table, -1, SQLITE_STATIC);
+    if (sqlite3_step(schema) == SQLITE_ROW)
+      coordinates = columns - 1;
+    sqlite3_finalize(schema);
+  }
+
+  sql = coordinates ? sqlite3_mprintf("SELECT * FROM \"%w_rowid\"", table)
+                    : NULL;
+  if (sql && sqlite3_prepare_v2(handle, sql, -1, &schema, NULL) == SQLITE_OK)
+  {
+    coordinates -= sqlite3_column_count(schema) - 2;
+    sqlite3_finalize(schema);
+  }
+  sqlite3_free(sql);
+  *dims = coordinates % 2 == 0 && coordinates >= 2 &&
+                  coordinates <= 2 * RTREE_MAX_DIMS
+              ? coordinates / 2
+              : 0;
+
+  sqlite3_str *s = sqlite3_str_new(handle);
+  if (within)
+  {
+    sqlite3_str_appendf(s, "SELECT \"%w\" FROM \"%w\" WHERE ",
+                        sqlite3_column_name(stmt, 0), table);
+    for (int k = 0; k < *dims; ++k)
+      sqlite3_str_appendf(s, "%s\"%w\" >= ? AND \"%w\" <= ?",
+                          k ? " AND " : "",
+                          sqlite3_column_name(stmt, 2 * k + 1),
+                          sqlite3_column_name(stmt, 2 * k + 2));
+  }
+  else
+  {
+    sqlite3_str_appendf(s, "INSERT INTO \"%w\" VALUES (?", table);
+    for (int c = 1; c < columns; ++c)
+      sqlite3_str_appendall(s, ", ?");
+    sqlite3_str_appendall(s, ")");
+  }
+  sqlite3_finalize(stmt);
+  return sqlite3_str_finish(s);
+}
+
+/* Return the cached bounding box query for an R*Tree table, preparing it
+ * again if it has not been prepared yet or was finalized by db:trim(). */
+static struct stmt *rtree_stmt(lua_State *L, int db, const char *table)
+{
+  int top = lua_gettop(L);
+  lua_getuservalue(L, db);
+  lua_getfield(L, top + 1, "rtree");
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, top + 1, "rtree");
+  }
+  lua_getfield(L, top + 2, table);
+
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, -1);
+  if (!stmt || !stmt->handle)
+  {
+    sqlite3 *handle = check_db(L, db)->handle;
+    int dims;
+    char *sql = rtree_sql(handle, table, 1, &dims);
+    if (!sql)
+      luaL_error(L, "%s", sqlite3_errmsg(handle));
+    lua_pushstring(L, sql);
+    sqlite3_free(sql);
+    if (!dims)
+      luaL_error(L, "%s is not an R*Tree table", table);
+    stmt = new_stmt(L, db, lua_tostring(L, -1));
+    lua_setfield(L, top + 2, table);
+  }
+  lua_settop(L, top);
+  touch_stmt(stmt);
+  return stmt;
+}
+
+/*
+ * Sort entries in Sort-Tile-Recursive order: by the centre in the first
+ * dimension, then in slabs of whole nodes by the next dimension, so that
+ * entries inserted one after another end up in the same node.
+ */
+static void str_sort(struct rtree_entry *entries, size_t n, int dim, int dims,
+                     size_t capacity)
+{
+  for (size_t i = 0; i < n; ++i)
+    entries[i].key = entries[i].center[dim];
+  qsort(entries, n, sizeof(struct rtree_entry), compare_rtree_entry);
+  if (dim == dims - 1 || n <= capacity)
+    return;
+
+  size_t nodes = (n + capacity - 1) / capacity;
+  size_t slabs = (size_t)ceil(pow((double)nodes, 1.0 / (dims - dim)));
+  size_t slab = capacity * ((nodes + slabs - 1) / slabs);
+  for (size_t i = 0; i < n; i += slab)
+    str_sort(entries + i, n - i < slab ? n - i : slab, dim + 1, dims,
+             capacity);
+}
+
+static int compare_rtree_entry(const void *a, const void *b)
+{
+  double x = ((const struct rtree_entry *)a)->key;
+  double y = ((const struct rtree_entry *)b)->key;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Push an array of rows sorted by the fields named in by, a field name or an
+ * array of them, comparing values the way SQLite orders them with the
+ * BINARY collation. Rows with equal keys keep their order. The text keys
+ * point into the rows table, which must not change while the array is used.
+ */
+static void sort_rows(lua_State *L, int rows, int by)
+{
+  int nkeys = lua_istable(L, by) ? (int)lua_rawlen(L, by) : 1;
+  luaL_argcheck(L, nkeys > 0, 3, "sort_by is empty");
+
+  size_t count = lua_rawlen(L, rows);
+  struct sorted_row *sorted = (struct sorted_row *)lua_newuserdata(
+      L, count * (sizeof(struct sorted_row) + nkeys * sizeof(struct sort_key)));
+  struct sort_key *keys = (struct sort_key *)(sorted + count);
+  for (size_t i = 0; i < count; ++i)
+  {
+    sorted[i].row = (int)i + 1;
+    sorted[i].nkeys = nkeys;
+    sorted[i].keys = keys + i * nkeys;
+    lua_rawgeti(L, rows, (lua_Integer)i + 1);
+    if (!lua_istable(L, -1))
+      luaL_error(L, "row %d is not a table", (int)i + 1);
+    for (int k = 0; k < nkeys; ++k)
+    {
+      if (lua_istable(L, by))
+        lua_rawgeti(L, by, k + 1);
+      else
+        lua_pushvalue(L, by);
+      lua_gettable(L, -2);
+      set_sort_key(L, &sorted[i].keys[k]);
+    }
+    lua_pop(L, 1);
+  }
+  qsort(sorted, count, sizeof(struct sorted_row), compare_sorted_row);
+}
+
+static void set_sort_key(lua_State *L, struct sort_key *key)
+{
+  switch (lua_type(L, -1))
+  {
+  case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, -1))
+    {
+      key->type = SQLITE_INTEGER;
+      key->integer = lua_tointeger(L, -1);
+      key->number = (double)key->integer;
+      break;
+    }
+#endif
+    key->type = SQLITE_FLOAT;
+    key->number = lua_tonumber(L, -1);
+    break;
+  case LUA_TBOOLEAN:
+    key->type = SQLITE_INTEGER;
+    key->integer = lua_toboolean(L, -1);
+    key->number = (double)key->integer;
+    break;
+  case LUA_TSTRING:
+    key->type = SQLITE_TEXT;
+    key->text = lua_tolstring(L, -1, &key->len);
+    break;
+  default:
+    key->type = SQLITE_NULL;
+    break;
+  }
+  lua_pop(L, 1);
+}
+
+static int compare_sorted_row(const void *a, const void *b)
+{
+  static const int ranks[] = {0, 1, 1, 2, 3, 0};
+
+  const struct sorted_row *x = (const struct sorted_row *)a;
+  const struct sorted_row *y = (const struct sorted_row *)b;
+  for (int k = 0; k < x->nkeys; ++k)
+  {
+    const struct sort_key *p = &x->keys[k], *q = &y->keys[k];
+    int rank = ranks[p->type];
+    if (rank != ranks[q->type])
+      return rank < ranks[q->type] ? -1 : 1;
+    if (rank == 1)
+    {
+      if (p->type == SQLITE_INTEGER && q->type == SQLITE_INTEGER)
+      {
+        if (p->integer != q->integer)
+          return p->integer < q->integer ? -1 : 1;
+      }
+      else if (p->number != q->number)
+        return p->number < q->number ? -1 : 1;
+    }
+    else if (rank == 2)
+    {
+      int c = memcmp(p->text, q->text, p->len < q->len ? p->len : q->len);
+      if (c || p->len != q->len)
+        return c ? c : p->len < q->len ? -1 : 1;
+    }
+  }
+  return x->row < y->row ? -1 : x->row > y->row;
+}
+
+/*
+ * Call f with the arguments of a statement method inside a savepoint, which
+ * is rolled back if f raises an error. The statement is reset and its
+ * bindings cleared afterwards.
+ */
+static int in_savepoint(lua_State *L, lua_CFunction f)
+{
+  struct stmt *prepared = check_stmt(L, 1);
+  touch_stmt(prepared);
+  sqlite3_stmt *stmt = prepared->handle;
+  sqlite3 *db = sqlite3_db_handle(stmt);
+  int status = sqlite3_exec(db, "SAVEPOINT clutch_savepoint", NULL, NULL, NULL);
+  if (status != SQLITE_OK)
+  {
+    return luaL_error(L, "%s", sqlite3_errmsg(db));
+  }
+
+  int nargs = lua_gettop(L);
+  lua_pushcfunction(L, f);
+  lua_insert(L, 1);
+  status = lua_pcall(L, nargs, 1, 0);
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+
+  if (status != LUA_OK)
+  {
+    sqlite3_exec(db, "ROLLBACK TO clutch_savepoint", NULL, NULL, NULL);
+    sqlite3_exec(db, "RELEASE clutch_savepoint", NULL, NULL, NULL);
+    return lua_error(L);
+  }
+  sqlite3_exec(db, "RELEASE clutch_savepoint", NULL, NULL, NULL);
+  return 1;
+}
+
+/*
+ * Parse a string.pack() format. Integers of 1 to 8 bytes, floats, doubles
+ * and the string options s, z and c are supported, as are endianness and
+ * alignment options and x for padding.
+ */
+static void parse_pack_format(lua_State *L, const char *fmt,
+                              struct pack_format *format)
+{
+  int little = is_little_endian();
+  int max_align = 1;
+
+  format->count = format->fields = 0;
+  while (*fmt)
+  {
+    char opt = *fmt++;
+    char type;
+    int size;
+
+    switch (opt)
+    {
+    case ' ':
+      continue;
+    case '<':
+      little = 1;
+      continue;
+    case '>':
+      little = 0;
+      continue;
+    case '=':
+      little = is_little_endian();
+      continue;
+    case '!':
+      max_align = read_pack_size(&fmt, PACK_MAX_ALIGN);
+      continue;
+    case 'b':
+    case 'B':
+      type = opt == 'b' ? 'i' : 'u';
+      size = 1;
+      break;
+    case 'h':
+    case 'H':
+      type = opt == 'h' ? 'i' : 'u';
+      size = sizeof(short);
+      break;
+    case 'i':
+    case 'I':
+      type = opt == 'i' ? 'i' : 'u';
+      size = read_pack_size(&fmt, sizeof(int));
+      break;
+    case 'l':
+    case 'L':
+      type = opt == 'l' ? 'i' : 'u';
+      size = sizeof(long);
+      break;
+    case 'j':
+    case 'J':
+      type = opt == 'j' ? 'i' : 'u';
+      size = sizeof(lua_Integer);
+      break;
+    case 'T':
+      type = 'u';
+      size = sizeof(size_t);
+      break;
+    case 'f':
+      type = 'f';
+      size = sizeof(float);
+      break;
+    case 'n':
+    case 'd':
+      type = opt == 'n' && sizeof(lua_Number) == sizeof(float) ? 'f' : 'd';
+      size = type == 'f' ? sizeof(float) : sizeof(double);
+      break;
+    case 's':
+      type = 's';
+      size = read_pack_size(&fmt, sizeof(size_t));
+      break;
+    case 'z':
+      type = 'z';
+      size = 0;
+      break;
+    case 'c':
+      type = 'c';
+      size = read_pack_size(&fmt, -1);
+      if (size < 0)
+        luaL_error(L, "missing size for format option 'c'");
+      break;
+    case 'x':
+      type = 'x';
+      size = 1;
+      break;
+    default:
+      luaL_error(L, "invalid format option '%c'", opt);
+      return;
+    }
+
+    if ((type == 'i' || type == 'u' || type == 's') && (size < 1 || size > 8))
+      luaL_error(L, "integral size (%d) out of limits [1,8]", size);
+    if (type == 'c' && size > 255)
+      luaL_error(L, "size of format option 'c' out of limits [0,255]");
+    if (format->count == PACK_MAX_ITEMS)
+      luaL_error(L, "format has too many options");
+
+    int align = 1;
+    if (type != 'c' && type != 'z' && type != 'x')
+      align = size < max_align ? size : max_align;
+    if (align & (align - 1))
+      luaL_error(L, "format asks for alignment not power of 2");
+
+    struct pack_item *item = &format->items[format->count++];
+    item->type = type;
+    item->size = size;
+    item->align = align;
+    item->little = little;
+    if (type != 'x')
+      format->fields++;
+  }
+}
+
+static int read_pack_size(const char **fmt, int size)
+{
+  if (!isdigit((unsigned char)**fmt))
+    return size;
+
+  size = 0;
+  while (isdigit((unsigned char)**fmt) && size < 1000)
+    size = size * 10 + *(*fmt)++ - '0';
+  return size;
+}
+
+static int is_little_endian(void)
+{
+  const unsigned int one = 1;
+  return *(const unsigned char *)&one;
+}
+
+static size_t pack_padding(size_t pos, int align)
+{
+  return align > 1 ? (align - pos % align) % align : 0;
+}
+
+static void pack_int(unsigned char *p, sqlite3_uint64 value, int size,
+                     int little)
+{
+  for (int i = 0; i < size; ++i)
+    p[little ? i : size - 1 - i] = (value >> (8 * i)) & 0xff;
+}
+
+static sqlite3_uint64 unpack_int(const unsigned char *p, int size, int little,
+                                 int is_signed)
+{
+  sqlite3_uint64 value = 0;
+  for (int i = 0; i < size; ++i)
+    value |= (sqlite3_uint64)p[little ? i : size - 1 - i] << (8 * i);
+  if (is_signed && size < 8 && (value >> (8 * size - 1)) & 1)
+    value |= ~0ULL << (8 * size);
+  return value;
+}
+
+static void check_pack_columns(lua_State *L, struct stmt *stmt,
+                               struct pack_format *format)
+{
+  int count = sqlite3_column_count(stmt->handle);
+  if (format->fields != count)
+    luaL_error(L, "format has %d fields but statement has %d columns",
+               format->fields, count);
+}
+
+static int pack_iter(lua_State *L)
+{
+  if (lua_toboolean(L, lua_upvalueindex(5)))
+    return 0;
+
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, lua_upvalueindex(1));
+  struct pack_format *format = lua_touserdata(L, lua_upvalueindex(4));
+  lua_Integer limit = lua_tointeger(L, lua_upvalueindex(3));
+
+  int rows = pack_rows(L, stmt, format, limit);
+  if (rows < limit)
+  {
+    lua_pushboolean(L, 1);
+    lua_replace(L, lua_upvalueindex(5));
+  }
+  if (rows == 0)
+    return 0;
+
+  lua_pushinteger(L, rows);
+  return 2;
+}
+
+/*
+ * Step through at most limit rows, or all rows if limit is zero, encoding
+ * them one after another according to format into a string that is left on
+ * the stack. Returns the number of rows encoded.
+ */
+static int pack_rows(lua_State *L, struct stmt *stmt,
+                     struct pack_format *format, lua_Integer limit)
+{
+  struct buffer b;
+  buffer_init(L, &b);
+
+  int rows = 0, status = SQLITE_DONE;
+  while ((limit == 0 || rows < limit) &&
+         (status = sqlite3_step(stmt->handle)) == SQLITE_ROW)
+  {
+    size_t record = b.len;
+    int column = 0;
+    for (int i = 0; i < format->count; ++i)
+    {
+      struct pack_item *item = &format->items[i];
+      size_t padding = pack_padding(b.len - record, item->align);
+      buffer_reserve(L, &b, padding + 8);
+      memset(b.data + b.len, 0, padding);
+      b.len += padding;
+
+      if (item->type == 'x')
+        buffer_addchar(L, &b, 0);
+      else
+        pack_column(L, &b, stmt, column++, item);
+    }
+    ++rows;
+  }
+  if ((limit == 0 || rows < limit) && status != SQLITE_DONE)
+    luaL_error(L, "step: %s",
+               sqlite3_errmsg(sqlite3_db_handle(stmt->handle)));
+
+  buffer_push(L, &b);
+  return rows;
+}
+
+static void pack_column(lua_State *L, struct buffer *b, struct stmt *stmt,
+                        int column, struct pack_item *item)
+{
+  sqlite3_stmt *handle = stmt->handle;
+  int type = sqlite3_column_type(handle, column);
+  unsigned char *p = (unsigned char *)b->data + b->len;
+
+  switch (item->type)
+  {
+  case 'i':
+  case 'u':
+  {
+    sqlite3_int64 value = sqlite3_column_int64(handle, column);
+    if (type == SQLITE_FLOAT &&
+        sqlite3_column_double(handle, column) != (double)value)
+      luaL_error(L, "number has no integer representation in column '%s'",
+                 sqlite3_column_name(handle, column));
+
+    int bits = 8 * item->size;
+    if (bits < 64 &&
+        (item->type == 'i'
+             ? value < -((sqlite3_int64)1 << (bits - 1)) ||
+                   value >= ((sqlite3_int64)1 << (bits - 1))
+             : value < 0 || value >= ((sqlite3_int64)1 << bits)))
+      luaL_error(L, "integer overflow in column '%s'",
+                 sqlite3_column_name(handle, column));
+
+    pack_int(p, (sqlite3_uint64)value, item->size, item->little);
+    b->len += item->size;
+    break;
+  }
+  case 'f':
+  {
+    float f = sqlite3_column_double(handle, column);
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(f));
+    pack_int(p, bits, item->size, item->little);
+    b->len += item->size;
+    break;
+  }
+  case 'd':
+  {
+    double d = sqlite3_column_double(handle, column);
+    sqlite3_uint64 bits;
+    memcpy(&bits, &d, sizeof(d));
+    pack_int(p, bits, item->size, item->little);
+    b->len += item->size;
+    break;
+  }
+  default:
+  {
+    const char *data = (const char *)sqlite3_column_blob(handle, column);
+    size_t len = sqlite3_column_bytes(handle, column);
+
+    if (item->type == 's')
+    {
+      if (item->size < 8 && len >> (8 * item->size))
+        luaL_error(L, "string length does not fit in given size");
+      pack_int(p, len, item->size, item->little);
+      b->len += item->size;
+    }
+    else if (item->type == 'z' && memchr(data, 0, len))
+      luaL_error(L, "string contains zeros in column '%s'",
+                 sqlite3_column_name(handle, column));
+    else if (item->type == 'c' && len > item->size)
+      luaL_error(L, "string longer than given size in column '%s'",
+                 sqlite3_column_name(handle, column));
+
+    buffer_add(L, b, data, len);
+    if (item->type == 'z')
+      buffer_addchar(L, b, 0);
+    for (size_t i = len; item->type == 'c' && i < item->size; ++i)
+      buffer_addchar(L, b, 0);
+    break;
+  }
+  }
+}
+
+static void check_materialize(lua_State *L, int group, int aggregates)
+{
+  if (!lua_isnil(L, group))
+  {
+    luaL_argcheck(L, lua_istable(L, group), 3, "group is not a table");
+    int count = (int)lua_rawlen(L, group);
+    for (int i = 1; i <= count; ++i)
+    {
+      lua_rawgeti(L, group, i);
+      luaL_argcheck(L, lua_type(L, -1) == LUA_TSTRING, 3,
+                    "group column is not a string");
+      luaL_argcheck(L, sqlite3_stricmp(lua_tostring(L, -1), "count"), 3,
+                    "group column cannot be named count");
+      lua_pop(L, 1);
+    }
+  }
+
+  luaL_argcheck(L, lua_istable(L, aggregates), 3, "aggregates is not a table");
+  lua_pushnil(L);
+  while (lua_next(L, aggregates))
+  {
+    int fn = 0;
+    if (lua_type(L, -2) == LUA_TSTRING)
+    {
+      while (materialize_funcs[fn] &&
+             strcmp(materialize_funcs[fn], lua_tostring(L, -2)))
+        ++fn;
+    }
+    if (lua_type(L, -2) != LUA_TSTRING || !materialize_funcs[fn])
+      luaL_error(L, "unsupported aggregate: %s", luaL_tolstring(L, -2, NULL));
+
+    int count = lua_istable(L, -1) ? (int)lua_rawlen(L, -1) : 1;
+    for (int i = 1; i <= count; ++i)
+    {
+      if (lua_istable(L, -1))
+        lua_rawgeti(L, -1, i);
+      else
+        lua_pushvalue(L, -1);
+      if (lua_type(L, -1) != LUA_TSTRING)
+        luaL_error(L, "%s: column is not a string", materialize_funcs[fn]);
+      if (fn != 0 && !strcmp(lua_tostring(L, -1), "*"))
+        luaL_error(L, "%s: '*' is only supported by count",
+                   materialize_funcs[fn]);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+static void build_materialize(lua_State *L, struct materialize *m,
+                              const char *name, const char *source, int group,
+                              int aggregates)
+{
+  sqlite3_str **p = m->parts;
+  sqlite3_str_appendall(p[PART_KEYS], "\"count\"");
+  sqlite3_str_appendall(p[PART_NEW_KEYS], "0");
+  sqlite3_str_appendall(p[PART_MATCH_NEW], "1");
+  sqlite3_str_appendall(p[PART_MATCH_OLD], "1");
+
+  int count = lua_istable(L, group) ? (int)lua_rawlen(L, group) : 0;
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, group, i);
+    const char *column = lua_tostring(L, -1);
+    sqlite3_str_appendf(p[PART_COLUMNS], "\"%w\", ", column);
+    sqlite3_str_appendf(p[PART_KEYS], ", \"%w\"", column);
+    sqlite3_str_appendf(p[PART_NEW_KEYS], ", new.\"%w\"", column);
+    sqlite3_str_appendf(p[PART_SELECT_KEYS], ", \"%w\"", column);
+    sqlite3_str_appendf(p[PART_GROUP_BY], "%s\"%w\"", i > 1 ? ", " : "", column);
+    sqlite3_str_appendf(p[PART_MATCH_NEW], " AND \"%w\" IS new.\"%w\"", column,
+                        column);
+    sqlite3_str_appendf(p[PART_MATCH_OLD], " AND \"%w\" IS old.\"%w\"", column,
+                        column);
+    lua_pop(L, 1);
+  }
+  if (sqlite3_str_length(p[PART_GROUP_BY]))
+  {
+    sqlite3_str_appendf(p[PART_INDEX],
+                        "CREATE INDEX IF NOT EXISTS \"%w_group\" ON \"%w\" (%s);",
+                        name, name, sqlite3_str_value(p[PART_GROUP_BY]));
+  }
+
+  sqlite3_str_appendall(p[PART_ADD], "\"count\" = \"count\" + 1");
+  sqlite3_str_appendall(p[PART_REMOVE], "\"count\" = \"count\" - 1");
+  for (int fn = 0; materialize_funcs[fn]; ++fn)
+  {
+    lua_getfield(L, aggregates, materialize_funcs[fn]);
+    count = lua_istable(L, -1) ? (int)lua_rawlen(L, -1)
+                                   : !lua_isnil(L, -1);
+    for (int i = 1; i <= count; ++i)
+    {
+      if (lua_istable(L, -1))
+        lua_rawgeti(L, -1, i);
+      else
+        lua_pushvalue(L, -1);
+      add_materialize_aggregate(m, fn, lua_tostring(L, -1), source);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+  }
+
+  sqlite3_str_appendf(p[PART_ENSURE],
+                      "INSERT INTO \"%w\" (%s) SELECT %s WHERE NOT EXISTS "
+                      "(SELECT 1 FROM \"%w\" WHERE %s);",
+                      name, sqlite3_str_value(p[PART_KEYS]),
+                      sqlite3_str_value(p[PART_NEW_KEYS]), name,
+                      sqlite3_str_value(p[PART_MATCH_NEW]));
+  char *add = sqlite3_mprintf("UPDATE \"%w\" SET %s WHERE %s;", name,
+                              sqlite3_str_value(p[PART_ADD]),
+                              sqlite3_str_value(p[PART_MATCH_NEW]));
+  char *remove = sqlite3_mprintf("UPDATE \"%w\" SET %s WHERE %s;", name,
+                                 sqlite3_str_value(p[PART_REMOVE]),
+                                 sqlite3_str_value(p[PART_MATCH_OLD]));
+  sqlite3_str_reset(p[PART_ADD]);
+  sqlite3_str_appendall(p[PART_ADD], add ? add : "");
+  sqlite3_str_reset(p[PART_REMOVE]);
+  sqlite3_str_appendall(p[PART_REMOVE], remove ? remove : "");
+  sqlite3_free(add);
+  sqlite3_free(remove);
+
+  sqlite3_str_appendf(p[PART_PRUNE],
+                      "DELETE FROM \"%w\" WHERE \"count\" = 0 AND %s;", name,
+                      sqlite3_str_value(p[PART_MATCH_OLD]));
+}
+
+/*
+ * Add the SQL fragments maintaining one aggregate column. Counts and sums
+ * are adjusted by the inserted and deleted values; minimums and maximums are
+ * recomputed from the source table when the current extreme is deleted.
+ */
+static void add_materialize_aggregate(struct materialize *m, int fn,
+                                      const char *column, const char *source)
+{
+  if (!strcmp(column, "*"))
+    return;
+
+  sqlite3_str **p = m->parts;
+  const char *func = materialize_funcs[fn];
+  char *out = sqlite3_mprintf("%s_%s", func, column);
+  if (!out)
+    return;
+
+  sqlite3_str_appendf(p[PART_AGGREGATE_COLUMNS], ", \"%w\"%s", out,
+                      fn < 2 ? " NOT NULL DEFAULT 0" : "");
+  sqlite3_str_appendf(p[PART_TARGETS], ", \"%w\"", out);
+  if (fn == 0)
+  {
+    sqlite3_str_appendf(p[PART_SELECT], ", count(\"%w\")", column);
+    sqlite3_str_appendf(p[PART_ADD], ", \"%w\" = \"%w\" + (new.\"%w\" IS NOT NULL)",
+                        out, out, column);
+    sqlite3_str_appendf(p[PART_REMOVE],
+                        ", \"%w\" = \"%w\" - (old.\"%w\" IS NOT NULL)", out, out,
+                        column);
+  }
+  else if (fn == 1)
+  {
+    sqlite3_str_appendf(p[PART_SELECT], ", coalesce(sum(\"%w\"), 0)", column);
+    sqlite3_str_appendf(p[PART_ADD], ", \"%w\" = \"%w\" + coalesce(new.\"%w\", 0)",
+                        out, out, column);
+    sqlite3_str_appendf(p[PART_REMOVE],
+                        ", \"%w\" = \"%w\" - coalesce(old.\"%w\", 0)", out, out,
+                        column);
+  }
+  else
+  {
+    sqlite3_str_appendf(p[PART_SELECT], ", %s(\"%w\")", func, column);
+    sqlite3_str_appendf(p[PART_ADD],
+                        ", \"%w\" = coalesce(%s(\"%w\", new.\"%w\"), \"%w\", "
+                        "new.\"%w\")",
+                        out, func, out, column, out, column);
+    sqlite3_str_appendf(p[PART_REMOVE],
+                        ", \"%w\" = CASE WHEN old.\"%w\" IS NULL OR old.\"%w\" "
+                        "%s \"%w\" THEN \"%w\" ELSE (SELECT %s(\"%w\") FROM "
+                        "\"%w\" WHERE %s) END",
+                        out, column, column, fn == 2 ? ">" : "<", out, out, func,
+                        column, source, sqlite3_str_value(p[PART_MATCH_OLD]));
+  }
+  sqlite3_free(out);
+}
+
+/* Run a script of SQL statements in a savepoint, returning an error message
+ * to be freed with sqlite3_free() if one of them fails. */
+static char *exec_script(sqlite3 *handle, const char *sql)
+{
+  char *error = NULL;
+  if (sqlite3_exec(handle, "SAVEPOINT clutch_savepoint", NULL, NULL, &error) !=
+      SQLITE_OK)
+    return error;
+
+  if (sqlite3_exec(handle, sql, NULL, NULL, &error) != SQLITE_OK)
+    sqlite3_exec(handle, "ROLLBACK TO clutch_savepoint", NULL, NULL, NULL);
+  sqlite3_exec(handle, "RELEASE clutch_savepoint", NULL, NULL, NULL);
+  return error;
+}
+
+/*
+ * Return the cached statement for a key-value operation, preparing it again
+ * if it has not been prepared yet or was finalized by db:trim().
+ */
+static struct stmt *kv_stmt(lua_State *L, int kv, const char *op)
+{
+  static const char *const ops[] = {"get", "getmany", "put", "delete", NULL};
+  static const char *const templates[] = {
+      "SELECT value FROM \"%w\" WHERE key = ?",
+      "SELECT key, value FROM \"%w\" WHERE key IN "
+      "(SELECT value FROM json_each(?))",
+      "REPLACE INTO \"%w\" (key, value) VALUES (?, ?)",
+      "DELETE FROM \"%w\" WHERE key = ?"};
+
+  int top = lua_gettop(L);
+  lua_getuservalue(L, kv);
+  lua_getfield(L, top + 1, "db");
+  check_db(L, top + 2);
+  lua_getfield(L, top + 1, "stmts");
+  lua_getfield(L, top + 3, op);
+
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, -1);
+  if (!stmt || !stmt->handle)
+  {
+    int i = 0;
+    while (strcmp(ops[i], op))
+      ++i;
+    lua_getfield(L, top + 1, "table");
+    char *sql = sqlite3_mprintf(templates[i], lua_tostring(L, -1));
+    if (!sql)
+      luaL_error(L, "out of memory");
+    lua_pushstring(L, sql);
+    sqlite3_free(sql);
+    stmt = new_stmt(L, top + 2, lua_tostring(L, -1));
+    lua_setfield(L, top + 3, op);
+  }
+  lua_settop(L, top);
+  touch_stmt(stmt);
+  return stmt;
+}
+
+/*
+ * Store the value at the given index under a key, or delete the key if the
+ * value is nil, dropping it from the cache. Tables are rejected, as they
+ * would read back as JSON text, and numbers are bound as numbers rather
+ * than as text so that they read back as numbers.
+ */
+static void kv_write(lua_State *L, int kv, int key, int value)
+{
+  if (lua_istable(L, value))
+    luaL_error(L, "values cannot be tables");
+  struct stmt *stmt = kv_stmt(L, kv, lua_isnil(L, value) ? "delete" : "put");
+  lua_pushvalue(L, key);
+  bind_one_param(L, stmt, 1);
+  if (lua_type(L, value) == LUA_TNUMBER)
+  {
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, value))
+      sqlite3_bind_int64(stmt->handle, 2, lua_tointeger(L, value));
+    else
+#endif
+      sqlite3_bind_double(stmt->handle, 2, lua_tonumber(L, value));
+  }
+  else if (!lua_isnil(L, value))
+  {
+    lua_pushvalue(L, value);
+    bind_one_param(L, stmt, 2);
+  }
+
+  int status = sqlite3_step(stmt->handle);
+  sqlite3_reset(stmt->handle);
+  sqlite3_clear_bindings(stmt->handle);
+  if (status != SQLITE_DONE)
+    luaL_error(L, "%s", sqlite3_errmsg(sqlite3_db_handle(stmt->handle)));
+
+  lua_getuservalue(L, kv);
+  kv_cache_drop(L, lua_gettop(L), key);
+  lua_pop(L, 1);
+}
+
+static int put_all(lua_State *L)
+{
+  lua_pushnil(L);
+  while (lua_next(L, 2))
+  {
+    if (lua_type(L, -2) != LUA_TSTRING)
+      return luaL_error(L, "keys must be strings");
+    int top = lua_gettop(L);
+    kv_write(L, 1, top - 1, top);
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+/*
+ * The cache is a two-generation approximation of LRU: hits are kept in a
+ * young table, and when it holds half of the entries it becomes the old
+ * table, replacing the previous one. Entries found in the old table are
+ * moved back to the young one. Pushes the cached value and returns 1 on a
+ * hit; pushes nothing on a miss.
+ */
+static int kv_cache_get(lua_State *L, int uv, int key)
+{
+  lua_getfield(L, uv, "young");
+  lua_pushvalue(L, key);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1))
+  {
+    lua_remove(L, -2);
+    return 1;
+  }
+  lua_pop(L, 2);
+
+  lua_getfield(L, uv, "old");
+  lua_pushvalue(L, key);
+  lua_rawget(L, -2);
+  if (!lua_isnil(L, -1))
+  {
+    lua_remove(L, -2);
+    kv_cache_set(L, uv, key, lua_gettop(L));
+    return 1;
+  }
+  lua_pop(L, 2);
+  return 0;
+}
+
+static void kv_cache_set(lua_State *L, int uv, int key, int value)
+{
+  lua_getfield(L, uv, "capacity");
+  lua_Integer capacity = lua_tointeger(L, -1);
+  lua_getfield(L, uv, "size");
+  lua_Integer size = lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  if (capacity == 0)
+    return;
+
+  if (size >= (capacity + 1) / 2)
+  {
+    lua_getfield(L, uv, "young");
+    lua_setfield(L, uv, "old");
+    lua_newtable(L);
+    lua_setfield(L, uv, "young");
+    size = 0;
+  }
+
+  lua_getfield(L, uv, "young");
+  lua_pushvalue(L, key);
+  lua_pushvalue(L, value);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  lua_pushinteger(L, size + 1);
+  lua_setfield(L, uv, "size");
+}
+
+static void kv_cache_drop(lua_State *L, int uv, int key)
+{
+  lua_getfield(L, uv, "young");
+  lua_pushvalue(L, key);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_getfield(L, uv, "old");
+  lua_pushvalue(L, key);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+}
+
+/*
+ * Close the cached connections last used before a time, or else the least
+ * recently used one, dropping connections that were closed elsewhere.
+ * Connections in a transaction or running a statement are only closed when
+ * forced.
+ */
+static void opener_evict(lua_State *L, int uv, double before, int force)
+{
+  int top = lua_gettop(L);
+  lua_getfield(L, uv, "dbs");
+  lua_getfield(L, uv, "used");
+  lua_newtable(L);
+  lua_pushnil(L);
+
+  int count = 0;
+  double oldest = 0;
+  lua_pushnil(L);
+  while (lua_next(L, top + 2))
+  {
+    double used = lua_tonumber(L, -1);
+    lua_pop(L, 1);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, top + 1);
+    struct db *db = (struct db *)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    int busy = !force && db && db->handle && db_in_use(db->handle);
+    if (!db || !db->handle || (before >= 0 && used < before && !busy))
+    {
+      lua_pushvalue(L, -1);
+      lua_rawseti(L, top + 3, ++count);
+    }
+    else if (before < 0 && !busy && (lua_isnil(L, top + 4) || used < oldest))
+    {
+      oldest = used;
+      lua_pushvalue(L, -1);
+      lua_replace(L, top + 4);
+    }
+  }
+  if (count == 0 && !lua_isnil(L, top + 4))
+  {
+    lua_pushvalue(L, top + 4);
+    lua_rawseti(L, top + 3, ++count);
+  }
+
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, top + 3, i);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, top + 1);
+    struct db *db = (struct db *)lua_touserdata(L, -1);
+    if (db)
+    {
+      while (db->stmts)
+        close_sqlite_stmt(db->stmts);
+      close_sqlite(db);
+    }
+    lua_pop(L, 1);
+
+    lua_pushvalue(L, -1);
+    lua_pushnil(L);
+    lua_rawset(L, top + 1);
+    lua_pushnil(L);
+    lua_rawset(L, top + 2);
+  }
+
+  lua_getfield(L, uv, "count");
+  lua_pushinteger(L, lua_tointeger(L, -1) - count);
+  lua_setfield(L, uv, "count");
+  lua_settop(L, top);
+}
+
+/* Whether a connection is in a transaction or has a statement that has
+ * been stepped and not reset, such as a query still being iterated. */
+static int db_in_use(sqlite3 *handle)
+{
+  if (!sqlite3_get_autocommit(handle))
+    return 1;
+  for (sqlite3_stmt *s = sqlite3_next_stmt(handle, NULL); s;
+       s = sqlite3_next_stmt(handle, s))
+  {
+    if (sqlite3_stmt_busy(s))
+      return 1;
+  }
+  return 0;
+}
+
+static struct writer_client *check_writer(lua_State *L, int index)
+{
+  struct writer_client *client =
+      (struct writer_client *)luaL_checkudata(L, index, "sqlite3.writer");
+  if (!client->writer)
+    luaL_error(L, "writer is closed");
+  return client;
+}
+
+/*
+ * Open the connection of a writer for a file. The writer is keyed by the
+ * canonical path of the file, which exists once the connection is open. Its
+ * thread is started once it is added to the list of writers.
+ */
+static struct writer *writer_open(const char *path, int batch, char **error)
+{
+  struct writer *w = (struct writer *)calloc(1, sizeof(struct writer));
+  if (!w)
+    return NULL;
+
+  if (sqlite3_open_v2(path, &w->handle,
+                      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                          SQLITE_OPEN_NOMUTEX,
+                      NULL) != SQLITE_OK)
+  {
+    *error = sqlite3_mprintf("%s", sqlite3_errmsg(w->handle));
+    sqlite3_close_v2(w->handle);
+    free(w);
+    return NULL;
+  }
+
+  const char *filename = sqlite3_db_filename(w->handle, "main");
+  if (!filename || !*filename)
+  {
+    *error = sqlite3_mprintf("cannot start a writer thread for a temporary or "
+                             "in-memory database");
+    sqlite3_close_v2(w->handle);
+    free(w);
+    return NULL;
+  }
+  sqlite3_busy_timeout(w->handle, 5000);
+  register_functions(w->handle);
+
+  char resolved[PATH_MAX];
+  w->path = strdup(realpath(filename, resolved) ? resolved : filename);
+  w->batch = batch;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  pthread_cond_init(&w->done, NULL);
+  if (!w->path)
+  {
+    writer_free(w);
+    return NULL;
+  }
+  return w;
+}
+
+/* Called with writers_lock held. */
+static struct writer *writer_find(const char *path)
+{
+  struct writer *w = writers;
+  while (w && strcmp(w->path, path) != 0)
+    w = w->next;
+  return w;
+}
+
+/* The last handle to go stops the thread. Every handle waits for its own
+ * writes before releasing, so the queue is empty by then. */
+static void writer_release(struct writer *w)
+{
+  pthread_mutex_lock(&writers_lock);
+  if (--w->refs > 0)
+  {
+    pthread_mutex_unlock(&writers_lock);
+    return;
+  }
+
+  struct writer **link = &writers;
+  while (*link != w)
+    link = &(*link)->next;
+  *link = w->next;
+  pthread_mutex_unlock(&writers_lock);
+
+  pthread_mutex_lock(&w->lock);
+  w->closing = 1;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  writer_free(w);
+}
+
+/* Close the connection of a writer whose thread is not running. */
+static void writer_free(struct writer *w)
+{
+  for (int i = 0; i < WRITER_CACHE; ++i)
+  {
+    sqlite3_finalize(w->cache[i].stmt);
+    free(w->cache[i].sql);
+  }
+  sqlite3_close_v2(w->handle);
+  pthread_cond_destroy(&w->done);
+  pthread_cond_destroy(&w->wake);
+  pthread_mutex_destroy(&w->lock);
+  free(w->path);
+  free(w);
+}
+
+static char *writer_wait(struct writer_client *client)
+{
+  struct writer *w = client->writer;
+  pthread_mutex_lock(&w->lock);
+  while (__atomic_load_n(&client->pending, __ATOMIC_ACQUIRE) > 0)
+    pthread_cond_wait(&w->done, &w->lock);
+  char *error = client->error;
+  client->error = NULL;
+  pthread_mutex_unlock(&w->lock);
+  return error;
+}
+
+/* Producers push onto a lock-free stack; only a push onto an empty stack
+ * takes the lock, to wake the writer if it is asleep. */
+static void writer_push(struct writer *w, struct writer_job *job)
+{
+  __atomic_add_fetch(&job->client->pending, 1, __ATOMIC_RELAXED);
+  struct writer_job *head = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+  do
+    job->next = head;
+  while (!__atomic_compare_exchange_n(&w->head, &head, job, 1,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  if (!head)
+  {
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+static void *writer_main(void *arg)
+{
+  struct writer *w = (struct writer *)arg;
+  struct writer_job *queue = NULL;
+
+  for (;;)
+  {
+    if (!queue)
+    {
+      pthread_mutex_lock(&w->lock);
+      while (!__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) && !w->closing)
+        pthread_cond_wait(&w->wake, &w->lock);
+      pthread_mutex_unlock(&w->lock);
+
+      queue = writer_take(w);
+      if (!queue)
+        break;
+    }
+    queue = writer_commit(w, queue);
+  }
+  return NULL;
+}
+
+/* Take everything queued so far, in the order it was written. */
+static struct writer_job *writer_take(struct writer *w)
+{
+  struct writer_job *job = __atomic_exchange_n(&w->head, NULL,
+                                               __ATOMIC_ACQUIRE);
+  struct writer_job *queue = NULL;
+  while (job)
+  {
+    struct writer_job *next = job->next;
+    job->next = queue;
+    queue = job;
+    job = next;
+  }
+  return queue;
+}
+
+/* Run up to batch jobs in one transaction and return the rest. A failing
+ * statement only undoes its own changes, unless it rolls back the whole
+ * transaction, in which case the batch ends there and every job in it
+ * fails. */
+static struct writer_job *writer_commit(struct writer *w,
+                                        struct writer_job *queue)
+{
+  struct writer_job *end = queue;
+  char *error = NULL;
+
+  if (sqlite3_exec(w->handle, "BEGIN IMMEDIATE", NULL, NULL, NULL) !=
+      SQLITE_OK)
+    error = sqlite3_mprintf("%s", sqlite3_errmsg(w->handle));
+
+  for (int n = 0; end && n < w->batch; ++n)
+  {
+    struct writer_job *job = end;
+    end = end->next;
+    if (error)
+      continue;
+    job->error = writer_run(w, job);
+    if (job->error && sqlite3_get_autocommit(w->handle))
+    {
+      error = sqlite3_mprintf("%s", job->error);
+      break;
+    }
+  }
+  if (!error &&
+      sqlite3_exec(w->handle, "COMMIT", NULL, NULL, NULL) != SQLITE_OK)
+  {
+    error = sqlite3_mprintf("%s", sqlite3_errmsg(w->handle));
+    sqlite3_exec(w->handle, "ROLLBACK", NULL, NULL, NULL);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  while (queue != end)
+  {
+    struct writer_job *job = queue;
+    queue = queue->next;
+    struct writer_client *client = job->client;
+    if (error && !job->error)
+      job->error = sqlite3_mprintf("%s", error);
+    if (job->error && !client->error)
+      client->error = job->error;
+    else
+      sqlite3_free(job->error);
+    __atomic_sub_fetch(&client->pending, 1, __ATOMIC_RELEASE);
+    free(job);
+  }
+  pthread_cond_broadcast(&w->done);
+  pthread_mutex_unlock(&w->lock);
+  sqlite3_free(error);
+  return end;
+}
+
+static char *writer_run(struct writer *w, struct writer_job *job)
+{
+  char *error = NULL;
+  sqlite3_stmt *s = writer_prepare(w, job->sql, &error);
+  if (!s)
+    return error ? error : sqlite3_mprintf("out of memory");
+
+  if (bind_packed(s, job->params, job->nparams) != SQLITE_OK)
+  {
+    error = sqlite3_mprintf("%s", sqlite3_errmsg(w->handle));
+    sqlite3_clear_bindings(s);
+    return error;
+  }
+  int status;
+  while ((status = sqlite3_step(s)) == SQLITE_ROW)
+    ;
+  error = status == SQLITE_DONE
+              ? NULL
+              : sqlite3_mprintf("%s", sqlite3_errmsg(w->handle));
+  sqlite3_reset(s);
+  sqlite3_clear_bindings(s);
+  return error;
+}
+
+/*
+ * Keep the most recently used statements prepared, since writers tend to
+ * repeat a handful of statements. A job has to be a single statement that
+ * does not control the transaction, which would break up the batches.
+ */
+static sqlite3_stmt *writer_prepare(struct writer *w, const char *sql,
+                                    char **error)
+{
+  struct writer_cache *slot = &w->cache[0];
+  for (int i = 0; i < WRITER_CACHE; ++i)
+  {
+    struct writer_cache *entry = &w->cache[i];
+    if (entry->sql && strcmp(entry->sql, sql) == 0)
+    {
+      entry->used = ++w->ticks;
+      return entry->stmt;
+    }
+    if (entry->used < slot->used)
+      slot = entry;
+  }
+
+  sqlite3_stmt *s, *rest = NULL;
+  const char *tail = NULL;
+  if (sqlite3_prepare_v3(w->handle, sql, -1, SQLITE_PREPARE_PERSISTENT, &s,
+                         &tail) != SQLITE_OK)
+  {
+    *error = sqlite3_mprintf("%s", sqlite3_errmsg(w->handle));
+    return NULL;
+  }
+  if (!s)
+  {
+    *error = sqlite3_mprintf("writer job has no statement");
+    return NULL;
+  }
+  if (is_transaction_sql(sql))
+  {
+    sqlite3_finalize(s);
+    *error = sqlite3_mprintf("writer jobs cannot control transactions");
+    return NULL;
+  }
+  if (tail && *tail &&
+      (sqlite3_prepare_v2(w->handle, tail, -1, &rest, NULL) != SQLITE_OK ||
+       rest))
+  {
+    sqlite3_finalize(rest);
+    sqlite3_finalize(s);
+    *error = sqlite3_mprintf("writer jobs must be a single statement");
+    return NULL;
+  }
+  char *copy = strdup(sql);
+  if (!copy)
+  {
+    sqlite3_finalize(s);
+    return NULL;
+  }
+
+  sqlite3_finalize(slot->stmt);
+  free(slot->sql);
+  slot->sql = copy;
+  slot->stmt = s;
+  slot->used = ++w->ticks;
+  return s;
+}
+
+/* Whether a statement starts with a keyword that begins or ends a
+ * transaction or savepoint. */
+static int is_transaction_sql(const char *sql)
+{
+  static const char *const keywords[] = {
+      "BEGIN", "COMMIT", "END", "ROLLBACK", "SAVEPOINT", "RELEASE", NULL};
+  while (isspace((unsigned char)*sql))
+    ++sql;
+  for (int i = 0; keywords[i]; ++i)
+  {
+    size_t len = strlen(keywords[i]);
+    if (!sqlite3_strnicmp(sql, keywords[i], (int)len) &&
+        !isalnum((unsigned char)sql[len]) && sql[len] != '_')
+      return 1;
+  }
+  return 0;
+}
+
+/* Format the key of the time bucket that lies offset buckets before t. */
+static void partition_key(char *key, time_t t, int by, int offset)
+{
+  static const char *const formats[] = {"%Y%m%d%H", "%Y%m%d", "%Y%m"};
+  static const int seconds[] = {3600, 86400, 0};
+
+  struct tm tm;
+  t -= (time_t)offset * seconds[by];
+  gmtime_r(&t, &tm);
+  if (seconds[by] == 0)
+  {
+    int month = tm.tm_year * 12 + tm.tm_mon - offset;
+    tm.tm_year = month / 12;
+    tm.tm_mon = month % 12;
+  }
+  strftime(key, PARTITION_KEY_MAX, formats[by], &tm);
+}
+
+/*
+ * Attach the partition file for a key unless it is already attached,
+ * creating its table if needed. When no more databases can be attached, the
+ * least recently used partition that the current view does not use is
+ * detached first. SQLite cannot attach inside a transaction, so that raises
+ * an error. Returns 1 if the partition file did not exist before.
+ */
+static int partition_attach(lua_State *L, int uv, const char *key)
+{
+  int top = lua_gettop(L);
+  lua_getfield(L, uv, "db");
+  sqlite3 *handle = check_db(L, top + 1)->handle;
+  lua_getfield(L, uv, "name");
+  const char *name = lua_tostring(L, top + 2);
+  lua_getfield(L, uv, "attached");
+  lua_getfield(L, uv, "tick");
+  lua_Integer tick = lua_tointeger(L, -1) + 1;
+  lua_pop(L, 1);
+  lua_pushinteger(L, tick);
+  lua_setfield(L, uv, "tick");
+
+  const char *schema = lua_pushfstring(L, "%s_%s", name, key);
+  lua_getfield(L, top + 3, schema);
+  int attached = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  lua_pushinteger(L, tick);
+  lua_setfield(L, top + 3, schema);
+  if (attached)
+  {
+    lua_settop(L, top);
+    return 0;
+  }
+  if (!sqlite3_get_autocommit(handle))
+  {
+    lua_pushnil(L);
+    lua_setfield(L, top + 3, schema);
+    return luaL_error(L, "cannot attach partition %s inside a transaction",
+                      schema);
+  }
+
+  if (pragma_int(handle, attached_count) >=
+      sqlite3_limit(handle, SQLITE_LIMIT_ATTACHED, -1))
+  {
+    const char *oldest = NULL;
+    lua_Integer min = tick;
+    lua_getfield(L, uv, "viewed");
+    lua_pushnil(L);
+    while (lua_next(L, top + 3))
+    {
+      lua_pushvalue(L, -2);
+      lua_rawget(L, top + 5);
+      int viewed = !lua_isnil(L, -1);
+      lua_pop(L, 1);
+      if (!viewed && lua_tointeger(L, -1) < min)
+      {
+        oldest = lua_tostring(L, -2);
+        min = lua_tointeger(L, -1);
+      }
+      lua_pop(L, 1);
+    }
+    if (!oldest)
+    {
+      lua_pushnil(L);
+      lua_setfield(L, top + 3, schema);
+      return luaL_error(L, "too many attached databases");
+    }
+    lua_pushstring(L, oldest);
+    partition_detach(L, uv, lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+
+  lua_getfield(L, uv, "dir");
+  const char *path =
+      lua_pushfstring(L, "%s/%s_%s.db", lua_tostring(L, -1), name, key);
+  int created = access(path, F_OK) != 0;
+  char *sql = sqlite3_mprintf("ATTACH DATABASE %Q AS \"%w\"", path, schema);
+  if (!sql || sqlite3_exec(handle, sql, NULL, NULL, NULL) != SQLITE_OK)
+  {
+    sqlite3_free(sql);
+    lua_pushnil(L);
+    lua_setfield(L, top + 3, schema);
+    return luaL_error(L, "%s", sqlite3_errmsg(handle));
+  }
+  sqlite3_free(sql);
+
+  lua_getfield(L, uv, "columns");
+  sql = sqlite3_mprintf("CREATE TABLE IF NOT EXISTS \"%w\".\"%w\" (%s)",
+                        schema, name, lua_tostring(L, -1));
+  exec_partition(L, handle, sql);
+  lua_settop(L, top);
+  return created;
+}
+
+/* Detach a partition, finalizing its cached insert statement first. */
+static void partition_detach(lua_State *L, int uv, const char *schema)
+{
+  int top = lua_gettop(L);
+  lua_getfield(L, uv, "db");
+  sqlite3 *handle = check_db(L, top + 1)->handle;
+  lua_getfield(L, uv, "name");
+  const char *key = schema + lua_rawlen(L, top + 2) + 1;
+  lua_getfield(L, uv, "inserts");
+  lua_getfield(L, top + 3, key);
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, -1);
+  if (stmt)
+    close_sqlite_stmt(stmt);
+  lua_pushnil(L);
+  lua_setfield(L, top + 3, key);
+
+  exec_partition(L, handle, sqlite3_mprintf("DETACH DATABASE \"%w\"", schema));
+  lua_getfield(L, uv, "attached");
+  lua_pushnil(L);
+  lua_setfield(L, -2, schema);
+  lua_settop(L, top);
+}
+
+/*
+ * Detach and delete the partitions that fall outside the last keep buckets
+ * before now, except the one with the given key. Returns the number of
+ * partitions deleted.
+ */
+static int partition_retire(lua_State *L, int uv, time_t now,
+                            const char *except)
+{
+  static const char *const suffixes[] = {"", "-journal", "-wal", "-shm"};
+
+  int top = lua_gettop(L);
+  lua_getfield(L, uv, "keep");
+  lua_Integer keep = lua_tointeger(L, -1);
+  lua_getfield(L, uv, "by");
+  int by = (int)lua_tointeger(L, -1);
+  lua_pop(L, 2);
+  if (keep == 0)
+    return 0;
+
+  char cutoff[PARTITION_KEY_MAX];
+  partition_key(cutoff, now, by, (int)keep - 1);
+  int count = partition_list(L, uv, NULL, NULL), retired = 0;
+  lua_getfield(L, uv, "name");
+  lua_getfield(L, uv, "dir");
+  lua_getfield(L, uv, "attached");
+  for (int i = 1; i <= count; ++i)
+  {
+    lua_rawgeti(L, top + 1, i);
+    const char *key = lua_tostring(L, -1);
+    if (strcmp(key, cutoff) >= 0 || (except && !strcmp(key, except)))
+    {
+      lua_pop(L, 1);
+      continue;
+    }
+
+    const char *schema =
+        lua_pushfstring(L, "%s_%s", lua_tostring(L, top + 2), key);
+    lua_getfield(L, top + 4, schema);
+    if (!lua_isnil(L, -1))
+      partition_detach(L, uv, schema);
+    lua_pop(L, 1);
+
+    for (int j = 0; j < 4; ++j)
+    {
+      const char *path = lua_pushfstring(
+          L, "%s/%s.db%s", lua_tostring(L, top + 3), schema, suffixes[j]);
+      if (unlink(path) == 0 && j == 0)
+        ++retired;
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 2);
+  }
+  lua_settop(L, top);
+  return retired;
+}
+
+/*
+ * Push a sorted array of the keys of the partition files in the directory,
+ * limited to keys between from and to when given. Returns the number of
+ * keys.
+ */
+static int partition_list(lua_State *L, int uv, const char *from,
+                          const char *to)
+{
+  static const size_t widths[] = {10, 8, 6};
+
+  lua_getfield(L, uv, "by");
+  size_t width = widths[lua_tointeger(L, -1)];
+  lua_getfield(L, uv, "name");
+  size_t len;
+  const char *name = lua_tolstring(L, -1, &len);
+  lua_getfield(L, uv, "dir");
+  const char *dir = lua_tostring(L, -1);
+
+  DIR *d = opendir(dir);
+  if (!d)
+    luaL_error(L, "cannot open directory %s", dir);
+
+  char(*keys)[PARTITION_KEY_MAX] = NULL;
+  int count = 0, capacity = 0;
+  struct dirent *entry;
+  while ((entry = readdir(d)))
+  {
+    const char *file = entry->d_name;
+    if (strlen(file) != len + width + 4 || strncmp(file, name, len) ||
+        file[len] != '_' || strcmp(file + len + 1 + width, ".db"))
+      continue;
+
+    char key[PARTITION_KEY_MAX];
+    memcpy(key, file + len + 1, width);
+    key[width] = '\0';
+    if (strspn(key, "0123456789") != width || (from && strcmp(key, from) < 0) ||
+        (to && strcmp(key, to) > 0))
+      continue;
+
+    if (count == capacity)
+    {
+      capacity = capacity ? capacity * 2 : 16;
+      char(*grown)[PARTITION_KEY_MAX] =
+          realloc(keys, capacity * sizeof(*keys));
+      if (!grown)
+      {
+        free(keys);
+        closedir(d);
+        luaL_error(L, "out of memory");
+      }
+      keys = grown;
+    }
+    strcpy(keys[count++], key);
+  }
+  closedir(d);
+  lua_pop(L, 3);
+
+  qsort(keys, count, sizeof(*keys), compare_partition_key);
+  lua_createtable(L, count, 0);
+  for (int i = 0; i < count; ++i)
+  {
+    lua_pushstring(L, keys[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  free(keys);
+  return count;
+}
+
+static int compare_partition_key(const void *a, const void *b)
+{
+  return strcmp((const char *)a, (const char *)b);
+}
+
+/* Build an insert statement for a partition table that binds each column
+ * to a named parameter of the same name. */
+static char *partition_insert_sql(sqlite3 *handle, const char *schema,
+                                  const char *name)
+{
+  sqlite3_stmt *info;
+  if (sqlite3_prepare_v2(handle, "SELECT name FROM pragma_table_info(?, ?)",
+                         -1, &info, NULL) != SQLITE_OK)
+    return NULL;
+  sqlite3_bind_text(info, 1, name, -1, SQLITE_STATIC);
+  sqlite3_bind_text(info, 2, schema, -1, SQLITE_STATIC);
+
+  sqlite3_str *columns = sqlite3_str_new(handle);
+  sqlite3_str *params = sqlite3_str_new(handle);
+  for (int i = 0; sqlite3_step(info) == SQLITE_ROW; ++i)
+  {
+    const char *column = (const char *)sqlite3_column_text(info, 0);
+    sqlite3_str_appendf(columns, "%s\"%w\"", i ? ", " : "", column);
+    sqlite3_str_appendf(params, "%s:%s", i ? ", " : "", column);
+  }
+  sqlite3_finalize(info);
+
+  char *c = sqlite3_str_finish(columns), *p = sqlite3_str_finish(params);
+  char *sql = c && p ? sqlite3_mprintf("INSERT INTO \"%w\".\"%w\" (%s) "
+                                       "VALUES (%s)",
+                                       schema, name, c, p)
+                     : NULL;
+  sqlite3_free(c);
+  sqlite3_free(p);
+  return sql;
+}
+
+/* Execute and free a statement built with sqlite3_mprintf(). */
+static void exec_partition(lua_State *L, sqlite3 *handle, char *sql)
+{
+  if (!sql)
+    luaL_error(L, "out of memory");
+  int status = sqlite3_exec(handle, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  if (status != SQLITE_OK)
+    luaL_error(L, "%s", sqlite3_errmsg(handle));
+}
+
+static sqlite3_int64 pragma_int(sqlite3 *handle, const char *sql)
+{
+  sqlite3_stmt *stmt;
+  sqlite3_int64 value = 0;
+  if (sqlite3_prepare_v2(handle, sql, -1, &stmt, NULL) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    value = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  return value;
+}
+
+/*
+ * Scan a b-tree to load its pages into the page cache. Returns SQLITE_DONE
+ * once the pages read since warming started exceed the budget, which is
+ * checked after every row so the scan stops on the page that uses it up, or
+ * the error that stopped the scan. Indexes that cannot be scanned on their
+ * own, such as partial indexes, are skipped.
+ */
+static int warm_btree(sqlite3 *handle, const char *sql, int misses,
+                      sqlite3_int64 max_pages)
+{
+  sqlite3_stmt *stmt;
+  if (!sql)
+    return SQLITE_NOMEM;
+  if (sqlite3_prepare_v2(handle, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return SQLITE_OK;
+
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
+  {
+    if (max_pages >= 0 && cache_misses(handle) - misses >= max_pages)
+      break;
+  }
+  sqlite3_finalize(stmt);
+  if (status == SQLITE_DONE)
+    return SQLITE_OK;
+  return status == SQLITE_ROW ? SQLITE_DONE : status;
+}
+
+/* Ask the OS to start reading the database file, or as much of it as the
+ * budget allows, into its cache. */
+static void read_ahead(sqlite3 *handle, sqlite3_int64 budget)
+{
+#ifdef POSIX_FADV_WILLNEED
+  if (budget == 0)
+    return;
+  const char *filename = sqlite3_db_filename(handle, "main");
+  if (!filename || !*filename)
+    return;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return;
+  posix_fadvise(fd, 0, budget > 0 ? budget : 0, POSIX_FADV_WILLNEED);
+  close(fd);
+#endif
+}
+
+static int cache_misses(sqlite3 *handle)
+{
+  int current = 0, highwater = 0;
+  sqlite3_db_status(handle, SQLITE_DBSTATUS_CACHE_MISS, &current, &highwater,
+                    0);
+  return current;
+}
+
+static int update(lua_State *L, struct stmt *stmt)
+{
+  sqlite3 *db = sqlite3_db_handle(stmt->handle);
+
+  int status = step_stmt(stmt);
+  if (status != SQLITE_DONE)
+  {
+    raise_collate_error(L, stmt->db);
+    return luaL_error(L, "%s", sqlite3_errmsg(db));
+  }
+  lua_pushinteger(L, sqlite3_changes(db));
+
+  return 1;
+}
+
+/*
+ * Step a statement, discarding a collation error left by an earlier one. SQLite
+ * only checks for an interrupt between some instructions, so a statement whose
+ * collation failed may still finish; it is then reset and fails as if it had
+ * been interrupted.
+ */
+static int step_stmt(struct stmt *stmt)
+{
+  struct db *db = stmt->db;
+  if (db && db->collate_error)
+  {
+    free(db->collate_error);
+    db->collate_error = NULL;
+  }
+  int status = sqlite3_step(stmt->handle);
+  if (db && db->collate_error &&
+      (status == SQLITE_ROW || status == SQLITE_DONE))
+  {
+    sqlite3_reset(stmt->handle);
+    status = SQLITE_INTERRUPT;
+  }
+  return status;
+}
+
+/*
+ * Raise the error of a collation defined in Lua that failed the last step of
+ * a statement.
+ */
+static void raise_collate_error(lua_State *L, struct db *db)
+{
+  if (!db || !db->collate_error)
+    return;
+  luaL_where(L, 1);
+  lua_pushstring(L, db->collate_error);
+  free(db->collate_error);
+  db->collate_error = NULL;
+  lua_concat(L, 2);
+  lua_error(L);
+}
+
+static void close_sqlite(struct db *db)
+{
+  if (db->handle)
+  {
+    record_stop(db);
+    sqlite3_close_v2(db->handle);
+    db->handle = NULL;
+  }
+  free(db->collate_error);
+  db->collate_error = NULL;
+}
+
+static void close_sqlite_stmt(struct stmt *stmt)
+{
+  if (stmt->handle)
+  {
+    record_forget(stmt);
+    sqlite3_finalize(stmt->handle);
+    stmt->handle = NULL;
+  }
+  free(stmt->columns);
+  stmt->columns = NULL;
+  free(stmt->params);
+  stmt->params = NULL;
+
+  if (stmt->prev)
+    stmt->prev->next = stmt->next;
+  else if (stmt->db && stmt->db->stmts == stmt)
+    stmt->db->stmts = stmt->next;
+  if (stmt->next)
+    stmt->next->prev = stmt->prev;
+  stmt->prev = stmt->next = NULL;
+}
+
+static void touch_stmt(struct stmt *stmt)
+{
+  stmt->runs++;
+  stmt->used = now_ms();
+  stmt->since_yield = 0;
+  stmt->last_yield = stmt->used;
+}
+
+static int is_yieldable(lua_State *L)
+{
+#if LUA_VERSION_NUM >= 503
+  return lua_isyieldable(L);
+#else
+  int main = lua_pushthread(L);
+  lua_pop(L, 1);
+  return !main;
+#endif
+}
+
+static int resume_thread(lua_State *L, lua_State *co, int nargs)
+{
+#if LUA_VERSION_NUM >= 504
+  int nresults;
+  int status = lua_resume(co, L, nargs, &nresults);
+#else
+  int status = lua_resume(co, L, nargs);
+  int nresults = lua_gettop(co);
+#endif
+  if (status == LUA_OK || status == LUA_YIELD)
+  {
+    lua_pop(co, nresults);
+    return LUA_OK;
+  }
+  lua_xmove(co, L, 1);
+  return status;
+}
+
+static int loader_fetch_all(lua_State *L)
+{
+  loader_fetch(L, 1, 2);
+  return 1;
+}
+
+static void loader_fetch(lua_State *L, int loader, int keys)
+{
+  int unique = lua_gettop(L) + 1;
+  int count = 0;
+
+  lua_newtable(L);
+  lua_newtable(L);
+  for (int i = 1; i <= (int)lua_rawlen(L, keys); ++i)
+  {
+    lua_rawgeti(L, keys, i);
+    lua_pushvalue(L, -1);
+    lua_rawget(L, unique + 1);
+    if (lua_isnil(L, -1))
+    {
+      lua_pushvalue(L, -2);
+      lua_pushboolean(L, 1);
+      lua_rawset(L, unique + 1);
+      lua_pushvalue(L, -2);
+      lua_rawseti(L, unique, ++count);
+    }
+    lua_pop(L, 2);
+  }
+  lua_pop(L, 1);
+
+  lua_getuservalue(L, loader);
+  lua_getfield(L, -1, "db");
+  sqlite3 *db = check_db(L, -1)->handle;
+  lua_pop(L, 2);
+
+  int rows = unique + 1;
+  lua_newtable(L);
+
+  int limit = sqlite3_limit(db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+  for (int first = 1; first <= count; first += limit)
+  {
+    int n = count - first + 1 < limit ? count - first + 1 : limit;
+    loader_fetch_chunk(L, loader, unique, first, n, rows);
+  }
+  lua_remove(L, unique);
+}
+
+static void loader_fetch_chunk(lua_State *L, int loader, int keys, int first,
+                               int count, int rows)
+{
+  int top = lua_gettop(L);
+
+  lua_getuservalue(L, loader);
+  lua_getfield(L, top + 1, "db");
+  sqlite3 *db = check_db(L, top + 2)->handle;
+  lua_getfield(L, top + 1, "key");
+  const char *key = lua_tostring(L, -1);
+  lua_getfield(L, top + 1, "sql");
+  const char *sql = lua_tostring(L, -1);
+  const char *placeholder = find_placeholder(sql);
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, sql, placeholder - sql);
+  for (int i = 0; i < count; ++i)
+    luaL_addstring(&b, i ? ",?" : "?");
+  luaL_addstring(&b, placeholder + 1);
+  luaL_pushresult(&b);
+
+  struct stmt *stmt = new_stmt(L, top + 2, lua_tostring(L, -1));
+  for (int i = 0; i < count; ++i)
+  {
+    lua_rawgeti(L, keys, first + i);
+    if (bind_one_param(L, stmt, i + 1) != SQLITE_OK)
+      luaL_error(L, "%s", sqlite3_errmsg(db));
+  }
+
+  while (step(L, stmt))
+  {
+    lua_getfield(L, -1, key);
+    if (lua_isnil(L, -1))
+    {
+      lua_pop(L, 2);
+      continue;
+    }
+    lua_insert(L, -2);
+    lua_rawset(L, rows);
+  }
+  close_sqlite_stmt(stmt);
+  lua_settop(L, top);
+}
+
+static const char *find_placeholder(const char *sql)
+{
+  const char *found = NULL;
+
+  for (const char *p = sql; *p; ++p)
+  {
+    const char *end;
+    switch (*p)
+    {
+    case '\'':
+    case '"':
+    case '`':
+    case '[':
+      end = strchr(p + 1, *p == '[' ? ']' : *p);
+      if (!end)
+        return NULL;
+      p = end;
+      break;
+    case '-':
+      if (p[1] == '-')
+      {
+        while (p[1] && p[1] != '\n')
+          ++p;
+      }
+      break;
+    case '/':
+      if (p[1] == '*')
+      {
+        end = strstr(p + 2, "*/");
+        if (!end)
+          return NULL;
+        p = end + 1;
+      }
+      break;
+    case '?':
+      if (found)
+        return NULL;
+      found = p;
+      break;
+    }
+  }
+  return found;
+}
+
+static void detect_stmt(lua_State *L, int index)
+{
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, index);
+  struct db *db = stmt->db;
+  double now = now_ms();
+  int top = lua_gettop(L);
+
+  push_stmt_db(L, index);
+  lua_getuservalue(L, top + 1);
+  lua_getfield(L, top + 2, "detect");
+  push_fingerprint(L, sqlite3_sql(stmt->handle));
+  push_call_site(L);
+  lua_pushfstring(L, "%s\n%s", lua_tostring(L, top + 4),
+                  lua_tostring(L, top + 5));
+
+  lua_pushvalue(L, top + 6);
+  lua_rawget(L, top + 3);
+  if (lua_isnil(L, -1))
+  {
+    lua_pop(L, 1);
+    if (db->detect_entries >= DETECT_MAX_ENTRIES)
+      db->detect_entries = sweep_detect(L, top + 3, now - db->detect_window);
+    if (db->detect_entries >= DETECT_MAX_ENTRIES)
+    {
+      lua_settop(L, top);
+      return;
+    }
+    db->detect_entries++;
+    lua_createtable(L, 0, 7);
+    lua_pushvalue(L, top + 4);
+    lua_setfield(L, -2, "sql");
+    lua_pushvalue(L, top + 5);
+    lua_setfield(L, -2, "site");
+    lua_pushvalue(L, top + 6);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, top + 3);
+  }
+  int entry = top + 7;
+
+  lua_getfield(L, entry, "window_start");
+  lua_getfield(L, entry, "window_count");
+  lua_getfield(L, entry, "count");
+  lua_getfield(L, entry, "total");
+  lua_getfield(L, entry, "flagged");
+  double start = lua_isnil(L, -5) ? now : lua_tonumber(L, -5);
+  int count = (int)lua_tointeger(L, -4);
+  int peak = (int)lua_tointeger(L, -3);
+  int total = (int)lua_tointeger(L, -2);
+  int flagged = (int)lua_tointeger(L, -1);
+  lua_pop(L, 5);
+
+  if (now - start > db->detect_window)
+  {
+    start = now;
+    count = 0;
+  }
+  ++count;
+  ++total;
+  if (count > peak)
+    peak = count;
+
+  lua_pushnumber(L, start);
+  lua_setfield(L, entry, "window_start");
+  lua_pushinteger(L, count);
+  lua_setfield(L, entry, "window_count");
+  lua_pushinteger(L, peak);
+  lua_setfield(L, entry, "count");
+  lua_pushinteger(L, total);
+  lua_setfield(L, entry, "total");
+
+  if (count == db->detect_threshold + 1)
+  {
+    lua_pushinteger(L, flagged + 1);
+    lua_setfield(L, entry, "flagged");
+
+    lua_getfield(L, top + 2, "detect_log");
+    if (lua_isfunction(L, -1))
+    {
+      report_hotspot(L, entry);
+      lua_call(L, 1, 0);
+    }
+    else if (lua_toboolean(L, -1))
+    {
+      fprintf(stderr, "clutch: %s: %s executed over %d times in %g ms\n",
+              lua_tostring(L, top + 5), lua_tostring(L, top + 4),
+              db->detect_threshold, db->detect_window);
+    }
+  }
+  lua_settop(L, top);
+}
+
+/* Forget the statements that were never flagged and have not run within
+ * the current window, and return how many are left. */
+static int sweep_detect(lua_State *L, int detect, double before)
+{
+  int count = 0;
+  lua_pushnil(L);
+  while (lua_next(L, detect))
+  {
+    lua_getfield(L, -1, "flagged");
+    lua_getfield(L, -2, "window_start");
+    if (lua_isnil(L, -2) && lua_tonumber(L, -1) < before)
+    {
+      lua_pop(L, 3);
+      lua_pushvalue(L, -1);
+      lua_pushnil(L);
+      lua_rawset(L, detect);
+    }
+    else
+    {
+      lua_pop(L, 3);
+      ++count;
+    }
+  }
+  return count;
+}
+
+static void report_hotspot(lua_State *L, int entry)
+{
+  static const char *const fields[] = {"sql", "site", "count", "total",
+                                       "flagged"};
+
+  lua_createtable(L, 0, 5);
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i)
+  {
+    lua_getfield(L, entry, fields[i]);
+    lua_setfield(L, -2, fields[i]);
+  }
+}
+
+static void push_fingerprint(lua_State *L, const char *sql)
+{
+  struct buffer b;
+  const char *p = sql;
+
+  buffer_init(L, &b);
+  while (*p)
+  {
+    unsigned char c = *p;
+    unsigned char last = b.len > 0 ? b.data[b.len - 1] : ' ';
+    const char *end;
+
+    if (isspace(c))
+    {
+      while (isspace((unsigned char)*p))
+        ++p;
+      if (b.len > 0 && *p)
+        buffer_addchar(L, &b, ' ');
+    }
+    else if (c == '\'')
+    {
+      for (end = p + 1; *end; ++end)
+      {
+        if (*end == '\'' && *++end != '\'')
+          break;
+      }
+      p = end;
+      add_fingerprint_param(L, &b);
+    }
+    else if (c == '"' || c == '`' || c == '[')
+    {
+      end = strchr(p + 1, c == '[' ? ']' : c);
+      end = end ? end + 1 : p + strlen(p);
+      buffer_add(L, &b, p, end - p);
+      p = end;
+    }
+    else if (c == '?' || (isdigit(c) && !isalnum(last) && last != '_'))
+    {
+      for (++p; isalnum((unsigned char)*p) || *p == '.' || *p == '_'; ++p)
+        ;
+      add_fingerprint_param(L, &b);
+    }
+    else if (c == '-' && p[1] == '-')
+    {
+      while (*p && *p != '\n')
+        ++p;
+    }
+    else if (c == '/' && p[1] == '*')
+    {
+      end = strstr(p + 2, "*/");
+      p = end ? end + 2 : p + strlen(p);
+    }
+    else
+    {
+      buffer_addchar(L, &b, tolower(c));
+      ++p;
+    }
+  }
+  while (b.len > 0 && b.data[b.len - 1] == ' ')
+    --b.len;
+  buffer_push(L, &b);
+}
+
+static void add_fingerprint_param(lua_State *L, struct buffer *b)
+{
+  size_t len = b->len;
+  while (len > 0 && b->data[len - 1] == ' ')
+    --len;
+  if (len > 0 && b->data[len - 1] == ',')
+  {
+    --len;
+    while (len > 0 && b->data[len - 1] == ' ')
+      --len;
+    if (len > 0 && b->data[len - 1] == '?')
+    {
+      b->len = len;
+      return;
+    }
+  }
+  buffer_addchar(L, b, '?');
+}
+
+static void push_call_site(lua_State *L)
+{
+  lua_Debug ar;
+  for (int level = 1; lua_getstack(L, level, &ar); ++level)
+  {
+    lua_getinfo(L, "Sl", &ar);
+    if (ar.currentline > 0)
+    {
+      lua_pushfstring(L, "%s:%d", ar.short_src, ar.currentline);
+      return;
+    }
+  }
+  lua_pushliteral(L, "?");
+}
+
+/*
+ * Check the plan of a newly prepared statement against the strict mode
+ * settings. The verdict is cached by SQL text, so each distinct statement is
+ * only inspected once; errors are raised every time it is prepared, warnings
+ * only the first time.
+ */
+static void check_strict(lua_State *L, int index)
+{
+  struct stmt *stmt = (struct stmt *)lua_touserdata(L, index);
+  const char *sql = sqlite3_sql(stmt->handle);
+  if (!sql || !is_dml(sql))
+    return;
+
+  int top = lua_gettop(L);
+  push_stmt_db(L, index);
+  lua_getuservalue(L, top + 1);
+  lua_getfield(L, top + 2, "strict");
+  lua_getfield(L, top + 3, "verdicts");
+  lua_getfield(L, top + 4, sql);
+
+  int fresh = lua_isnil(L, -1);
+  if (fresh)
+  {
+    lua_pop(L, 1);
+    push_strict_verdict(L, stmt, top + 3);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, top + 4, sql);
+  }
+
+  if (lua_isstring(L, -1))
+  {
+    lua_getfield(L, top + 3, "action");
+    if (lua_isfunction(L, -1))
+    {
+      if (fresh)
+      {
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 0);
+      }
+    }
+    else if (!strcmp(lua_tostring(L, -1), "warn"))
+    {
+      if (fresh)
+        fprintf(stderr, "clutch: %s\n", lua_tostring(L, -2));
+    }
+    else
+      luaL_error(L, "%s", lua_tostring(L, -2));
+  }
+  lua_settop(L, top);
+}
+
+/*
+ * Push a message describing the first forbidden plan of a statement, or
+ * false. Full scans are found from the bytecode: a table or index cursor that
+ * is rewound but never positioned with a seek. Temporary b-trees are taken
+ * from the query plan.
+ */
+static void push_strict_verdict(lua_State *L, struct stmt *stmt, int strict)
+{
+  sqlite3 *handle = stmt->db->handle;
+  const char *sql = sqlite3_sql(stmt->handle);
+  lua_getfield(L, strict, "min_rows");
+  sqlite3_int64 min_rows = (sqlite3_int64)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+
+  struct strict_cursor cursors[STRICT_MAX_CURSORS];
+  int ncursors = 0;
+  sqlite3_stmt *explain;
+  char *text = sqlite3_mprintf("EXPLAIN %s", sql);
+  int status = sqlite3_prepare_v2(handle, text, -1, &explain, NULL);
+  sqlite3_free(text);
+  if (status != SQLITE_OK)
+  {
+    lua_pushboolean(L, 0);
+    return;
+  }
+
+  while (sqlite3_step(explain) == SQLITE_ROW)
+  {
+    const char *opcode = (const char *)sqlite3_column_text(explain, 1);
+    int cursor = sqlite3_column_int(explain, 2);
+    if (!strcmp(opcode, "OpenRead") || !strcmp(opcode, "OpenWrite"))
+    {
+      if (ncursors < STRICT_MAX_CURSORS)
+      {
+        struct strict_cursor *c = &cursors[ncursors++];
+        c->cursor = cursor;
+        c->root = sqlite3_column_int(explain, 3);
+        c->schema = sqlite3_column_int(explain, 4);
+        c->rewound = c->seeked = 0;
+      }
+      continue;
+    }
+
+    int rewind = !strcmp(opcode, "Rewind") || !strcmp(opcode, "Last");
+    int seek = !strncmp(opcode, "Seek", 4) || !strcmp(opcode, "NotExists");
+    for (int i = 0; i < ncursors && (rewind || seek); ++i)
+    {
+      if (cursors[i].cursor == cursor)
+      {
+        cursors[i].rewound |= rewind;
+        cursors[i].seeked |= seek;
+      }
+    }
+  }
+  sqlite3_finalize(explain);
+
+  sqlite3_int64 largest = -1;
+  const char *largest_name = NULL;
+  luaL_checkstack(L, ncursors + LUA_MINSTACK, "too many cursors");
+  for (int i = 0; i < ncursors; ++i)
+  {
+    struct strict_cursor *c = &cursors[i];
+    sqlite3_int64 rows = strict_table_rows(L, handle, strict, c);
+    const char *name = lua_tostring(L, -1);
+    if ((stmt->db->strict & STRICT_SCAN) && c->rewound && !c->seeked &&
+        rows >= min_rows)
+    {
+      lua_pushfstring(L, "full scan of table %s (%d rows): %s", name,
+                      (int)rows, sql);
+      return;
+    }
+    if (rows > largest)
+    {
+      largest = rows;
+      largest_name = name;
+    }
+  }
+
+  if ((stmt->db->strict & STRICT_TEMP_BTREE) && largest >= min_rows)
+  {
+    text = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+    status = sqlite3_prepare_v2(handle, text, -1, &explain, NULL);
+    sqlite3_free(text);
+    while (status == SQLITE_OK && sqlite3_step(explain) == SQLITE_ROW)
+    {
+      const char *detail = (const char *)sqlite3_column_text(explain, 3);
+      if (detail && !strncmp(detail, "USE TEMP B-TREE", 15))
+      {
+        lua_pushfstring(L, "%s on table %s (%d rows): %s", detail,
+                        largest_name, (int)largest, sql);
+        sqlite3_finalize(explain);
+        return;
+      }
+    }
+    sqlite3_finalize(explain);
+  }
+  lua_pushboolean(L, 0);
+}
+
+/*
+ * Push the name of the table a cursor reads and return its number of rows,
+ * estimated from sqlite_stat1 when the table has been analyzed and counted
+ * otherwise. Counts are cached while strict mode is on.
+ */
+static sqlite3_int64 strict_table_rows(lua_State *L, sqlite3 *handle,
+                                       int strict, struct strict_cursor *c)
+{
+  char *sql;
+  const char *schema = c->schema == 0 ? "main" : c->schema == 1 ? "temp" : NULL;
+  sqlite3_stmt *stmt;
+  char *name = NULL;
+  if (!schema)
+  {
+    sql = sqlite3_mprintf("SELECT name FROM pragma_database_list WHERE seq = %d",
+                          c->schema);
+    if (sqlite3_prepare_v2(handle, sql, -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW)
+      lua_pushstring(L, (const char *)sqlite3_column_text(stmt, 0));
+    else
+      lua_pushliteral(L, "main");
+    sqlite3_finalize(stmt);
+    sqlite3_free(sql);
+    schema = lua_tostring(L, -1);
+  }
+  else
+    lua_pushstring(L, schema);
+
+  sql = sqlite3_mprintf("SELECT tbl_name FROM \"%w\".sqlite_master WHERE "
+                        "rootpage = %d",
+                        schema, c->root);
+  if (sqlite3_prepare_v2(handle, sql, -1, &stmt, NULL) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    name = sqlite3_mprintf("%s", sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  sqlite3_free(sql);
+  if (!name)
+  {
+    lua_pop(L, 1);
+    lua_pushliteral(L, "?");
+    return -1;
+  }
+  lua_pushfstring(L, "%s.%s", schema, name);
+
+  lua_getfield(L, strict, "rows");
+  lua_pushvalue(L, -2);
+  lua_rawget(L, -2);
+  if (lua_isnumber(L, -1))
+  {
+    sqlite3_int64 rows = (sqlite3_int64)lua_tonumber(L, -1);
+    lua_pop(L, 2);
+    lua_remove(L, -2);
+    sqlite3_free(name);
+    return rows;
+  }
+  lua_pop(L, 1);
+
+  sqlite3_int64 rows = -1;
+  sql = sqlite3_mprintf(
+      "SELECT stat FROM \"%w\".sqlite_stat1 WHERE tbl = %Q LIMIT 1", schema,
+      name);
+  if (sqlite3_prepare_v2(handle, sql, -1, &stmt, NULL) == SQLITE_OK &&
+      sqlite3_step(stmt) == SQLITE_ROW)
+    rows = strtoll((const char *)sqlite3_column_text(stmt, 0), NULL, 10);
+  sqlite3_finalize(stmt);
+  sqlite3_free(sql);
+  if (rows < 0)
+  {
+    sql = sqlite3_mprintf("SELECT count(*) FROM \"%w\".\"%w\"", schema, name);
+    rows = sql ? pragma_int(handle, sql) : 0;
+    sqlite3_free(sql);
+  }
+  sqlite3_free(name);
+
+  lua_pushvalue(L, -2);
+  lua_pushnumber(L, (lua_Number)rows);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  lua_remove(L, -2);
+  return rows;
+}
+
+static int is_dml(const char *sql)
+{
+  static const char *const keywords[] = {"SELECT", "WITH",   "INSERT",
+                                         "REPLACE", "UPDATE", "DELETE",
+                                         "VALUES", NULL};
+  while (isspace((unsigned char)*sql) || *sql == '(')
+    ++sql;
+  for (int i = 0; keywords[i]; ++i)
+  {
+    size_t n = strlen(keywords[i]);
+    if (!sqlite3_strnicmp(sql, keywords[i], n) &&
+        !isalnum((unsigned char)sql[n]) && sql[n] != '_')
+      return 1;
+  }
+  return 0;
+}
+
+static void record_stop(struct db *db)
+{
+  struct recorder *r = db->recorder;
+  if (!r)
+    return;
+
+  sqlite3_trace_v2(db->handle, 0, NULL, NULL);
+  fclose(r->file);
+  for (size_t i = 0; i < r->params_size; ++i)
+    free(r->params[i].data);
+  free(r->params);
+  free(r->ids);
+  free(r);
+  db->recorder = NULL;
+}
+
+/*
+ * Write an execution record when a statement finishes. Parameters bound
+ * through clutch were captured by record_param(); statements bound some other
+ * way, such as bulk inserts, are logged with their parameters expanded into
+ * the SQL text.
+ */
+static int record_trace(unsigned type, void *ctx, void *p, void *x)
+{
+  struct recorder *r = (struct recorder *)ctx;
+  sqlite3_stmt *handle = (sqlite3_stmt *)p;
+  sqlite3_int64 ns = *(sqlite3_int64 *)x;
+  struct record_params *params = record_find(r, handle, 0);
+  const char *sql = sqlite3_sql(handle);
+  char *expanded = NULL;
+  (void)type;
+
+  if (params && params->count < 0)
+    params = NULL;
+  if (!params && sqlite3_bind_parameter_count(handle) > 0)
+  {
+    expanded = sqlite3_expanded_sql(handle);
+    if (expanded)
+      sql = expanded;
+  }
+  if (!sql)
+    return 0;
+
+  double start = (now_ms() - r->start) * 1e3 - ns / 1e3;
+  unsigned char header[29];
+  header[0] = 'E';
+  put_u64(header + 1, record_define(r, sql));
+  put_u64(header + 9, start > 0 ? (sqlite3_uint64)start : 0);
+  put_u64(header + 17, ns);
+  put_u32(header + 25, params ? params->count : 0);
+  fwrite(header, 1, sizeof(header), r->file);
+  if (params)
+  {
+    fwrite(params->data, 1, params->len, r->file);
+    params->count = -1;
+  }
+  sqlite3_free(expanded);
+  return 0;
+}
+
+/* Statements are identified by a 64-bit FNV-1a hash of their SQL text, which
+ * is written to the log the first time the statement is seen. */
+static sqlite3_uint64 record_define(struct recorder *r, const char *sql)
+{
+  sqlite3_uint64 id = 0xcbf29ce484222325ULL;
+  size_t len = 0;
+  for (; sql[len]; ++len)
+    id = (id ^ (unsigned char)sql[len]) * 0x100000001b3ULL;
+  if (!id)
+    id = 1;
+
+  if (r->nids * 2 >= r->ids_size)
+  {
+    size_t size = r->ids_size ? r->ids_size * 2 : 64;
+    sqlite3_uint64 *ids = (sqlite3_uint64 *)calloc(size, sizeof(*ids));
+    if (ids)
+    {
+      for (size_t i = 0; i < r->ids_size; ++i)
+      {
+        if (!r->ids[i])
+          continue;
+        size_t j = r->ids[i] & (size - 1);
+        while (ids[j])
+          j = (j + 1) & (size - 1);
+        ids[j] = r->ids[i];
+      }
+      free(r->ids);
+      r->ids = ids;
+      r->ids_size = size;
+    }
+  }
+
+  if (r->nids * 2 < r->ids_size)
+  {
+    size_t i = id & (r->ids_size - 1);
+    for (; r->ids[i]; i = (i + 1) & (r->ids_size - 1))
+    {
+      if (r->ids[i] == id)
+        return id;
+    }
+    r->ids[i] = id;
+    r->nids++;
+  }
+
+  unsigned char header[13];
+  header[0] = 'S';
+  put_u64(header + 1, id);
+  put_u32(header + 9, len);
+  fwrite(header, 1, sizeof(header), r->file);
+  fwrite(sql, 1, len, r->file);
+  return id;
+}
+
+/* Captured parameters are kept in an open-addressing table keyed by the
+ * statement handle, like the statement ids. */
+static size_t record_slot(struct recorder *r, sqlite3_stmt *handle)
+{
+  sqlite3_uint64 h = (sqlite3_uint64)(uintptr_t)handle >> 3;
+  return (size_t)((h * 0x9e3779b97f4a7c15ULL) >> 32) & (r->params_size - 1);
+}
+
+static struct record_params *record_find(struct recorder *r,
+                                         sqlite3_stmt *handle, int create)
+{
+  if (create && (r->nparams + 1) * 2 > r->params_size)
+  {
+    size_t size = r->params_size ? r->params_size * 2 : 64;
+    struct record_params *params =
+        (struct record_params *)calloc(size, sizeof(struct record_params));
+    if (!params)
+      return NULL;
+    struct record_params *old = r->params;
+    size_t old_size = r->params_size;
+    r->params = params;
+    r->params_size = size;
+    for (size_t i = 0; i < old_size; ++i)
+    {
+      if (!old[i].handle)
+        continue;
+      size_t j = record_slot(r, old[i].handle);
+      while (params[j].handle)
+        j = (j + 1) & (size - 1);
+      params[j] = old[i];
+    }
+    free(old);
+  }
+  if (!r->params_size)
+    return NULL;
+
+  size_t i = record_slot(r, handle);
+  for (; r->params[i].handle; i = (i + 1) & (r->params_size - 1))
+  {
+    if (r->params[i].handle == handle)
+      return &r->params[i];
+  }
+  if (!create)
+    return NULL;
+
+  memset(&r->params[i], 0, sizeof(r->params[i]));
+  r->params[i].handle = handle;
+  r->params[i].count = -1;
+  r->nparams++;
+  return &r->params[i];
+}
+
+static void record_begin(struct stmt *stmt)
+{
+  if (!stmt->db || !stmt->db->recorder)
+    return;
+
+  struct record_params *params = record_find(stmt->db->recorder, stmt->handle, 1);
+  if (params)
+  {
+    params->count = 0;
+    params->len = 0;
+  }
+}
+
+static void record_param(struct stmt *stmt, int index, char type,
+                         const void *data, size_t len)
+{
+  if (!stmt->db || !stmt->db->recorder)
+    return;
+
+  struct record_params *params =
+      record_find(stmt->db->recorder, stmt->handle, 0);
+  if (!params || params->count < 0)
+    return;
+
+  size_t size = type == 't' || type == 'b' ? 4 + len : len;
+  if (!record_reserve(&params->data, &params->size, params->len + 5 + size))
+  {
+    params->count = -1;
+    return;
+  }
+
+  unsigned char *p = params->data + params->len;
+  put_u32(p, index);
+  p[4] = type;
+  p += 5;
+  if (type == 'i' || type == 'f')
+  {
+    sqlite3_uint64 bits;
+    memcpy(&bits, data, sizeof(bits));
+    put_u64(p, bits);
+  }
+  else if (type == 't' || type == 'b')
+  {
+    put_u32(p, len);
+    memcpy(p + 4, data, len);
+  }
+  params->len += 5 + size;
+  params->count++;
+}
+
+static void record_forget(struct stmt *stmt)
+{
+  if (!stmt->db || !stmt->db->recorder)
+    return;
+
+  struct recorder *r = stmt->db->recorder;
+  struct record_params *params = record_find(r, stmt->handle, 0);
+  if (!params)
+    return;
+
+  /* Shift the rest of the probe sequence back over the freed slot. */
+  size_t mask = r->params_size - 1;
+  size_t i = params - r->params;
+  free(params->data);
+  for (size_t j = (i + 1) & mask; r->params[j].handle; j = (j + 1) & mask)
+  {
+    size_t k = record_slot(r, r->params[j].handle);
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j))
+    {
+      r->params[i] = r->params[j];
+      i = j;
+    }
+  }
+  memset(&r->params[i], 0, sizeof(r->params[i]));
+  r->nparams--;
+}
+
+static int record_reserve(unsigned char **data, size_t *size, size_t n)
+{
+  if (n <= *size)
+    return 1;
+
+  size_t newsize = *size ? *size * 2 : 64;
+  while (newsize < n)
+    newsize *= 2;
+  unsigned char *p = (unsigned char *)realloc(*data, newsize);
+  if (!p)
+    return 0;
+  *data = p;
+  *size = newsize;
+  return 1;
+}
+
+/*
+ * Parse a log written by db:record() in two passes: the first validates it
+ * and counts the records, the second fills the statement and event arrays,
+ * which are left on the Lua stack as userdata.
+ */
+static void parse_replay(lua_State *L, const unsigned char *data, size_t len,
+                         struct replay *replay)
+{
+  if (len < 8 || memcmp(data, RECORD_MAGIC, 8))
+    luaL_error(L, "not a clutch workload log");
+
+  for (int pass = 0; pass < 2; ++pass)
+  {
+    size_t nstmts = 0, nevents = 0;
+    size_t pos = 8;
+    while (pos < len)
+    {
+      unsigned char tag = data[pos++];
+      if (tag == 'S' && len - pos >= 12)
+      {
+        size_t n = get_u32(data + pos + 8);
+        if (len - pos - 12 < n)
+          break;
+        if (pass)
+        {
+          struct replay_stmt *stmt = &replay->stmts[nstmts];
+          stmt->id = get_u64(data + pos);
+          stmt->sql = (const char *)data + pos + 12;
+          stmt->len = n;
+        }
+        nstmts++;
+        pos += 12 + n;
+      }
+      else if (tag == 'E' && len - pos >= 28)
+      {
+        struct replay_event *event = pass ? &replay->events[nevents] : NULL;
+        unsigned int nparams = get_u32(data + pos + 24);
+        if (event)
+        {
+          event->id = get_u64(data + pos);
+          event->start_us = get_u64(data + pos + 8);
+          event->duration_ns = get_u64(data + pos + 16);
+          event->nparams = nparams;
+          event->params = data + pos + 28;
+        }
+        pos += 28;
+
+        unsigned int i = 0;
+        for (; i < nparams && len - pos >= 5; ++i)
+        {
+          unsigned char type = data[pos + 4];
+          pos += 5;
+          size_t n = type == 'i' || type == 'f' ? 8 : type == 'n' ? 0 : 4;
+          if (len - pos < n)
+            break;
+          if (type == 't' || type == 'b')
+          {
+            n += get_u32(data + pos);
+            if (len - pos < n)
+              break;
+          }
+          else if (type != 'i' && type != 'f' && type != 'n')
+            break;
+          pos += n;
+        }
+        if (i < nparams)
+          break;
+        nevents++;
+      }
+      else
+        break;
+    }
+    if (pos < len)
+      luaL_error(L, "corrupt workload log at offset %d", (int)pos);
+
+    if (!pass)
+    {
+      replay->nstmts = nstmts;
+      replay->nevents = nevents;
+      replay->stmts = (struct replay_stmt *)lua_newuserdata(
+          L, (nstmts ? nstmts : 1) * sizeof(struct replay_stmt));
+      replay->events = (struct replay_event *)lua_newuserdata(
+          L, (nevents ? nevents : 1) * sizeof(struct replay_event));
+    }
+  }
+
+  qsort(replay->stmts, replay->nstmts, sizeof(struct replay_stmt),
+        compare_replay_stmt);
+  for (size_t i = 0; i < replay->nevents; ++i)
+  {
+    struct replay_stmt key = {replay->events[i].id, NULL, 0};
+    struct replay_stmt *stmt = (struct replay_stmt *)bsearch(
+        &key, replay->stmts, replay->nstmts, sizeof(struct replay_stmt),
+        compare_replay_stmt);
+    if (!stmt)
+      luaL_error(L, "corrupt workload log: unknown statement");
+    replay->events[i].stmt = stmt - replay->stmts;
+  }
+}
+
+static int compare_replay_stmt(const void *a, const void *b)
+{
+  sqlite3_uint64 x = ((const struct replay_stmt *)a)->id;
+  sqlite3_uint64 y = ((const struct replay_stmt *)b)->id;
+  return x < y ? -1 : x > y;
+}
+
+/* Workers take every threads'th event, so with more than one thread the
+ * relative order of events is only kept within a worker. */
+static void *replay_worker(void *arg)
+{
+  struct replay_worker *worker = (struct replay_worker *)arg;
+  struct replay *replay = worker->replay;
+  sqlite3_stmt **prepared = (sqlite3_stmt **)calloc(
+      replay->nstmts ? replay->nstmts : 1, sizeof(sqlite3_stmt *));
+  if (!prepared)
+  {
+    worker->errors++;
+    return NULL;
+  }
+
+  for (size_t i = worker->index; i < replay->nevents;
+       i += replay->threads)
+  {
+    struct replay_event *event = &replay->events[i];
+    if (replay->speed > 0)
+    {
+      double wait = replay->start + event->start_us / 1e3 / replay->speed -
+                    now_ms();
+      if (wait > 0)
+      {
+        struct timespec ts;
+        ts.tv_sec = (time_t)(wait / 1e3);
+        ts.tv_nsec = (long)(fmod(wait, 1e3) * 1e6);
+        nanosleep(&ts, NULL);
+      }
+    }
+
+    double start = now_ms();
+    if (replay_event(worker->handle, &prepared[event->stmt],
+                     &replay->stmts[event->stmt], event) != SQLITE_OK)
+      worker->errors++;
+    replay->latencies[i] = now_ms() - start;
+  }
+
+  for (size_t i = 0; i < replay->nstmts; ++i)
+    sqlite3_finalize(prepared[i]);
+  free(prepared);
+  return NULL;
+}
+
+static int replay_event(sqlite3 *handle, sqlite3_stmt **prepared,
+                        struct replay_stmt *stmt, struct replay_event *event)
+{
+  if (!*prepared && sqlite3_prepare_v2(handle, stmt->sql, (int)stmt->len,
+                                       prepared, NULL) != SQLITE_OK)
+    return SQLITE_ERROR;
+
+  sqlite3_stmt *s = *prepared;
+  int status = bind_packed(s, event->params, event->nparams);
+  if (status != SQLITE_OK)
+  {
+    sqlite3_clear_bindings(s);
+    return status;
+  }
+
+  while ((status = sqlite3_step(s)) == SQLITE_ROW)
+    ;
+  sqlite3_reset(s);
+  sqlite3_clear_bindings(s);
+  return status == SQLITE_DONE ? SQLITE_OK : status;
+}
+
+/* Parameters are packed as a 32-bit index and a type tag followed by the
+ * value, as written by record_param(). Text and blobs are bound in place, so
+ * p must outlive the next step. */
+static int bind_packed(sqlite3_stmt *s, const unsigned char *p,
+                       unsigned int nparams)
+{
+  int status = SQLITE_OK;
+  for (unsigned int i = 0; status == SQLITE_OK && i < nparams; ++i)
+  {
+    int index = (int)get_u32(p);
+    unsigned char type = p[4];
+    p += 5;
+
+    if (type == 'i' || type == 'f')
+    {
+      sqlite3_uint64 bits = get_u64(p);
+      if (type == 'i')
+        status = sqlite3_bind_int64(s, index, (sqlite3_int64)bits);
+      else
+      {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        status = sqlite3_bind_double(s, index, value);
+      }
+      p += 8;
+    }
+    else if (type == 't' || type == 'b')
+    {
+      unsigned int n = get_u32(p);
+      if (type == 't')
+        status =
+            sqlite3_bind_text(s, index, (const char *)p + 4, n, SQLITE_STATIC);
+      else
+        status = sqlite3_bind_blob(s, index, p + 4, n, SQLITE_STATIC);
+      p += 4 + n;
+    }
+    else
+      status = sqlite3_bind_null(s, index);
+  }
+  return status;
+}
+
+static void push_percentiles(lua_State *L, double *values, size_t n)
+{
+  static const char *const names[] = {"p50", "p90", "p99", "max"};
+  static const double quantiles[] = {0.5, 0.9, 0.99, 1.0};
+
+  qsort(values, n, sizeof(double), compare_double);
+  lua_createtable(L, 0, 4);
+  for (int i = 0; i < 4; ++i)
+  {
+    size_t rank = (size_t)ceil(quantiles[i] * n);
+    lua_pushnumber(L, n ? values[rank ? rank - 1 : 0] : 0);
+    lua_setfield(L, -2, names[i]);
+  }
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void buffer_init(lua_State *L, struct buffer *b)
+{
+  b->len = 0;
+  b->size = LUAL_BUFFERSIZE;
+  b->data = (char *)lua_newuserdata(L, b->size);
+  b->index = lua_gettop(L);
+}
+
+static void buffer_reserve(lua_State *L, struct buffer *b, size_t n)
+{
+  if (b->size - b->len >= n)
+    return;
+
+  size_t size = b->size * 2;
+  if (size - b->len < n)
+    size = b->len + n;
+
+  char *data = (char *)lua_newuserdata(L, size);
+  memcpy(data, b->data, b->len);
+  lua_replace(L, b->index);
+  b->data = data;
+  b->size = size;
+}
+
+static void buffer_add(lua_State *L, struct buffer *b, const char *s, size_t n)
+{
+  buffer_reserve(L, b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+static void buffer_addchar(lua_State *L, struct buffer *b, char c)
+{
+  buffer_reserve(L, b, 1);
+  b->data[b->len++] = c;
+}
+
+static void buffer_push(lua_State *L, struct buffer *b)
+{
+  lua_pushlstring(L, b->data, b->len);
+  lua_replace(L, b->index);
+}
+
+static void json_encode(lua_State *L, int index)
+{
+  struct buffer b;
+
+  index = lua_absindex(L, index);
+  buffer_init(L, &b);
+  json_encode_value(L, &b, index, 0);
+  buffer_push(L, &b);
+}
+
+static void json_encode_value(lua_State *L, struct buffer *b, int index,
+                              int depth)
+{
+  char number[32];
+
+  switch (lua_type(L, index))
+  {
+  case LUA_TNIL:
+    buffer_add(L, b, "null", 4);
+    break;
+  case LUA_TBOOLEAN:
+    if (lua_toboolean(L, index))
+      buffer_add(L, b, "true", 4);
+    else
+      buffer_add(L, b, "false", 5);
+    break;
+  case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+    if (lua_isinteger(L, index))
+    {
+      snprintf(number, sizeof(number), "%lld",
+               (long long)lua_tointeger(L, index));
+      buffer_add(L, b, number, strlen(number));
+      break;
+    }
+#endif
+    {
+      double value = lua_tonumber(L, index);
+      if (value != value || value - value != 0)
+        luaL_error(L, "cannot encode %f to JSON", value);
+      snprintf(number, sizeof(number), "%.17g", value);
+      buffer_add(L, b, number, strlen(number));
+    }
+    break;
+  case LUA_TSTRING:
+    json_encode_string(L, b, index);
+    break;
+  case LUA_TTABLE:
+    json_encode_table(L, b, index, depth + 1);
+    break;
+  default:
+    luaL_error(L, "cannot encode lua type '%s' to JSON",
+               luaL_typename(L, index));
+  }
+}
+
+static void json_encode_string(lua_State *L, struct buffer *b, int index)
+{
+  static const char hex[] = "0123456789abcdef";
+  size_t len;
+  const char *s = lua_tolstring(L, index, &len);
+
+  buffer_addchar(L, b, '"');
+  for (size_t i = 0; i < len; ++i)
+  {
+    unsigned char c = s[i];
+    switch (c)
+    {
+    case '"':
+      buffer_add(L, b, "\\\"", 2);
+      break;
+    case '\\':
+      buffer_add(L, b, "\\\\", 2);
+      break;
+    case '\b':
+      buffer_add(L, b, "\\b", 2);
+      break;
+    case '\f':
+      buffer_add(L, b, "\\f", 2);
+      break;
+    case '\n':
+      buffer_add(L, b, "\\n", 2);
+      break;
+    case '\r':
+      buffer_add(L, b, "\\r", 2);
+      break;
+    case '\t':
+      buffer_add(L, b, "\\t", 2);
+      break;
+    default:
+      if (c < 0x20)
+      {
+        char escape[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+        buffer_add(L, b, escape, sizeof(escape));
+      }
+      else
+      {
+        buffer_addchar(L, b, c);
+      }
+    }
+  }
+  buffer_addchar(L, b, '"');
+}
+
+static void json_encode_table(lua_State *L, struct buffer *b, int index,
+                              int depth)
+{
+  if (depth > JSON_MAX_DEPTH)
+    luaL_error(L, "cannot encode table to JSON: nesting too deep");
+  luaL_checkstack(L, 3, "cannot encode table to JSON");
+
+  size_t count = json_is_array(L, index);
+  if (count > 0)
+  {
+    buffer_addchar(L, b, '[');
+    for (size_t i = 1; i <= count; ++i)
+    {
+      if (i > 1)
+        buffer_addchar(L, b, ',');
+      lua_rawgeti(L, index, i);
+      json_encode_value(L, b, lua_gettop(L), depth);
+      lua_pop(L, 1);
+    }
+    buffer_addchar(L, b, ']');
+    return;
+  }
+
+  int first = 1;
+  buffer_addchar(L, b, '{');
+  lua_pushnil(L);
+  while (lua_next(L, index))
+  {
+    int type = lua_type(L, -2);
+    if (type != LUA_TSTRING && type != LUA_TNUMBER)
+      luaL_error(L, "cannot encode table key of type '%s' to JSON",
+                 lua_typename(L, type));
+    if (!first)
+      buffer_addchar(L, b, ',');
+    first = 0;
+
+    lua_pushvalue(L, -2);
+    lua_tostring(L, -1);
+    json_encode_string(L, b, lua_gettop(L));
+    lua_pop(L, 1);
+    buffer_addchar(L, b, ':');
+    json_encode_value(L, b, lua_gettop(L), depth);
+    lua_pop(L, 1);
+  }
+  buffer_addchar(L, b, '}');
+}
+
+static int json_is_array(lua_State *L, int index)
+{
+  size_t count = 0;
+  lua_Number max = 0;
+
+  lua_pushnil(L);
+  while (lua_next(L, index))
+  {
+    lua_pop(L, 1);
+    if (lua_type(L, -1) != LUA_TNUMBER)
+    {
+      lua_pop(L, 1);
+      return 0;
+    }
+    lua_Number key = lua_tonumber(L, -1);
+    if (key < 1 || key != (lua_Number)(lua_Integer)key)
+    {
+      lua_pop(L, 1);
+      return 0;
+    }
+    if (key > max)
+      max = key;
+    ++count;
+  }
+  return max == count ? (int)count : 0;
+}
+
+static void json_decode(lua_State *L, const char *text, size_t len)
+{
+  struct json_parser p = {text, text, text + len, 0};
+
+  json_decode_value(L, &p);
+  json_skip_space(&p);
+  if (p.pos != p.end)
+    json_error(L, &p, "trailing characters");
+}
+
+static void json_decode_value(lua_State *L, struct json_parser *p)
+{
+  json_skip_space(p);
+  if (p->pos == p->end)
+    json_error(L, p, "unexpected end of input");
+
+  switch (*p->pos)
+  {
+  case '{':
+    json_decode_object(L, p);
+    break;
+  case '[':
+    json_decode_array(L, p);
+    break;
+  case '"':
+    json_decode_string(L, p);
+    break;
+  case 't':
+    json_decode_literal(L, p, "true");
+    lua_pushboolean(L, 1);
+    break;
+  case 'f':
+    json_decode_literal(L, p, "false");
+    lua_pushboolean(L, 0);
+    break;
+  case 'n':
+    json_decode_literal(L, p, "null");
+    lua_pushnil(L);
+    break;
+  default:
+    json_decode_number(L, p);
+  }
+}
+
+static void json_decode_object(lua_State *L, struct json_parser *p)
+{
+  if (++p->depth > JSON_MAX_DEPTH)
+    json_error(L, p, "nesting too deep");
+  luaL_checkstack(L, 3, "cannot decode JSON");
+
+  ++p->pos;
+  lua_newtable(L);
+  json_skip_space(p);
+  if (p->pos < p->end && *p->pos == '}')
+  {
+    ++p->pos;
+    --p->depth;
+    return;
+  }
+
+  for (;;)
+  {
+    json_skip_space(p);
+    if (p->pos == p->end || *p->pos != '"')
+      json_error(L, p, "expected string");
+    json_decode_string(L, p);
+
+    json_skip_space(p);
+    if (p->pos == p->end || *p->pos != ':')
+      json_error(L, p, "expected ':'");
+    ++p->pos;
+
+    json_decode_value(L, p);
+    lua_rawset(L, -3);
+
+    json_skip_space(p);
+    if (p->pos == p->end)
+      json_error(L, p, "unexpected end of input");
+    if (*p->pos++ == '}')
+      break;
+    if (p->pos[-1] != ',')
+      json_error(L, p, "expected ',' or '}'");
+  }
+  --p->depth;
+}
+
+static void json_decode_array(lua_State *L, struct json_parser *p)
+{
+  if (++p->depth > JSON_MAX_DEPTH)
+    json_error(L, p, "nesting too deep");
+  luaL_checkstack(L, 2, "cannot decode JSON");
+
+  ++p->pos;
+  lua_newtable(L);
+  json_skip_space(p);
+  if (p->pos < p->end && *p->pos == ']')
+  {
+    ++p->pos;
+    --p->depth;
+    return;
+  }
+
+  for (int i = 1;; ++i)
+  {
+    json_decode_value(L, p);
+    lua_rawseti(L, -2, i);
+
+    json_skip_space(p);
+    if (p->pos == p->end)
+      json_error(L, p, "unexpected end of input");
+    if (*p->pos++ == ']')
+      break;
+    if (p->pos[-1] != ',')
+      json_error(L, p, "expected ',' or ']'");
+  }
+  --p->depth;
+}
+
+static void json_decode_string(lua_State *L, struct json_parser *p)
+{
+  const char *start = ++p->pos;
+  while (p->pos < p->end && *p->pos != '"' && *p->pos != '\\')
+    ++p->pos;
+
+  if (p->pos < p->end && *p->pos == '"')
+  {
+    lua_pushlstring(L, start, p->pos++ - start);
+    return;
+  }
+
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, start, p->pos - start);
+  while (p->pos < p->end && *p->pos != '"')
+  {
+    char c = *p->pos++;
+    if (c != '\\')
+    {
+      luaL_addchar(&b, c);
+      continue;
+    }
+    if (p->pos == p->end)
+      break;
+
+    switch (c = *p->pos++)
+    {
+    case 'b':
+      luaL_addchar(&b, '\b');
+      break;
+    case 'f':
+      luaL_addchar(&b, '\f');
+      break;
+    case 'n':
+      luaL_addchar(&b, '\n');
+      break;
+    case 'r':
+      luaL_addchar(&b, '\r');
+      break;
+    case 't':
+      luaL_addchar(&b, '\t');
+      break;
+    case 'u':
+    {
+      unsigned long code = json_decode_hex(L, p);
+      if (code >= 0xd800 && code < 0xdc00 && p->end - p->pos >= 6 &&
+          p->pos[0] == '\\' && p->pos[1] == 'u')
+      {
+        p->pos += 2;
+        unsigned long low = json_decode_hex(L, p);
+        if (low < 0xdc00 || low >= 0xe000)
+          json_error(L, p, "invalid surrogate pair");
+        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+      }
+      json_add_utf8(&b, code);
+      break;
+    }
+    case '"':
+    case '\\':
+    case '/':
+      luaL_addchar(&b, c);
+      break;
+    default:
+      json_error(L, p, "invalid escape sequence");
+    }
+  }
+  if (p->pos == p->end)
+    json_error(L, p, "unterminated string");
+  ++p->pos;
+  luaL_pushresult(&b);
+}
+
+static void json_decode_number(lua_State *L, struct json_parser *p)
+{
+  const char *start = p->pos;
+  int integer = 1;
+
+  if (p->pos < p->end && *p->pos == '-')
+    ++p->pos;
+  while (p->pos < p->end && *p->pos && strchr("0123456789.eE+-", *p->pos))
+  {
+    if (*p->pos < '0' || *p->pos > '9')
+      integer = 0;
+    ++p->pos;
+  }
+
+  /* Long literals are valid JSON, so convert from a copy of any length. */
+  lua_pushlstring(L, start, p->pos - start);
+  const char *number = lua_tostring(L, -1);
+
+  char first = number[number[0] == '-'];
+  if (first < '0' || first > '9')
+  {
+    p->pos = start;
+    json_error(L, p, "unexpected character");
+  }
+
+  char *end;
+#if LUA_VERSION_NUM >= 503
+  if (integer)
+  {
+    long long value = strtoll(number, &end, 10);
+    if (*end == '\0' && value > LLONG_MIN && value < LLONG_MAX)
+    {
+      lua_pop(L, 1);
+      lua_pushinteger(L, (lua_Integer)value);
+      return;
+    }
+  }
+#else
+  (void)integer;
+#endif
+  double value = strtod(number, &end);
+  if (*end != '\0')
+  {
+    p->pos = start;
+    json_error(L, p, "invalid number");
+  }
+  lua_pop(L, 1);
+  lua_pushnumber(L, value);
+}
+
+static void json_decode_literal(lua_State *L, struct json_parser *p,
+                                const char *literal)
+{
+  size_t len = strlen(literal);
+  if ((size_t)(p->end - p->pos) < len || memcmp(p->pos, literal, len))
+    json_error(L, p, "unexpected character");
+  p->pos += len;
+}
+
+static unsigned long json_decode_hex(lua_State *L, struct json_parser *p)
+{
+  unsigned long code = 0;
+
+  if (p->end - p->pos < 4)
+    json_error(L, p, "invalid unicode escape");
+  for (int i = 0; i < 4; ++i)
+  {
+    char c = *p->pos++;
+    code <<= 4;
+    if (c >= '0' && c <= '9')
+      code |= c - '0';
+    else if (c >= 'a' && c <= 'f')
+      code |= c - 'a' + 10;
+    else if (c >= 'A' && c <= 'F')
+      code |= c - 'A' + 10;
+    else
+      json_error(L, p, "invalid unicode escape");
+  }
+  return code;
+}
+
+static void json_add_utf8(luaL_Buffer *b, unsigned long code)
+{
+  if (code < 0x80)
+  {
+    luaL_addchar(b, (char)code);
+  }
+  else if (code < 0x800)
+  {
+    luaL_addchar(b, (char)(0xc0 | (code >> 6)));
+    luaL_addchar(b, (char)(0x80 | (code & 0x3f)));
+  }
+  else if (code < 0x10000)
+  {
+    luaL_addchar(b, (char)(0xe0 | (code >> 12)));
+    luaL_addchar(b, (char)(0x80 | ((code >> 6) & 0x3f)));
+    luaL_addchar(b, (char)(0x80 | (code & 0x3f)));
+  }
+  else
+  {
+    luaL_addchar(b, (char)(0xf0 | (code >> 18)));
+    luaL_addchar(b, (char)(0x80 | ((code >> 12) & 0x3f)));
+    luaL_addchar(b, (char)(0x80 | ((code >> 6) & 0x3f)));
+    luaL_addchar(b, (char)(0x80 | (code & 0x3f)));
+  }
+}
+
+static void json_skip_space(struct json_parser *p)
+{
+  while (p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' ||
+                              *p->pos == '\r' || *p->pos == '\n'))
+    ++p->pos;
+}
+
+static int json_error(lua_State *L, struct json_parser *p, const char *msg)
+{
+  return luaL_error(L, "invalid JSON at offset %d: %s",
+                    (int)(p->pos - p->start), msg);
+}
+
+
+static void register_functions(sqlite3 *handle)
+{
+  int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+  sqlite3_create_function(handle, "compress", 1, flags, NULL, sql_compress,
+                          NULL, NULL);
+  sqlite3_create_function(handle, "compress", 2, flags, NULL, sql_compress,
+                          NULL, NULL);
+  sqlite3_create_function(handle, "decompress", 1, flags, NULL,
+                          sql_decompress, NULL, NULL);
+
+  sqlite3_create_function(handle, "regexp", 2, flags, NULL, sql_regexp, NULL,
+                          NULL);
+  sqlite3_create_window_function(handle, "quantile", 2, flags, NULL,
+                                 quantile_step, quantile_value, quantile_value,
+                                 quantile_inverse, NULL);
+  sqlite3_create_window_function(handle, "approx_count_distinct", 1, flags,
+                                 NULL, hll_step, hll_final, hll_value,
+                                 hll_inverse, NULL);
+  sqlite3_create_window_function(handle, "histogram", 2, flags, NULL,
+                                 histogram_step, histogram_value,
+                                 histogram_value, histogram_inverse, NULL);
+
+  for (int i = 0; vec_metrics[i]; ++i)
+  {
+    char name[16];
+    snprintf(name, sizeof(name), "vec_%s", vec_metrics[i]);
+    sqlite3_create_function(handle, name, 2, flags, (void *)&vec_metrics[i],
+                            sql_vec, NULL, NULL);
+  }
+  sqlite3_create_module(handle, "vec_topk", &vec_topk_module, NULL);
+
+  sqlite3_create_collation(handle, "UNICODE_NOCASE", SQLITE_UTF8, NULL,
+                           collate_unicode_nocase);
+  sqlite3_create_collation(handle, "NATURAL", SQLITE_UTF8, NULL,
+                           collate_natural);
+}
+
+static void sql_compress(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  int type = sqlite3_value_type(argv[0]);
+  if (type != SQLITE_TEXT && type != SQLITE_BLOB)
+  {
+    sqlite3_result_value(ctx, argv[0]);
+    return;
+  }
+
+  int level = argc > 1 ? sqlite3_value_int(argv[1]) : Z_DEFAULT_COMPRESSION;
+  if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION)
+  {
+    sqlite3_result_error(ctx, "compression level must be between -1 and 9",
+                         -1);
+    return;
+  }
+
+  const void *data = sqlite3_value_blob(argv[0]);
+  size_t len = sqlite3_value_bytes(argv[0]);
+  size_t outlen;
+  unsigned char *out = compress_value(data, len,
+                                      type == SQLITE_TEXT ? 't' : 'b', level,
+                                      &outlen);
+  if (!out)
+    sqlite3_result_error_nomem(ctx);
+  else
+    sqlite3_result_blob64(ctx, out, outlen, sqlite3_free);
+}
+
+static void sql_decompress(sqlite3_context *ctx, int argc,
+                           sqlite3_value **argv)
+{
+  const unsigned char *data = sqlite3_value_blob(argv[0]);
+  size_t len = sqlite3_value_bytes(argv[0]);
+  if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || !is_compressed(data, len))
+  {
+    sqlite3_result_value(ctx, argv[0]);
+    return;
+  }
+
+  size_t outlen;
+  unsigned char *out = decompress_value(data, len, &outlen);
+  if (!out)
+    sqlite3_result_error(ctx, "corrupt compressed value", -1);
+  else if (data[3] == 't')
+    sqlite3_result_text64(ctx, (char *)out, outlen, sqlite3_free, SQLITE_UTF8);
+  else
+    sqlite3_result_blob64(ctx, out, outlen, sqlite3_free);
+}
+
+/*
+ * Compressed values are stored as blobs with an 8 byte header: the magic
+ * bytes "\0CZ", the original type ('t' for text, 'b' for blob) and the
+ * uncompressed length as a 32 bit little endian integer, followed by a zlib
+ * stream.
+ */
+static int is_compressed(const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  return len >= COMPRESS_HEADER && !memcmp(p, "\0CZ", 3) &&
+         (p[3] == 't' || p[3] == 'b');
+}
+
+static unsigned char *compress_value(const void *data, size_t len, char type,
+                                     int level, size_t *outlen)
+{
+  if (len > 0xffffffffUL)
+    return NULL;
+
+  uLongf size = compressBound(len);
+  unsigned char *out = sqlite3_malloc64(COMPRESS_HEADER + size);
+  if (!out)
+    return NULL;
+
+  memcpy(out, "\0CZ", 3);
+  out[3] = type;
+  for (int i = 0; i < 4; ++i)
+    out[4 + i] = (len >> (8 * i)) & 0xff;
+
+  if (compress2(out + COMPRESS_HEADER, &size, data, len, level) != Z_OK)
+  {
+    sqlite3_free(out);
+    return NULL;
+  }
+  *outlen = COMPRESS_HEADER + size;
+  return out;
+}
+
+static unsigned char *decompress_value(const void *data, size_t len,
+                                       size_t *outlen)
+{
+  const unsigned char *p = data;
+  uLongf size = 0;
+  for (int i = 0; i < 4; ++i)
+    size |= (uLongf)p[4 + i] << (8 * i);
+
+  unsigned char *out = sqlite3_malloc64(size ? size : 1);
+  if (!out)
+    return NULL;
+
+  uLongf n = size;
+  if (uncompress(out, &n, p + COMPRESS_HEADER, len - COMPRESS_HEADER) !=
+          Z_OK ||
+      n != size)
+  {
+    sqlite3_free(out);
+    return NULL;
+  }
+  *outlen = n;
+  return out;
+}
+
+/*
+ * regexp(pattern, text) implements the REGEXP operator with POSIX extended
+ * regular expressions. The compiled pattern is kept as auxiliary data of the
+ * pattern argument, so a constant pattern is compiled once per statement.
+ */
+static void sql_regexp(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  const char *pattern = (const char *)sqlite3_value_text(argv[0]);
+  const char *text = (const char *)sqlite3_value_text(argv[1]);
+  if (!pattern || !text)
+    return;
+
+  regex_t *regex = sqlite3_get_auxdata(ctx, 0);
+  if (!regex)
+  {
+    regex = sqlite3_malloc(sizeof(regex_t));
+    if (!regex)
+    {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+
+    int status = regcomp(regex, pattern, REG_EXTENDED | REG_NOSUB);
+    if (status != 0)
+    {
+      char msg[256];
+      regerror(status, regex, msg, sizeof(msg));
+      sqlite3_free(regex);
+      char *error = sqlite3_mprintf("invalid regular expression: %s", msg);
+      sqlite3_result_error(ctx, error, -1);
+      sqlite3_free(error);
+      return;
+    }
+
+    sqlite3_set_auxdata(ctx, 0, regex, free_regex);
+    regex = sqlite3_get_auxdata(ctx, 0);
+    if (!regex)
+    {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+  }
+
+  sqlite3_result_int(ctx, regexec(regex, text, 0, NULL, 0) == 0);
+}
+
+static void free_regex(void *regex)
+{
+  regfree(regex);
+  sqlite3_free(regex);
+}
+
+/*
+ * Collations defined in Lua run the comparator in a thread of their own, so
+ * that they work whichever coroutine steps the statement. A comparison
+ * cannot fail, so an error raised by the comparator is kept with the
+ * connection and the statement is interrupted, which rolls back its changes
+ * instead of leaving an index in the wrong order.
+ */
+static int collate_lua(void *arg, int len1, const void *s1, int len2,
+                       const void *s2)
+{
+  struct collation *collation = (struct collation *)arg;
+  lua_State *L = collation->thread;
+  lua_pushvalue(L, 1);
+  lua_pushlstring(L, (const char *)s1, len1);
+  lua_pushlstring(L, (const char *)s2, len2);
+
+  int result = 0;
+  if (lua_pcall(L, 2, 1, 0) == LUA_OK)
+  {
+    lua_Number n = lua_tonumber(L, -1);
+    result = n < 0 ? -1 : n > 0;
+  }
+  else
+  {
+    struct db *db = collation->db;
+    const char *error = lua_tostring(L, -1);
+    if (!db->collate_error)
+      db->collate_error = strdup(error ? error : "error in collation");
+    sqlite3_interrupt(db->handle);
+  }
+  lua_settop(L, 1);
+  return result;
+}
+
+/* Compare UTF-8 strings code point by code point after simple case
+ * folding. */
+static int collate_unicode_nocase(void *arg, int len1, const void *s1,
+                                  int len2, const void *s2)
+{
+  const unsigned char *p = s1, *end1 = p + len1;
+  const unsigned char *q = s2, *end2 = q + len2;
+  while (p < end1 && q < end2)
+  {
+    unsigned long a = fold_case(decode_utf8(&p, end1));
+    unsigned long b = fold_case(decode_utf8(&q, end2));
+    if (a != b)
+      return a < b ? -1 : 1;
+  }
+  return (p < end1) - (q < end2);
+}
+
+/*
+ * Compare strings so that runs of digits are ordered by their numeric value,
+ * as in "file2" < "file10". Numbers that differ only in leading zeros are
+ * ordered by the number of zeros. Other bytes compare as in BINARY.
+ */
+static int collate_natural(void *arg, int len1, const void *s1, int len2,
+                           const void *s2)
+{
+  const unsigned char *p = s1, *end1 = p + len1;
+  const unsigned char *q = s2, *end2 = q + len2;
+  int zeros = 0;
+  while (p < end1 && q < end2)
+  {
+    if (!isdigit(*p) || !isdigit(*q))
+    {
+      if (*p != *q)
+        return *p < *q ? -1 : 1;
+      ++p, ++q;
+      continue;
+    }
+
+    const unsigned char *a = p, *b = q;
+    while (a < end1 && *a == '0')
+      ++a;
+    while (b < end2 && *b == '0')
+      ++b;
+    if (!zeros)
+      zeros = (int)((a - p) - (b - q));
+
+    const unsigned char *x = a, *y = b;
+    while (x < end1 && isdigit(*x))
+      ++x;
+    while (y < end2 && isdigit(*y))
+      ++y;
+    if (x - a != y - b)
+      return x - a < y - b ? -1 : 1;
+    int c = memcmp(a, b, x - a);
+    if (c)
+      return c < 0 ? -1 : 1;
+    p = x, q = y;
+  }
+  if (p < end1 || q < end2)
+    return (p < end1) - (q < end2);
+  return zeros < 0 ? -1 : zeros > 0;
+}
+
+/* Decode one code point, taking bytes that are not valid UTF-8 as is. */
+static unsigned long decode_utf8(const unsigned char **pos,
+                                 const unsigned char *end)
+{
+  const unsigned char *p = *pos;
+  unsigned long code = *p++;
+  int extra = code >= 0xf0 ? 3 : code >= 0xe0 ? 2 : code >= 0xc0 ? 1 : 0;
+  if (extra == 0 || end - p < extra)
+  {
+    *pos = p;
+    return code;
+  }
+
+  code &= 0x3f >> extra;
+  for (int i = 0; i < extra; ++i)
+  {
+    if ((p[i] & 0xc0) != 0x80)
+    {
+      *pos = p;
+      return p[-1];
+    }
+    code = (code << 6) | (p[i] & 0x3f);
+  }
+  *pos = p + extra;
+  return code;
+}
+
+/*
+ * Simple case folding of the Latin, Greek, Cyrillic and Armenian letters and
+ * of fullwidth Latin letters. Other code points are left as they are.
+ */
+static unsigned long fold_case(unsigned long c)
+{
+  if (c < 0x80)
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+  if ((c >= 0xc0 && c <= 0xde && c != 0xd7) ||
+      (c >= 0x391 && c <= 0x3ab && c != 0x3a2) ||
+      (c >= 0x410 && c <= 0x42f) || (c >= 0xff21 && c <= 0xff3a))
+    return c + 32;
+  if (c >= 0x400 && c <= 0x40f)
+    return c + 80;
+  if (c >= 0x531 && c <= 0x556)
+    return c + 48;
+  if ((c >= 0x100 && c <= 0x12f) || (c >= 0x132 && c <= 0x137) ||
+      (c >= 0x14a && c <= 0x177) || (c >= 0x3d8 && c <= 0x3ef) ||
+      (c >= 0x460 && c <= 0x481) || (c >= 0x48a && c <= 0x4bf) ||
+      (c >= 0x4d0 && c <= 0x52f) || (c >= 0x1e00 && c <= 0x1e95) ||
+      (c >= 0x1ea0 && c <= 0x1eff))
+    return c | 1;
+  if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17e) ||
+      (c >= 0x4c1 && c <= 0x4ce))
+    return c + (c & 1);
+
+  switch (c)
+  {
+  case 0xb5:
+    return 0x3bc;
+  case 0x178:
+    return 0xff;
+  case 0x17f:
+    return 's';
+  case 0x386:
+    return 0x3ac;
+  case 0x388:
+  case 0x389:
+  case 0x38a:
+    return c + 37;
+  case 0x38c:
+    return 0x3cc;
+  case 0x38e:
+  case 0x38f:
+    return c + 63;
+  case 0x3c2:
+    return 0x3c3;
+  case 0x4c0:
+    return 0x4cf;
+  case 0x1e9e:
+    return 0xdf;
+  default:
+    return c;
+  }
+}
+
+/*
+ * quantile(x, q) estimates the q-quantile of x with a merging t-digest of at
+ * most TDIGEST_CENTROIDS centroids. Rows leaving a window are removed from
+ * the nearest centroid, so windowed results are approximate as well.
+ */
+static void quantile_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  struct tdigest *td = sqlite3_aggregate_context(ctx, sizeof(struct tdigest));
+  if (!td)
+  {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  if (!td->init)
+  {
+    td->q = sqlite3_value_double(argv[1]);
+    if (sqlite3_value_type(argv[1]) == SQLITE_NULL || td->q < 0 || td->q > 1)
+    {
+      sqlite3_result_error(ctx, "quantile must be between 0 and 1", -1);
+      return;
+    }
+    td->init = 1;
+  }
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return;
+
+  double x = sqlite3_value_double(argv[0]);
+  if (td->total == 0 || x < td->min)
+  {
+    td->min = x;
+    td->min_count = 0;
+  }
+  if (td->total == 0 || x > td->max)
+  {
+    td->max = x;
+    td->max_count = 0;
+  }
+  td->min_count += x == td->min;
+  td->max_count += x == td->max;
+  td->total += 1;
+
+  if (td->count == TDIGEST_CENTROIDS + TDIGEST_BUFFER)
+    tdigest_merge(td);
+  td->points[td->count].mean = x;
+  td->points[td->count].weight = 1;
+  td->count++;
+}
+
+static void quantile_inverse(sqlite3_context *ctx, int argc,
+                             sqlite3_value **argv)
+{
+  struct tdigest *td = sqlite3_aggregate_context(ctx, sizeof(struct tdigest));
+  if (!td || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return;
+
+  tdigest_merge(td);
+  double x = sqlite3_value_double(argv[0]);
+  int nearest = 0;
+  for (int i = 1; i < td->count; ++i)
+    if (fabs(td->points[i].mean - x) < fabs(td->points[nearest].mean - x))
+      nearest = i;
+
+  td->total -= 1;
+  struct centroid *c = &td->points[nearest];
+  if (c->weight > 1)
+    c->mean = (c->mean * c->weight - x) / (c->weight - 1);
+  c->weight -= 1;
+  if (c->weight <= 0)
+  {
+    memmove(&td->points[nearest], &td->points[nearest + 1],
+            (td->count - nearest - 1) * sizeof(struct centroid));
+    td->count--;
+    td->merged--;
+  }
+  /* The extremes are exact while a copy of them is left in the window.
+   * After that, the best that is left to go by is the outermost centroid. */
+  if (td->count == 0)
+    td->total = 0;
+  else
+  {
+    if (x == td->min && --td->min_count == 0)
+    {
+      td->min = td->points[0].mean;
+      td->min_count = td->points[0].weight == 1;
+    }
+    if (x == td->max && --td->max_count == 0)
+    {
+      td->max = td->points[td->count - 1].mean;
+      td->max_count = td->points[td->count - 1].weight == 1;
+    }
+  }
+}
+
+static void quantile_value(sqlite3_context *ctx)
+{
+  struct tdigest *td = sqlite3_aggregate_context(ctx, 0);
+  if (!td || td->total <= 0 || td->count == 0)
+    return;
+
+  tdigest_merge(td);
+  struct centroid *c = td->points;
+  double target = td->q * td->total;
+
+  if (td->count == 1)
+  {
+    sqlite3_result_double(ctx, c[0].mean);
+    return;
+  }
+  if (target < c[0].weight / 2)
+  {
+    double t = target / (c[0].weight / 2);
+    sqlite3_result_double(ctx, td->min + t * (c[0].mean - td->min));
+    return;
+  }
+
+  double cumulative = c[0].weight / 2;
+  for (int i = 0; i + 1 < td->count; ++i)
+  {
+    double step = (c[i].weight + c[i + 1].weight) / 2;
+    if (target < cumulative + step)
+    {
+      double t = (target - cumulative) / step;
+      sqlite3_result_double(ctx, c[i].mean + t * (c[i + 1].mean - c[i].mean));
+      return;
+    }
+    cumulative += step;
+  }
+
+  struct centroid *last = &c[td->count - 1];
+  double t = (target - cumulative) / (last->weight / 2);
+  sqlite3_result_double(ctx, last->mean + fmin(t, 1) * (td->max - last->mean));
+}
+
+static void tdigest_merge(struct tdigest *td)
+{
+  if (td->merged == td->count)
+    return;
+
+  qsort(td->points, td->count, sizeof(struct centroid), centroid_compare);
+
+  /* Centroids near the tails are kept small by the k1 scale function
+   * k(q) = delta / (2 pi) * asin(2q - 1). */
+  double half_pi = asin(1.0);
+  double scale = TDIGEST_DELTA / (4 * half_pi);
+  double so_far = 0;
+  double limit = td->total * (sin(fmin(1 / scale - half_pi, half_pi)) + 1) / 2;
+  int n = 0;
+  for (int i = 1; i < td->count; ++i)
+  {
+    struct centroid *cur = &td->points[n], *next = &td->points[i];
+    if (so_far + cur->weight + next->weight <= limit)
+    {
+      cur->weight += next->weight;
+      cur->mean += (next->mean - cur->mean) * next->weight / cur->weight;
+    }
+    else
+    {
+      so_far += cur->weight;
+      double k = asin(fmin(2 * so_far / td->total - 1, 1)) * scale + 1;
+      limit = td->total * (sin(fmin(k / scale, half_pi)) + 1) / 2;
+      td->points[++n] = *next;
+    }
+  }
+  td->count = td->merged = n + 1;
+}
+
+static int centroid_compare(const void *a, const void *b)
+{
+  double x = ((const struct centroid *)a)->mean;
+  double y = ((const struct centroid *)b)->mean;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+ * approx_count_distinct(x) is a HyperLogLog estimate with HLL_REGISTERS
+ * registers. Rows leave windows in the order they were added, so removing a
+ * row only needs to expire the oldest register entries.
+ */
+static void hll_step(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  struct hll *hll = sqlite3_aggregate_context(ctx, sizeof(struct hll));
+  if (!hll)
+  {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+    return;
+
+  sqlite3_uint64 hash = hll_hash(argv[0]);
+  int reg = hash >> (64 - HLL_BITS);
+  sqlite3_uint64 rest = (hash << HLL_BITS) | (1ULL << (HLL_BITS - 1));
+  unsigned char rank = 1;
+  while (!(rest & (1ULL << 63)))
+  {
+    rest <<= 1;
+    ++rank;
+  }
+
+  hll_expire(hll, reg);
+  int len = hll->len[reg];
+  while (len > 0 && hll->entries[reg][len - 1].rank <= rank)
+    --len;
+  if (len == hll->size[reg])
+  {
+    int size = len ? 2 * len : 4;
+    if (size > HLL_MAX_DEPTH)
+      size = HLL_MAX_DEPTH;
+    struct hll_entry *entries = (struct hll_entry *)sqlite3_realloc(
+        hll->entries[reg], size * sizeof(struct hll_entry));
+    if (!entries)
+    {
+      sqlite3_result_error_nomem(ctx);
+      return;
+    }
+    hll->entries[reg] = entries;
+    hll->size[reg] = size;
+  }
+  hll->entries[reg][len].rank = rank;
+  hll->entries[reg][len].seq = hll->added++;
+  hll->len[reg] = len + 1;
+}
+
+static void hll_inverse(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  struct hll *hll = sqlite3_aggregate_context(ctx, sizeof(struct hll));
+  if (hll && sqlite3_value_type(argv[0]) != SQLITE_NULL)
+    hll->removed++;
+}
+
+static void hll_value(sqlite3_context *ctx)
+{
+  struct hll *hll = sqlite3_aggregate_context(ctx, 0);
+  if (!hll)
+  {
+    sqlite3_result_int(ctx, 0);
+    return;
+  }
+
+  double sum = 0;
+  int zeros = 0;
+  for (int reg = 0; reg < HLL_REGISTERS; ++reg)
+  {
+    hll_expire(hll, reg);
+    int rank = hll->len[reg] ? hll->entries[reg][0].rank : 0;
+    sum += ldexp(1, -rank);
+    zeros += rank == 0;
+  }
+
+  double m = HLL_REGISTERS;
+  double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+  if (estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log(m / zeros);
+  sqlite3_result_int64(ctx, (sqlite3_int64)(estimate + 0.5));
+}
+
+static void hll_final(sqlite3_context *ctx)
+{
+  hll_value(ctx);
+  struct hll *hll = sqlite3_aggregate_context(ctx, 0);
+  if (hll)
+    for (int reg = 0; reg < HLL_REGISTERS; ++reg)
+      sqlite3_free(hll->entries[reg]);
+}
+
+static sqlite3_uint64 hll_hash(sqlite3_value *value)
+{
+  unsigned char bytes[8];
+  const unsigned char *data = bytes;
+  size_t len = sizeof(bytes);
+  sqlite3_uint64 hash = 14695981039346656037ULL;
+
+  int type = sqlite3_value_type(value);
+  double d = sqlite3_value_double(value);
+  if (type == SQLITE_FLOAT && d == (double)(sqlite3_int64)d)
+    type = SQLITE_INTEGER;
+
+  if (type == SQLITE_INTEGER)
+    put_u64(bytes, (sqlite3_uint64)sqlite3_value_int64(value));
+  else if (type == SQLITE_FLOAT)
+    memcpy(bytes, &d, sizeof(d));
+  else
+  {
+    data = sqlite3_value_blob(value);
+    len = sqlite3_value_bytes(value);
+  }
+
+  hash = (hash ^ type) * 1099511628211ULL;
+  for (size_t i = 0; i < len; ++i)
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static void hll_expire(struct hll *hll, int reg)
+{
+  int expired = 0;
+  while (expired < hll->len[reg] &&
+         (int)(hll->entries[reg][expired].seq - hll->removed) < 0)
+    ++expired;
+  if (!expired)
+    return;
+
+  hll->len[reg] -= expired;
+  memmove(hll->entries[reg], hll->entries[reg] + expired,
+          hll->len[reg] * sizeof(struct hll_entry));
+}
+
+/*
+ * histogram(x, bounds) counts values into the buckets separated by the JSON
+ * array of ascending bounds and returns the counts as a JSON array, one
+ * element longer than bounds.
+ */
+static void histogram_step(sqlite3_context *ctx, int argc,
+                           sqlite3_value **argv)
+{
+  struct histogram *h =
+      sqlite3_aggregate_context(ctx, sizeof(struct histogram));
+  if (!h)
+  {
+    sqlite3_result_error_nomem(ctx);
+    return;
+  }
+
+  if (h->nbounds == 0)
+  {
+    const char *json = (const char *)sqlite3_value_text(argv[1]);
+    if (!json || !histogram_bounds(h, json))
+    {
+      sqlite3_result_error(
+          ctx, "histogram bounds must be a JSON array of ascending numbers",
+          -1);
+      return;
+    }
+  }
+
+  if (sqlite3_value_type(argv[0]) != SQLITE_NULL)
+    h->counts[histogram_bucket(h, sqlite3_value_double(argv[0]))]++;
+}
+
+static void histogram_inverse(sqlite3_context *ctx, int argc,
+                              sqlite3_value **argv)
+{
+  struct histogram *h =
+      sqlite3_aggregate_context(ctx, sizeof(struct histogram));
+  if (h && h->nbounds > 0 && sqlite3_value_type(argv[0]) != SQLITE_NULL)
+    h->counts[histogram_bucket(h, sqlite3_value_double(argv[0]))]--;
+}
+
+static void histogram_value(sqlite3_context *ctx)
+{
+  struct histogram *h = sqlite3_aggregate_context(ctx, 0);
+  if (!h || h->nbounds == 0)
+    return;
+
+  sqlite3_str *str = sqlite3_str_new(NULL);
+  for (int i = 0; i <= h->nbounds; ++i)
+    sqlite3_str_appendf(str, "%c%lld", i ? ',' : '[', h->counts[i]);
+  sqlite3_str_appendchar(str, 1, ']');
+
+  int len = sqlite3_str_length(str);
+  char *json = sqlite3_str_finish(str);
+  if (!json)
+    sqlite3_result_error_nomem(ctx);
+  else
+    sqlite3_result_text(ctx, json, len, sqlite3_free);
+}
+
+static int histogram_bounds(struct histogram *h, const char *json)
+{
+  while (isspace((unsigned char)*json))
+    ++json;
+  if (*json++ != '[')
+    return 0;
+
+  for (;;)
+  {
+    char *end;
+    double bound = strtod(json, &end);
+    if (end == json || h->nbounds == HISTOGRAM_MAX_BOUNDS ||
+        (h->nbounds > 0 && bound <= h->bounds[h->nbounds - 1]))
+      return 0;
+    h->bounds[h->nbounds++] = bound;
+
+    json = end;
+    while (isspace((unsigned char)*json))
+      ++json;
+    if (*json == ']')
+      return 1;
+    if (*json++ != ',')
+      return 0;
+  }
+}
+
+static int histogram_bucket(struct histogram *h, double x)
+{
+  int low = 0, high = h->nbounds;
+  while (low < high)
+  {
+    int mid = (low + high) / 2;
+    if (x < h->bounds[mid])
+      high = mid;
+    else
+      low = mid + 1;
+  }
+  return low;
+}
+
+/*
+ * Vectors are blobs of native float32 values. The kernels are picked once
+ * at load time according to the instruction sets the CPU supports.
+ */
+static void init_vec_kernels(void)
+{
+#ifdef VEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+  {
+    vec_dot = vec_dot_avx2;
+    vec_l2 = vec_l2_avx2;
+  }
+  else if (__builtin_cpu_supports("sse"))
+  {
+    vec_dot = vec_dot_sse;
+    vec_l2 = vec_l2_sse;
+  }
+#endif
+}
+
+static void sql_vec(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  int metric = (const char **)sqlite3_user_data(ctx) - vec_metrics;
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL)
+    return;
+
+  size_t n = 0, m = 0;
+  const char *error = NULL;
+  const void *a = vec_value(argv[0], &n, &error);
+  const void *b = vec_value(argv[1], &m, &error);
+  if (!error && n != m)
+    error = "vectors must have the same dimension";
+  if (error)
+    sqlite3_result_error(ctx, error, -1);
+  else
+    sqlite3_result_double(ctx, vec_score(metric, a, b, n));
+}
+
+static const void *vec_value(sqlite3_value *value, size_t *n,
+                             const char **error)
+{
+  int type = sqlite3_value_type(value);
+  if (type != SQLITE_BLOB && type != SQLITE_TEXT)
+  {
+    *n = 0;
+    *error = "vector must be a blob of float32 values";
+    return NULL;
+  }
+
+  const void *data = sqlite3_value_blob(value);
+  size_t len = sqlite3_value_bytes(value);
+  if (len % sizeof(float))
+    *error = "vector size is not a multiple of 4 bytes";
+  *n = len / sizeof(float);
+  return data;
+}
+
+static double vec_score(int metric, const void *a, const void *b, size_t n)
+{
+  switch (metric)
+  {
+  case VEC_DOT:
+    return vec_dot(a, b, n);
+  case VEC_COSINE:
+  {
+    double norm = sqrt((double)vec_dot(a, a, n) * vec_dot(b, b, n));
+    return norm > 0 ? vec_dot(a, b, n) / norm : 0;
+  }
+  case VEC_L2:
+  default:
+    return sqrt(vec_l2(a, b, n));
+  }
+}
+
+static float vec_dot_scalar(const void *a, const void *b, size_t n)
+{
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    float x, y;
+    memcpy(&x, (const char *)a + i * sizeof(float), sizeof(float));
+    memcpy(&y, (const char *)b + i * sizeof(float), sizeof(float));
+    sum += x * y;
+  }
+  return sum;
+}
+
+static float vec_l2_scalar(const void *a, const void *b, size_t n)
+{
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    float x, y;
+    memcpy(&x, (const char *)a + i * sizeof(float), sizeof(float));
+    memcpy(&y, (const char *)b + i * sizeof(float), sizeof(float));
+    sum += (x - y) * (x - y);
+  }
+  return sum;
+}
+
+#ifdef VEC_X86
+VEC_TARGET("sse") static float vec_dot_sse(const void *a, const void *b,
+                                           size_t n)
+{
+  const float *x = a, *y = b;
+  __m128 sum = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i)));
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, sum);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         vec_dot_scalar(x + i, y + i, n - i);
+}
+
+VEC_TARGET("sse") static float vec_l2_sse(const void *a, const void *b,
+                                          size_t n)
+{
+  const float *x = a, *y = b;
+  __m128 sum = _mm_setzero_ps();
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128 d = _mm_sub_ps(_mm_loadu_ps(x + i), _mm_loadu_ps(y + i));
+    sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+  }
+
+  float lanes[4];
+  _mm_storeu_ps(lanes, sum);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         vec_l2_scalar(x + i, y + i, n - i);
+}
+
+VEC_TARGET("avx2,fma") static float vec_dot_avx2(const void *a,
+                                                 const void *b, size_t n)
+{
+  const float *x = a, *y = b;
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i),
+                           sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8),
+                           _mm256_loadu_ps(y + i + 8), sum1);
+  }
+  for (; i + 8 <= n; i += 8)
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i),
+                           sum0);
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, _mm256_add_ps(sum0, sum1));
+  float sum = 0;
+  for (int j = 0; j < 8; ++j)
+    sum += lanes[j];
+  return sum + vec_dot_scalar(x + i, y + i, n - i);
+}
+
+VEC_TARGET("avx2,fma") static float vec_l2_avx2(const void *a, const void *b,
+                                                size_t n)
+{
+  const float *x = a, *y = b;
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+  {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+    __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(x + i + 8),
+                              _mm256_loadu_ps(y + i + 8));
+    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+  }
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256 d = _mm256_sub_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i));
+    sum0 = _mm256_fmadd_ps(d, d, sum0);
+  }
+
+  float lanes[8];
+  _mm256_storeu_ps(lanes, _mm256_add_ps(sum0, sum1));
+  float sum = 0;
+  for (int j = 0; j < 8; ++j)
+    sum += lanes[j];
+  return sum + vec_l2_scalar(x + i, y + i, n - i);
+}
+#endif
+
+/*
+ * vec_topk(table, column, query, k[, metric]) scans column of table and
+ * returns the ids and scores of the k vectors closest to query, best first.
+ * Only the k best hits are kept in a heap while scanning.
+ */
+static int vec_topk_connect(sqlite3 *db, void *aux, int argc,
+                            const char *const *argv, sqlite3_vtab **vtab,
+                            char **error)
+{
+  int status = sqlite3_declare_vtab(
+      db, "CREATE TABLE x(id, score, tbl HIDDEN, col HIDDEN, query HIDDEN, "
+          "k HIDDEN, metric HIDDEN)");
+  if (status != SQLITE_OK)
+    return status;
+
+  struct vec_topk_vtab *topk = sqlite3_malloc(sizeof(struct vec_topk_vtab));
+  if (!topk)
+    return SQLITE_NOMEM;
+  memset(topk, 0, sizeof(struct vec_topk_vtab));
+  topk->db = db;
+  *vtab = &topk->base;
+  return SQLITE_OK;
+}
+
+static int vec_topk_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  int args[5] = {-1, -1, -1, -1, -1};
+
+  for (int i = 0; i < info->nConstraint; ++i)
+  {
+    struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (c->iColumn < 2 || c->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    if (!c->usable)
+      return SQLITE_CONSTRAINT;
+    args[c->iColumn - 2] = i;
+  }
+
+  int argc = 0;
+  for (int i = 0; i < 5; ++i)
+  {
+    if (args[i] < 0)
+      continue;
+    info->aConstraintUsage[args[i]].argvIndex = ++argc;
+    info->aConstraintUsage[args[i]].omit = 1;
+    info->idxNum |= 1 << i;
+  }
+  info->estimatedCost = 1000000;
+  return SQLITE_OK;
+}
+
+static int vec_topk_disconnect(sqlite3_vtab *vtab)
+{
+  sqlite3_free(vtab);
+  return SQLITE_OK;
+}
+
+static int vec_topk_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cursor)
+{
+  struct vec_topk_cursor *c = sqlite3_malloc(sizeof(struct vec_topk_cursor));
+  if (!c)
+    return SQLITE_NOMEM;
+  memset(c, 0, sizeof(struct vec_topk_cursor));
+  *cursor = &c->base;
+  return SQLITE_OK;
+}
+
+static int vec_topk_close(sqlite3_vtab_cursor *cursor)
+{
+  sqlite3_free(((struct vec_topk_cursor *)cursor)->hits);
+  sqlite3_free(cursor);
+  return SQLITE_OK;
+}
+
+static int vec_topk_filter(sqlite3_vtab_cursor *cursor, int index,
+                           const char *index_str, int argc,
+                           sqlite3_value **argv)
+{
+  struct vec_topk_cursor *c = (struct vec_topk_cursor *)cursor;
+  struct vec_topk_vtab *vtab = (struct vec_topk_vtab *)cursor->pVtab;
+
+  sqlite3_free(c->hits);
+  c->hits = NULL;
+  c->count = c->pos = 0;
+
+  if ((index & 0xf) != 0xf)
+  {
+    vtab->base.zErrMsg = sqlite3_mprintf(
+        "vec_topk requires table, column, query and k arguments");
+    return SQLITE_ERROR;
+  }
+
+  const char *table = (const char *)sqlite3_value_text(argv[0]);
+  const char *column = (const char *)sqlite3_value_text(argv[1]);
+  sqlite3_int64 k = sqlite3_value_int64(argv[3]);
+  int metric = VEC_COSINE;
+  if (argc > 4)
+  {
+    const char *name = (const char *)sqlite3_value_text(argv[4]);
+    for (metric = 0; vec_metrics[metric]; ++metric)
+      if (name && !strcmp(name, vec_metrics[metric]))
+        break;
+    if (!vec_metrics[metric])
+    {
+      vtab->base.zErrMsg = sqlite3_mprintf("no such metric: %s", name);
+      return SQLITE_ERROR;
+    }
+  }
+
+  size_t n;
+  const char *error = NULL;
+  const void *query = vec_value(argv[2], &n, &error);
+  if (error || !table || !column)
+  {
+    vtab->base.zErrMsg =
+        sqlite3_mprintf("%s", error ? error : "table and column expected");
+    return SQLITE_ERROR;
+  }
+  if (k <= 0)
+    return SQLITE_OK;
+
+  char *sql = sqlite3_mprintf("SELECT rowid, \"%w\" FROM \"%w\"", column, table);
+  if (!sql)
+    return SQLITE_NOMEM;
+
+  sqlite3_stmt *stmt;
+  int status = sqlite3_prepare_v2(vtab->db, sql, -1, &stmt, NULL);
+  sqlite3_free(sql);
+  if (status != SQLITE_OK)
+  {
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+    return status;
+  }
+
+  status = vec_topk_scan(c, stmt, metric, query, n, k);
+  sqlite3_finalize(stmt);
+  if (status == SQLITE_MISMATCH)
+    vtab->base.zErrMsg = sqlite3_mprintf("vectors must have the same dimension");
+  else if (status != SQLITE_OK && status != SQLITE_NOMEM)
+    vtab->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(vtab->db));
+  return status;
+}
+
+static int vec_topk_scan(struct vec_topk_cursor *cursor, sqlite3_stmt *stmt,
+                         int metric, const void *query, size_t n,
+                         sqlite3_int64 k)
+{
+  int limit = k < INT_MAX / (int)sizeof(struct vec_hit)
+                  ? (int)k
+                  : INT_MAX / (int)sizeof(struct vec_hit);
+  int size = limit < 64 ? limit : 64;
+  cursor->hits = sqlite3_malloc64(size * sizeof(struct vec_hit));
+  if (!cursor->hits)
+    return SQLITE_NOMEM;
+
+  /* Scores are compared so that larger is better, so negate distances. */
+  double sign = metric == VEC_L2 ? -1 : 1;
+  double query_norm = sqrt(vec_dot(query, query, n));
+
+  int status;
+  while ((status = sqlite3_step(stmt)) == SQLITE_ROW)
+  {
+    if (sqlite3_column_type(stmt, 1) == SQLITE_NULL)
+      continue;
+    if ((size_t)sqlite3_column_bytes(stmt, 1) != n * sizeof(float))
+      return SQLITE_MISMATCH;
+
+    const void *v = sqlite3_column_blob(stmt, 1);
+    struct vec_hit hit = {sqlite3_column_int64(stmt, 0), 0};
+    if (metric == VEC_COSINE)
+    {
+      double norm = query_norm * sqrt(vec_dot(v, v, n));
+      hit.score = norm > 0 ? vec_dot(query, v, n) / norm : 0;
+    }
+    else
+      hit.score = sign * vec_score(metric, query, v, n);
+
+    if (cursor->count == size && size < limit)
+    {
+      int grow = size * 2 < limit ? size * 2 : limit;
+      struct vec_hit *hits =
+          sqlite3_realloc64(cursor->hits, grow * sizeof(struct vec_hit));
+      if (!hits)
+        return SQLITE_NOMEM;
+      cursor->hits = hits;
+      size = grow;
+    }
+    vec_heap_push(cursor->hits, &cursor->count, limit, hit);
+  }
+  if (status != SQLITE_DONE)
+    return status;
+
+  qsort(cursor->hits, cursor->count, sizeof(struct vec_hit), vec_hit_compare);
+  for (int i = 0; i < cursor->count; ++i)
+    cursor->hits[i].score *= sign;
+  return SQLITE_OK;
+}
+
+/* Keep the k best hits in a min-heap whose root is the worst of them. */
+static void vec_heap_push(struct vec_hit *heap, int *count, int k,
+                          struct vec_hit hit)
+{
+  int i;
+  if (*count < k)
+  {
+    i = (*count)++;
+    while (i > 0 && heap[(i - 1) / 2].score > hit.score)
+    {
+      heap[i] = heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    heap[i] = hit;
+    return;
+  }
+  if (hit.score <= heap[0].score)
+    return;
+
+  i = 0;
+  for (;;)
   {
-    lua_pushfstring(L, "%s: %s", filename, sqlite3_errmsg(*db));
-    close_sqlite(db);
-    return lua_error(L);
+    int child = 2 * i + 1;
+    if (child >= k)
+      break;
+    if (child + 1 < k && heap[child + 1].score < heap[child].score)
+      ++child;
+    if (heap[child].score >= hit.score)
+      break;
+    heap[i] = heap[child];
+    i = child;
   }
-  return 1;
+  heap[i] = hit;
 }
 
-static int db_close(lua_State *L)
+static int vec_hit_compare(const void *a, const void *b)
 {
-  close_sqlite((sqlite3 **)luaL_checkudata(L, 1, "sqlite3.db"));
-  return 0;
+  double x = ((const struct vec_hit *)a)->score;
+  double y = ((const struct vec_hit *)b)->score;
+  return x < y ? 1 : x > y ? -1 : 0;
 }
 
-static int db_prepare(lua_State *L)
+static int vec_topk_next(sqlite3_vtab_cursor *cursor)
 {
-  prepare_stmt(L, *(sqlite3 **)luaL_checkudata(L, 1, "sqlite3.db"));
-  return 1;
+  ((struct vec_topk_cursor *)cursor)->pos++;
+  return SQLITE_OK;
 }
 
-static int db_query_all(lua_State *L) { return step_all(L, prepare_query(L)); }
-
-static int db_query_one(lua_State *L) { return step_one(L, prepare_query(L)); }
-
-static int db_query(lua_State *L)
+static int vec_topk_eof(sqlite3_vtab_cursor *cursor)
 {
-  prepare_query(L);
-  lua_pushcclosure(L, iter, 1);
-  return 1;
+  struct vec_topk_cursor *c = (struct vec_topk_cursor *)cursor;
+  return c->pos >= c->count;
 }
 
-static int db_tostring(lua_State *L)
+static int vec_topk_column(sqlite3_vtab_cursor *cursor, sqlite3_context *ctx,
+                           int column)
 {
-  sqlite3 **db = (sqlite3 **)luaL_checkudata(L, 1, "sqlite3.db");
-  const char *name = sqlite3_db_filename(*db, "main");
-  lua_pushfstring(L, "sqlite3: %s", name);
-  return 1;
+  struct vec_topk_cursor *c = (struct vec_topk_cursor *)cursor;
+  if (column == 0)
+    sqlite3_result_int64(ctx, c->hits[c->pos].id);
+  else if (column == 1)
+    sqlite3_result_double(ctx, c->hits[c->pos].score);
+  return SQLITE_OK;
 }
 
-static int db_transaction(lua_State *L)
+static int vec_topk_rowid(sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid)
 {
-  sqlite3 *db = *(sqlite3 **)luaL_checkudata(L, 1, "sqlite3.db");
-  luaL_argcheck(L, lua_type(L, 2) == LUA_TFUNCTION, 2,
-                "argument 2 is not a function");
+  *rowid = ((struct vec_topk_cursor *)cursor)->pos + 1;
+  return SQLITE_OK;
+}
 
-  int status = sqlite3_exec(db, "SAVEPOINT clutch_savepoint", NULL, NULL, NULL);
+/*
+ * Archives written by db:archive() consist of a 32 byte header: the magic
+ * "CLUTCHZ1", page size and page count as 32 bit integers and the offset of
+ * the page map as a 64 bit integer, all little endian. The header is followed
+ * by each database page compressed with zlib and the page map, which holds a
+ * 64 bit file offset and a 32 bit size for each page. Pages that do not
+ * compress are stored as such, with their size equal to the page size.
+ */
+static int write_archive(sqlite3 *handle, FILE *out, sqlite3_int64 *size)
+{
+  sqlite3_file *db_file = NULL;
+  int status = sqlite3_file_control(handle, "main", SQLITE_FCNTL_FILE_POINTER,
+                                    &db_file);
   if (status != SQLITE_OK)
+    return status;
+
+  sqlite3_stmt *stmt;
+  sqlite3_int64 counts[2] = {0, 0};
+  const char *pragmas[2] = {"PRAGMA main.page_size", "PRAGMA main.page_count"};
+  for (int i = 0; i < 2; ++i)
   {
-    return luaL_error(L, "%s", sqlite3_errmsg(db));
+    status = sqlite3_prepare_v2(handle, pragmas[i], -1, &stmt, NULL);
+    if (status != SQLITE_OK)
+      return status;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+      counts[i] = sqlite3_column_int64(stmt, 0);
+    status = sqlite3_finalize(stmt);
+    if (status != SQLITE_OK)
+      return status;
   }
 
-  lua_settop(L, 2);
-  lua_insert(L, -2);
-  status = lua_pcall(L, 1, LUA_MULTRET, 0);
+  sqlite3_int64 page_size = counts[0], page_count = counts[1];
+  if (page_count > 0xffffffffL)
+    return SQLITE_TOOBIG;
 
-  if (status == LUA_OK)
+  uLong bound = compressBound(page_size);
+  unsigned char *page = sqlite3_malloc64(page_size + bound);
+  unsigned char *map = sqlite3_malloc64(page_count * ARCHIVE_ENTRY + 1);
+  if (!page || !map)
   {
-    sqlite3_exec(db, "RELEASE clutch_savepoint", NULL, NULL, NULL);
+    sqlite3_free(page);
+    sqlite3_free(map);
+    return SQLITE_NOMEM;
   }
-  else
+
+  unsigned char header[ARCHIVE_HEADER] = ARCHIVE_MAGIC;
+  sqlite3_uint64 offset = ARCHIVE_HEADER;
+  if (fwrite(header, ARCHIVE_HEADER, 1, out) != 1)
+    status = SQLITE_IOERR_WRITE;
+
+  for (sqlite3_int64 i = 0; i < page_count && status == SQLITE_OK; ++i)
   {
-    sqlite3_exec(db, "ROLLBACK TO clutch_savepoint", NULL, NULL, NULL);
-  }
-  lua_pushboolean(L, status == LUA_OK);
+    status = db_file->pMethods->xRead(db_file, page, page_size, i * page_size);
+    if (status != SQLITE_OK)
+      break;
 
-  lua_insert(L, 1);
-  return lua_gettop(L);
-}
+    /* Archives have no shared memory for a write-ahead log, so mark them as
+     * rollback journal databases. */
+    if (i == 0 && page[18] == 2 && page[19] == 2)
+      page[18] = page[19] = 1;
 
-static int db_update(lua_State *L) { return update(L, prepare_query(L)); }
+    const unsigned char *data = page;
+    uLongf len = bound;
+    if (compress2(page + page_size, &len, page, page_size,
+                  Z_BEST_COMPRESSION) == Z_OK &&
+        len < (uLongf)page_size)
+      data = page + page_size;
+    else
+      len = page_size;
 
-static int prep_stmt_all(lua_State *L) { return step_all(L, rebind_stmt(L)); }
+    if (len && fwrite(data, len, 1, out) != 1)
+      status = SQLITE_IOERR_WRITE;
+    put_u64(map + i * ARCHIVE_ENTRY, offset);
+    put_u32(map + i * ARCHIVE_ENTRY + 8, len);
+    offset += len;
+  }
 
-static int prep_stmt_close(lua_State *L)
-{
-  close_sqlite_stmt((sqlite3_stmt **)luaL_checkudata(L, 1, "sqlite3.stmt"));
-  return 0;
+  if (status == SQLITE_OK)
+  {
+    memcpy(header, ARCHIVE_MAGIC, 8);
+    put_u32(header + 8, page_size);
+    put_u32(header + 12, page_count);
+    put_u64(header + 16, offset);
+    if ((page_count && fwrite(map, page_count * ARCHIVE_ENTRY, 1, out) != 1) ||
+        fseek(out, 0, SEEK_SET) || fwrite(header, ARCHIVE_HEADER, 1, out) != 1)
+      status = SQLITE_IOERR_WRITE;
+    *size = offset + page_count * ARCHIVE_ENTRY;
+  }
+
+  sqlite3_free(page);
+  sqlite3_free(map);
+  return status;
 }
 
-static int prep_stmt_iter(lua_State *L)
+static void register_archive_vfs(void)
 {
-  rebind_stmt(L);
-  lua_pushcclosure(L, iter, 1);
-  return 1;
-}
+  if (sqlite3_vfs_find(ARCHIVE_VFS))
+    return;
 
-static int prep_stmt_one(lua_State *L) { return step_one(L, rebind_stmt(L)); }
+  sqlite3_vfs *real = sqlite3_vfs_find(NULL);
+  if (!real)
+    return;
 
-static int prep_stmt_tostring(lua_State *L)
-{
-  sqlite3_stmt *stmt = *(sqlite3_stmt **)luaL_checkudata(L, 1, "sqlite3.stmt");
-  lua_pushstring(L, sqlite3_sql(stmt));
-  return 1;
+  archive_vfs.pAppData = real;
+  archive_vfs.mxPathname = real->mxPathname;
+  archive_vfs.szOsFile = sizeof(struct archive_file) + real->szOsFile;
+  sqlite3_vfs_register(&archive_vfs, 0);
 }
 
-static int prep_stmt_update(lua_State *L) { return update(L, rebind_stmt(L)); }
+#define REAL_VFS(vfs) ((sqlite3_vfs *)(vfs)->pAppData)
 
-static sqlite3_stmt *rebind_stmt(lua_State *L)
+static int archive_open(sqlite3_vfs *vfs, const char *name, sqlite3_file *file,
+                        int flags, int *out_flags)
 {
-  sqlite3_stmt *stmt = *(sqlite3_stmt **)luaL_checkudata(L, 1, "sqlite3.stmt");
-  sqlite3_reset(stmt);
-  bind_stmt(L, stmt, 1);
-  return stmt;
-}
+  /* Only the main database is compressed, journals and temporary files are
+   * opened directly in the space of the archive file. */
+  if (!(flags & SQLITE_OPEN_MAIN_DB))
+    return REAL_VFS(vfs)->xOpen(REAL_VFS(vfs), name, file, flags, out_flags);
 
-static sqlite3_stmt *prepare_query(lua_State *L)
-{
-  sqlite3 *db = *(sqlite3 **)luaL_checkudata(L, 1, "sqlite3.db");
-  sqlite3_stmt *stmt = prepare_stmt(L, db);
+  struct archive_file *archive = (struct archive_file *)file;
+  memset(archive, 0, sizeof(struct archive_file));
+  archive->real = (sqlite3_file *)&archive[1];
+  archive->cached = -1;
 
-  int status = bind_stmt(L, stmt, 3);
+  flags &= ~(SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+  flags |= SQLITE_OPEN_READONLY;
+  int status = REAL_VFS(vfs)->xOpen(REAL_VFS(vfs), name, archive->real, flags,
+                                    out_flags);
+  if (status != SQLITE_OK)
+    return status;
+
+  archive->base.pMethods = &archive_io_methods;
+  status = archive_load_map(archive);
   if (status != SQLITE_OK)
   {
-    luaL_error(L, "%s", sqlite3_errmsg(db));
+    archive_close(file);
+    archive->base.pMethods = NULL;
+    return status;
   }
-
-  return stmt;
+  if (out_flags)
+    *out_flags = flags;
+  return SQLITE_OK;
 }
 
-static sqlite3_stmt *prepare_stmt(lua_State *L, sqlite3 *db)
+static int archive_load_map(struct archive_file *file)
 {
-  const char *sql = luaL_checkstring(L, 2);
+  sqlite3_file *real = file->real;
+  sqlite3_int64 file_size;
+  unsigned char header[ARCHIVE_HEADER];
 
-  sqlite3_stmt **stmt =
-      (sqlite3_stmt **)lua_newuserdata(L, sizeof(sqlite3_stmt **));
-  *stmt = NULL;
+  int status = real->pMethods->xFileSize(real, &file_size);
+  if (status != SQLITE_OK)
+    return status;
+  if (file_size < ARCHIVE_HEADER)
+    return SQLITE_NOTADB;
 
-  luaL_getmetatable(L, "sqlite3.stmt");
-  lua_setmetatable(L, -2);
+  status = real->pMethods->xRead(real, header, ARCHIVE_HEADER, 0);
+  if (status != SQLITE_OK)
+    return status;
 
-  lua_insert(L, 3);
+  file->page_size = get_u32(header + 8);
+  file->page_count = get_u32(header + 12);
+  sqlite3_uint64 map = get_u64(header + 16);
+  sqlite3_uint64 map_size = (sqlite3_uint64)file->page_count * ARCHIVE_ENTRY;
+  if (memcmp(header, ARCHIVE_MAGIC, 8) || file->page_size < 512 ||
+      file->page_size > 65536 || map + map_size != (sqlite3_uint64)file_size)
+    return SQLITE_NOTADB;
 
-  int status = sqlite3_prepare_v2(db, sql, strlen(sql), stmt, NULL);
-  if (status != SQLITE_OK)
+  unsigned char *entries = sqlite3_malloc64(map_size + 1);
+  file->pages =
+      sqlite3_malloc64(file->page_count * sizeof(struct archive_page) + 1);
+  file->cache = sqlite3_malloc64(2 * file->page_size);
+  if (!entries || !file->pages || !file->cache)
   {
-    luaL_error(L, "%s", sqlite3_errmsg(db));
+    sqlite3_free(entries);
+    return SQLITE_NOMEM;
   }
+  file->scratch = file->cache + file->page_size;
 
-  return *stmt;
+  status = real->pMethods->xRead(real, entries, map_size, map);
+  for (unsigned int i = 0; status == SQLITE_OK && i < file->page_count; ++i)
+  {
+    file->pages[i].offset = get_u64(entries + i * ARCHIVE_ENTRY);
+    file->pages[i].size = get_u32(entries + i * ARCHIVE_ENTRY + 8);
+    if (file->pages[i].size > file->page_size ||
+        file->pages[i].offset + file->pages[i].size > map)
+      status = SQLITE_CORRUPT;
+  }
+  sqlite3_free(entries);
+  return status;
 }
 
-static int bind_stmt(lua_State *L, sqlite3_stmt *stmt, int nargs)
+static int archive_load_page(struct archive_file *file, sqlite3_int64 page)
 {
-  int top = lua_gettop(L);
-  if (top < nargs + 1)
-    return bind_lua_vars(L, stmt);
-  else if (lua_istable(L, nargs + 1))
-    return bind_params(L, stmt);
+  if (page == file->cached)
+    return SQLITE_OK;
+
+  struct archive_page *entry = &file->pages[page];
+  sqlite3_file *real = file->real;
+  file->cached = -1;
+
+  if (entry->size == file->page_size)
+  {
+    int status =
+        real->pMethods->xRead(real, file->cache, entry->size, entry->offset);
+    if (status != SQLITE_OK)
+      return status;
+  }
   else
-    return bind_varargs(L, top - nargs, stmt);
+  {
+    int status =
+        real->pMethods->xRead(real, file->scratch, entry->size, entry->offset);
+    if (status != SQLITE_OK)
+      return status;
+
+    uLongf len = file->page_size;
+    if (uncompress(file->cache, &len, file->scratch, entry->size) != Z_OK ||
+        len != file->page_size)
+      return SQLITE_CORRUPT;
+  }
+
+  file->cached = page;
+  return SQLITE_OK;
 }
 
-static int bind_params(lua_State *L, sqlite3_stmt *stmt)
+static int archive_close(sqlite3_file *file)
 {
-  int count = sqlite3_bind_parameter_count(stmt);
-  int status = SQLITE_OK;
+  struct archive_file *archive = (struct archive_file *)file;
+  sqlite3_free(archive->pages);
+  sqlite3_free(archive->cache);
+  archive->pages = NULL;
+  archive->cache = NULL;
+  return archive->real->pMethods->xClose(archive->real);
+}
 
-  for (int i = 1; i <= count; ++i)
+static int archive_read(sqlite3_file *file, void *buf, int amount,
+                        sqlite3_int64 offset)
+{
+  struct archive_file *archive = (struct archive_file *)file;
+  unsigned char *out = buf;
+
+  while (amount > 0)
   {
-    const char *name = sqlite3_bind_parameter_name(stmt, i);
-    if (!name || name[0] == '?')
-    {
-#if LUA_VERSION_NUM >= 503
-      lua_geti(L, -1, i);
-#else
-      lua_pushinteger(L, i);
-      lua_gettable(L, -2);
-#endif
-    }
-    else
+    sqlite3_int64 page = offset / archive->page_size;
+    if (page >= archive->page_count)
     {
-      lua_getfield(L, -1, name + 1);
+      memset(out, 0, amount);
+      return SQLITE_IOERR_SHORT_READ;
     }
-    status = bind_one_param(L, stmt, i);
+
+    int status = archive_load_page(archive, page);
     if (status != SQLITE_OK)
-      break;
+      return status;
+
+    int start = offset % archive->page_size;
+    int n = archive->page_size - start;
+    if (n > amount)
+      n = amount;
+    memcpy(out, archive->cache + start, n);
+    out += n;
+    offset += n;
+    amount -= n;
   }
-  lua_pop(L, 1);
-  return status;
+  return SQLITE_OK;
 }
 
-static int bind_one_param(lua_State *L, sqlite3_stmt *stmt, int index)
+static int archive_write(sqlite3_file *file, const void *buf, int amount,
+                         sqlite3_int64 offset)
 {
-  int status = SQLITE_OK;
+  return SQLITE_READONLY;
+}
 
-  if (lua_isstring(L, -1))
-  {
-    size_t len;
-    const char *text = lua_tolstring(L, -1, &len);
-    status = sqlite3_bind_text(stmt, index, text, len, SQLITE_TRANSIENT);
-#if LUA_VERSION_NUM >= 503
-  }
-  else if (lua_isinteger(L, -1))
-  {
-    status = sqlite3_bind_int64(stmt, index, lua_tointeger(L, -1));
-#endif
-  }
-  else if (lua_isnumber(L, -1))
-  {
-    status = sqlite3_bind_double(stmt, index, lua_tonumber(L, -1));
-  }
-  else if (lua_isnil(L, -1))
-  {
-    status = sqlite3_bind_null(stmt, index);
-  }
-  else
-  {
-    return luaL_error(L, "unsupported lua type '%s' at position %d",
-                      lua_typename(L, lua_type(L, -1)), index);
-  }
+static int archive_truncate(sqlite3_file *file, sqlite3_int64 size)
+{
+  return SQLITE_READONLY;
+}
 
-  lua_pop(L, 1);
-  return status;
+static int archive_sync(sqlite3_file *file, int flags) { return SQLITE_OK; }
+
+static int archive_file_size(sqlite3_file *file, sqlite3_int64 *size)
+{
+  struct archive_file *archive = (struct archive_file *)file;
+  *size = (sqlite3_int64)archive->page_count * archive->page_size;
+  return SQLITE_OK;
 }
 
-static int bind_varargs(lua_State *L, int nparams, sqlite3_stmt *stmt)
+static int archive_lock(sqlite3_file *file, int lock)
 {
-  int count = sqlite3_bind_parameter_count(stmt);
+  sqlite3_file *real = ((struct archive_file *)file)->real;
+  return real->pMethods->xLock(real, lock);
+}
 
-  lua_settop(L, lua_gettop(L) + (count - nparams));
+static int archive_unlock(sqlite3_file *file, int lock)
+{
+  sqlite3_file *real = ((struct archive_file *)file)->real;
+  return real->pMethods->xUnlock(real, lock);
+}
 
-  int status = SQLITE_OK;
-  while (count > 0)
-  {
-    status = bind_one_param(L, stmt, count--);
-    if (status != SQLITE_OK)
-      break;
-  }
-  return status;
+static int archive_check_reserved_lock(sqlite3_file *file, int *out)
+{
+  sqlite3_file *real = ((struct archive_file *)file)->real;
+  return real->pMethods->xCheckReservedLock(real, out);
 }
 
-static int bind_lua_vars(lua_State *L, sqlite3_stmt *stmt)
+static int archive_file_control(sqlite3_file *file, int op, void *arg)
 {
-  int count = sqlite3_bind_parameter_count(stmt);
-  int status = SQLITE_OK;
+  return SQLITE_NOTFOUND;
+}
 
-  for (int i = 1; i <= count; ++i)
-  {
-    const char *name = sqlite3_bind_parameter_name(stmt, i);
-    if (!name || !is_named_parameter(name))
-    {
-      return luaL_error(L, "anonymous and numbered parameters not supported");
-    }
+static int archive_sector_size(sqlite3_file *file)
+{
+  sqlite3_file *real = ((struct archive_file *)file)->real;
+  return real->pMethods->xSectorSize(real);
+}
 
-    find_var(L, name + 1);
-    status = bind_one_param(L, stmt, i);
-    if (status != SQLITE_OK)
-      break;
-  }
-  return status;
+static int archive_device_characteristics(sqlite3_file *file)
+{
+  sqlite3_file *real = ((struct archive_file *)file)->real;
+  return real->pMethods->xDeviceCharacteristics(real);
 }
 
-static int is_named_parameter(const char *name)
+static int archive_delete(sqlite3_vfs *vfs, const char *name, int sync)
 {
-  return name[0] == ':' || name[0] == '@' || name[0] == '$';
+  return REAL_VFS(vfs)->xDelete(REAL_VFS(vfs), name, sync);
 }
 
-static void find_var(lua_State *L, const char *name)
+static int archive_access(sqlite3_vfs *vfs, const char *name, int flags,
+                          int *out)
 {
-  lua_Debug debug;
-  for (int level = 1; lua_getstack(L, level, &debug); ++level)
-  {
-    int index = 1;
-    const char *lname;
-    while ((lname = lua_getlocal(L, &debug, index++)))
-    {
-      if (!strcmp(name, lname))
-        return;
-      lua_pop(L, 1);
-    }
-  }
-  lua_getglobal(L, name);
+  return REAL_VFS(vfs)->xAccess(REAL_VFS(vfs), name, flags, out);
 }
 
-static int iter(lua_State *L)
+static int archive_full_pathname(sqlite3_vfs *vfs, const char *name, int n,
+                                 char *out)
 {
-  sqlite3_stmt *stmt = *(sqlite3_stmt **)lua_touserdata(L, lua_upvalueindex(1));
-  return step(L, stmt);
+  return REAL_VFS(vfs)->xFullPathname(REAL_VFS(vfs), name, n, out);
 }
 
-static int step_one(lua_State *L, sqlite3_stmt *stmt)
+static void *archive_dlopen(sqlite3_vfs *vfs, const char *name)
 {
-  if (step(L, stmt) == 0)
-    luaL_error(L, "no results");
+  return REAL_VFS(vfs)->xDlOpen(REAL_VFS(vfs), name);
+}
 
-  if (step(L, stmt) != 0)
-  {
-    luaL_error(L, "too many results");
-  }
-  return 1;
+static void archive_dlerror(sqlite3_vfs *vfs, int n, char *msg)
+{
+  REAL_VFS(vfs)->xDlError(REAL_VFS(vfs), n, msg);
 }
 
-static int step_all(lua_State *L, sqlite3_stmt *stmt)
+static void (*archive_dlsym(sqlite3_vfs *vfs, void *lib,
+                            const char *sym))(void)
 {
-  lua_newtable(L);
-  for (int i = 1; step(L, stmt); ++i)
-    lua_rawseti(L, -2, i);
-  return 1;
+  return REAL_VFS(vfs)->xDlSym(REAL_VFS(vfs), lib, sym);
 }
 
-static int step(lua_State *L, sqlite3_stmt *stmt)
+static void archive_dlclose(sqlite3_vfs *vfs, void *lib)
 {
-  int status = sqlite3_step(stmt);
-  if (status != SQLITE_ROW)
-  {
-    if (status != SQLITE_DONE)
-      luaL_error(L, "step: %s", sqlite3_errstr(status));
-    return 0;
-  }
+  REAL_VFS(vfs)->xDlClose(REAL_VFS(vfs), lib);
+}
 
-  handle_row(L, stmt);
-  return 1;
+static int archive_randomness(sqlite3_vfs *vfs, int n, char *out)
+{
+  return REAL_VFS(vfs)->xRandomness(REAL_VFS(vfs), n, out);
 }
 
-static void handle_row(lua_State *L, sqlite3_stmt *stmt)
+static int archive_sleep(sqlite3_vfs *vfs, int usec)
 {
-  int count = sqlite3_data_count(stmt);
+  return REAL_VFS(vfs)->xSleep(REAL_VFS(vfs), usec);
+}
 
-  lua_createtable(L, 0, count);
-  for (int i = 0; i < count; ++i)
-  {
-    lua_pushstring(L, sqlite3_column_name(stmt, i));
-    switch (sqlite3_column_type(stmt, i))
-    {
-    case SQLITE_INTEGER:
-      lua_pushinteger(L, sqlite3_column_int64(stmt, i));
-      break;
-    case SQLITE_FLOAT:
-      lua_pushnumber(L, sqlite3_column_double(stmt, i));
-      break;
-    case SQLITE_TEXT:
-    case SQLITE_BLOB:
-      lua_pushlstring(L, (const char *)sqlite3_column_blob(stmt, i),
-                      sqlite3_column_bytes(stmt, i));
-      break;
-    case SQLITE_NULL:
-    default:
-      lua_pushnil(L);
-      break;
-    }
-    lua_rawset(L, -3);
-  }
+static int archive_current_time(sqlite3_vfs *vfs, double *now)
+{
+  return REAL_VFS(vfs)->xCurrentTime(REAL_VFS(vfs), now);
 }
 
-static int update(lua_State *L, sqlite3_stmt *stmt)
+static int archive_get_last_error(sqlite3_vfs *vfs, int n, char *msg)
 {
-  sqlite3 *db = sqlite3_db_handle(stmt);
+  return REAL_VFS(vfs)->xGetLastError(REAL_VFS(vfs), n, msg);
+}
 
-  int status = sqlite3_step(stmt);
-  if (status != SQLITE_DONE)
-  {
-    return luaL_error(L, "%s", sqlite3_errmsg(db));
-  }
-  lua_pushinteger(L, sqlite3_changes(db));
+static int archive_current_time_int64(sqlite3_vfs *vfs, sqlite3_int64 *now)
+{
+  sqlite3_vfs *real = REAL_VFS(vfs);
+  if (real->iVersion >= 2 && real->xCurrentTimeInt64)
+    return real->xCurrentTimeInt64(real, now);
 
-  return 1;
+  double days;
+  int status = real->xCurrentTime(real, &days);
+  *now = (sqlite3_int64)(days * 86400000.0);
+  return status;
 }
 
-static void close_sqlite(sqlite3 **db)
+static void put_u32(unsigned char *p, sqlite3_uint64 v)
 {
-  if (*db)
-  {
-    sqlite3_close_v2(*db);
-    *db = NULL;
-  }
+  for (int i = 0; i < 4; ++i)
+    p[i] = (v >> (8 * i)) & 0xff;
 }
 
-static void close_sqlite_stmt(sqlite3_stmt **stmt)
+static void put_u64(unsigned char *p, sqlite3_uint64 v)
 {
-  if (*stmt)
-  {
-    sqlite3_finalize(*stmt);
-    *stmt = NULL;
-  }
+  for (int i = 0; i < 8; ++i)
+    p[i] = (v >> (8 * i)) & 0xff;
+}
+
+static unsigned int get_u32(const unsigned char *p)
+{
+  unsigned int v = 0;
+  for (int i = 0; i < 4; ++i)
+    v |= (unsigned int)p[i] << (8 * i);
+  return v;
+}
+
+static sqlite3_uint64 get_u64(const unsigned char *p)
+{
+  sqlite3_uint64 v = 0;
+  for (int i = 0; i < 8; ++i)
+    v |= (sqlite3_uint64)p[i] << (8 * i);
+  return v;
 }
@@ -0,0 +1,54 @@
+#ifndef CLUTCH_H
+#define CLUTCH_H
+
+#include <lua.h>
+#include <sqlite3.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * C API for native modules linked together with clutch.c. All functions raise
+ * Lua errors like the Lua methods of clutch do.
+ */
+
+int luaopen_clutch(lua_State *L);
+
+/* Return the connection of the clutch database at index. */
+sqlite3 *clutch_checkdb(lua_State *L, int index);
+
+/* Return the statement handle of the clutch prepared statement at index. */
+sqlite3_stmt *clutch_checkstmt(lua_State *L, int index);
+
+/*
+ * Reset stmt and bind the parameter table or the values from index first to
+ * the top of the stack to it, like stmt:query() does. The values are popped.
+ * With no values, named parameters are bound from Lua variables visible to
+ * the calling function. Returns the status of the last sqlite3_bind_* call.
+ */
+int clutch_bind(lua_State *L, sqlite3_stmt *stmt, int first);
+
+/* Push the current row of stmt as a table keyed by column names. */
+void clutch_pushrow(lua_State *L, sqlite3_stmt *stmt);
+
+/*
+ * Push a clutch database object wrapping handle. The object takes ownership
+ * of the connection and closes it when garbage collected.
+ */
+void clutch_pushdb(lua_State *L, sqlite3 *handle);
+
+/*
+ * Push a clutch prepared statement wrapping handle, which must be prepared on
+ * the connection of the clutch database at index db. The object takes
+ * ownership of the statement and finalizes it when garbage collected. If db
+ * is not an open clutch database or handle belongs to another connection,
+ * the statement is finalized before the error is raised.
+ */
+void clutch_pushstmt(lua_State *L, int db, sqlite3_stmt *handle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -444,6 +444,841 @@ function TestClutch:testSQLSyntaxErrorIsReportedAsError()
     end)
 end
 
+function TestClutch:testTableParameterIsBoundAsJSON()
+    local result = self.db:queryone("select json_extract(?, '$.a.b') as b", {{a = {b = 'c'}}})
+    luaunit.assertEquals(result.b, 'c')
+end
+
+function TestClutch:testArrayParameterIsBoundAsJSONArray()
+    local result = self.db:queryone("select json_array_length(?) as n", {{1, 2, 3}})
+    luaunit.assertEquals(result.n, 3)
+end
+
+function TestClutch:testJSONColumnIsDecodedByDeclaredType()
+    self.db:update("create table docs (id integer primary key, doc JSON)")
+    self.db:update("insert into docs values (1, ?)", {{name = 'Nut', tags = {'a', 'b'}, n = 1.5}})
+    luaunit.assertEquals(
+        self.db:queryone("select doc from docs where id = 1").doc,
+        {name = 'Nut', tags = {'a', 'b'}, n = 1.5})
+end
+
+function TestClutch:testJSONColumnIsDecodedByStatementOption()
+    local stmt = self.db:prepare([[select '{"s": "a\"\u00e4\n", "x": null, "t": true}' as j]],
+        {json = {'j'}})
+    luaunit.assertEquals(stmt:queryone().j, {s = 'a"\195\164\n', t = true})
+end
+
+function TestClutch:testJSONStatementOptionFailsForUnknownColumn()
+    luaunit.assertErrorMsgContains("no such column: k", function()
+        self.db:prepare("select 1 as j", {json = {'k'}})
+    end)
+end
+
+function TestClutch:testLongJSONNumberIsDecoded()
+    local digits = '0.' .. string.rep('5', 80)
+    local stmt = self.db:prepare("select '[" .. digits .. "]' as j", {json = {'j'}})
+    luaunit.assertAlmostEquals(stmt:queryone().j[1], 0.5555555555, 1e-9)
+end
+
+function TestClutch:testInvalidJSONIsReportedAsError()
+    local stmt = self.db:prepare("select '{\"a\": }' as j", {json = {'j'}})
+    luaunit.assertErrorMsgContains("invalid JSON at offset 6", function()
+        stmt:queryone()
+    end)
+end
+
+function TestClutch:testLoaderBatchesLookupsFromCoroutines()
+    local loader = self.db:loader('select pnum, pname from p where pnum in (?)', 'pnum')
+    local names = {}
+    for i, pnum in ipairs({1, 3, 5, 3, 100}) do
+        coroutine.wrap(function()
+            local part = loader:load(pnum)
+            names[i] = part and part.pname or 'none'
+        end)()
+    end
+    luaunit.assertEquals(names, {})
+    luaunit.assertEquals(loader:dispatch(), 5)
+    luaunit.assertEquals(names, {'Nut', 'Screw', 'Cam', 'Screw', 'none'})
+    luaunit.assertEquals(loader:dispatch(), 0)
+end
+
+function TestClutch:testLoaderResumesCoroutinesWhenQueryFails()
+    self.db:update('create table lk (k integer)')
+    local loader = self.db:loader('select k from lk where k in (?)', 'k')
+    local results = {}
+    for i = 1, 2 do
+        coroutine.wrap(function()
+            results[i] = {loader:load(i)}
+        end)()
+    end
+    self.db:update('drop table lk')
+    luaunit.assertErrorMsgContains('no such table: lk', loader.dispatch, loader)
+    luaunit.assertEquals(#results, 2)
+    luaunit.assertNil(results[1][1])
+    luaunit.assertStrContains(results[2][2], 'no such table: lk')
+end
+
+function TestClutch:testLoaderLoadsImmediatelyOutsideCoroutines()
+    local loader = self.db:loader('select pnum, city from p where pnum in (?)', 'pnum')
+    luaunit.assertItemsEquals(loader:load(2), {pnum = 2, city = 'Paris'})
+    luaunit.assertNil(loader:load(100))
+end
+
+function TestClutch:testLoaderRequiresSingleParameter()
+    luaunit.assertErrorMsgContains("exactly one '?' parameter", function()
+        self.db:loader('select * from p where pnum in (?) and color = ?', 'pnum')
+    end)
+end
+
+function TestClutch:testDetectReportsStatementsRunInLoops()
+    self.db:detect{threshold = 3, window_ms = 60000}
+    local stmt = self.db:prepare('select city from p where pnum = ?')
+    for pnum = 1, 5 do
+        self.db:queryone('select pname from p where pnum = ?', pnum)
+        if pnum < 3 then stmt:queryone(pnum) end
+    end
+    local hotspots = self.db:hotspots()
+    luaunit.assertEquals(#hotspots, 1)
+    luaunit.assertEquals(hotspots[1].sql, 'select pname from p where pnum = ?')
+    luaunit.assertEquals(hotspots[1].count, 5)
+    luaunit.assertEquals(hotspots[1].flagged, 1)
+    luaunit.assertStrContains(hotspots[1].site, 'test.lua:')
+end
+
+function TestClutch:testDetectLogsNormalizedStatements()
+    local logged = {}
+    self.db:detect{threshold = 2, window_ms = 60000, log = function(hotspot)
+        logged[#logged + 1] = hotspot.sql
+    end}
+    for i = 1, 4 do
+        self.db:queryone("SELECT  'x' || ? AS s, 5 as n", i)
+    end
+    self.db:queryall("select * from p where pnum in (1, 2, 3)")
+    luaunit.assertEquals(logged, {"select ? || ? as s, ? as n"})
+end
+
+function TestClutch:testDetectChecksOptions()
+    luaunit.assertErrorMsgContains('threshold must be a number', function()
+        self.db:detect{threshold = 'many'}
+    end)
+end
+
+function TestClutch:testDetectForgetsStaleStatements()
+    self.db:detect{threshold = 2, window_ms = 0}
+    for i = 1, 1100 do
+        self.db:queryone('select pname as c' .. i .. ' from p where pnum = ?', 1)
+    end
+    self.db:queryone('select pname from p where pnum = ?', 1)
+    luaunit.assertEquals(#self.db:hotspots(), 0)
+end
+
+function TestClutch:testCompressFunctionsRoundTrip()
+    local text = string.rep('compressible ', 100)
+    local result = self.db:queryone(
+        "select length(compress(?1)) < length(?1) as smaller, decompress(compress(?1)) = ?1 as same",
+        text)
+    luaunit.assertEquals(result, {smaller = 1, same = 1})
+end
+
+function TestClutch:testCompressedParameterIsDecompressedInResults()
+    self.db:update("create table logs (id integer primary key, body)")
+    local insert = self.db:prepare("insert into logs values (:id, :body)", {compress = {'body'}})
+    local body = string.rep('line of log output\n', 50)
+    insert:update{id = 1, body = body}
+    insert:update{id = 2, body = 'short'}
+    luaunit.assertEquals(self.db:queryone("select typeof(body) as t from logs where id = 1").t, 'blob')
+    luaunit.assertEquals(self.db:queryone("select typeof(body) as t from logs where id = 2").t, 'text')
+    local select = self.db:prepare("select body from logs order by id", {compress = {'body'}})
+    luaunit.assertEquals(select:queryall(), {{body = body}, {body = 'short'}})
+end
+
+function TestClutch:testCompressStatementOptionFailsForUnknownName()
+    luaunit.assertErrorMsgContains("no such column or parameter: x", function()
+        self.db:prepare("select :a as b", {compress = {'x'}})
+    end)
+end
+
+function TestClutch:testArchiveCanBeOpenedWithCompressingVFS()
+    local path, archive = os.tmpname(), os.tmpname()
+    local db = clutch.open(path)
+    db:update("create table logs (id integer primary key, line text)")
+    db:transaction(function(t)
+        for i = 1, 1000 do
+            t:update("insert into logs values (?, ?)", i, 'GET /index.html 200 ' .. i % 10)
+        end
+    end)
+    local file = io.open(path)
+    local size = file:seek('end')
+    file:close()
+    luaunit.assertTrue(db:archive(archive) < size)
+    db:close()
+
+    local cold = clutch.open(archive, {vfs = 'clutch-zlib'})
+    luaunit.assertEquals(cold:queryone("select count(*) as n from logs").n, 1000)
+    luaunit.assertEquals(cold:queryone("select line from logs where id = 42").line, 'GET /index.html 200 2')
+    luaunit.assertErrorMsgContains("readonly", function()
+        cold:update("delete from logs")
+    end)
+    cold:close()
+    os.remove(path)
+    os.remove(archive)
+end
+
+function TestClutch:testOpenFailsForUnknownVFS()
+    luaunit.assertErrorMsgContains("no such vfs: nope", function()
+        clutch.open("", {vfs = 'nope'})
+    end)
+end
+
+function TestClutch:testVectorFunctions()
+    local result = self.db:queryone([[
+        select vec_dot(x'0000803f0000004000004040', x'0000803f0000004000004040') as dot,
+               vec_cosine(x'0000803f00000000', x'000000000000803f') as cosine,
+               vec_l2(x'0000803f0000004000004040', x'0000803f00000040000080bf') as l2
+    ]])
+    luaunit.assertEquals(result, {dot = 14, cosine = 0, l2 = 4})
+end
+
+function TestClutch:testVectorFunctionsRejectMismatchedDimensions()
+    luaunit.assertErrorMsgContains("same dimension", function()
+        self.db:queryone("select vec_dot(x'0000803f', x'0000803f0000803f') as d")
+    end)
+end
+
+function TestClutch:testVecTopkReturnsClosestVectorsFirst()
+    self.db:update("create table emb (id integer primary key, v blob)")
+    self.db:update("insert into emb values (1, x'0000803f00000000')")
+    self.db:update("insert into emb values (2, x'000000000000803f')")
+    self.db:update("insert into emb values (3, x'0000803f0000803f')")
+    self.db:update("insert into emb values (4, null)")
+    local hits = self.db:queryall([[
+        select id from vec_topk('emb', 'v', x'0000803f0000003f', 2)
+    ]])
+    luaunit.assertEquals(hits, {{id = 3}, {id = 1}})
+    hits = self.db:queryall([[
+        select id, score from vec_topk('emb', 'v', x'0000803f00000000', 3, 'l2')
+    ]])
+    luaunit.assertEquals(hits, {{id = 1, score = 0}, {id = 3, score = 1}, {id = 2, score = math.sqrt(2)}})
+end
+
+function TestClutch:testSketchAggregates()
+    local result = self.db:queryone([[
+        select quantile(weight, 0.5) as median,
+               approx_count_distinct(color) as colors,
+               histogram(weight, :bounds) as weights
+        from p
+    ]], {bounds = {13, 17}})
+    luaunit.assertEquals(result, {median = 15.5, colors = 3, weights = '[2,1,3]'})
+end
+
+function TestClutch:testSketchAggregatesAsWindowFunctions()
+    local rows = self.db:queryall([[
+        select quantile(weight, 0.5) over w as median,
+               approx_count_distinct(city) over w as cities,
+               histogram(weight, '[15]') over w as weights
+        from p
+        window w as (order by pnum rows between 1 preceding and current row)
+    ]])
+    local medians, cities, weights = {}, {}, {}
+    for i, row in ipairs(rows) do
+        medians[i], cities[i], weights[i] = row.median, row.cities, row.weights
+    end
+    luaunit.assertEquals(medians, {12, 14.5, 17, 15.5, 13, 15.5})
+    luaunit.assertEquals(cities, {1, 2, 2, 2, 2, 2})
+    luaunit.assertEquals(weights, {'[1,0]', '[1,1]', '[0,2]', '[1,1]', '[2,0]', '[1,1]'})
+end
+
+function TestClutch:testWindowedQuantileTracksExtremes()
+    local rows = self.db:queryall([[
+        select quantile(x, 0) over w as low, quantile(x, 1) over w as high
+        from (select value as x, key as k from json_each('[5, 1, 1, 9, 3, 4, 6]'))
+        window w as (order by k rows between 2 preceding and current row)
+    ]])
+    local lows, highs = {}, {}
+    for i, row in ipairs(rows) do
+        lows[i], highs[i] = row.low, row.high
+    end
+    luaunit.assertEquals(lows, {5, 1, 1, 1, 1, 3, 3})
+    luaunit.assertEquals(highs, {5, 5, 5, 9, 9, 9, 6})
+end
+
+function TestClutch:testQuantileMustBeBetweenZeroAndOne()
+    luaunit.assertErrorMsgContains("quantile must be between 0 and 1", function()
+        self.db:queryone("select quantile(weight, 2) as q from p")
+    end)
+end
+
+function TestClutch:testRegexpOperator()
+    local rows = self.db:queryall("select pname from p where pname regexp '^(Nut|Sc.*)$' order by pnum")
+    luaunit.assertEquals(rows, {{pname = 'Nut'}, {pname = 'Screw'}, {pname = 'Screw'}})
+end
+
+function TestClutch:testInvalidRegexpIsReportedAsError()
+    luaunit.assertErrorMsgContains("invalid regular expression", function()
+        self.db:queryall("select * from p where pname regexp '('")
+    end)
+end
+
+function TestClutch:testInsertColumnsBindsArraysByPosition()
+    local stmt = self.db:prepare("insert into p values (?, ?, ?, ?, ?)")
+    local changes = stmt:insertcolumns{
+        {7, 8}, {'Washer', 'Gear'}, {'Grey', 'Black'}, {5, 30}, {'Helsinki', 'Oslo'}
+    }
+    luaunit.assertEquals(changes, 2)
+    luaunit.assertEquals(self.db:queryall("select pname from p where pnum > 6 order by pnum"),
+        {{pname = 'Washer'}, {pname = 'Gear'}})
+end
+
+function TestClutch:testInsertColumnsBindsArraysByName()
+    self.db:update("create table metrics (ts, host, value)")
+    local stmt = self.db:prepare("insert into metrics values (:ts, :host, :value)")
+    stmt:insertcolumns{ts = {1, 2, 3}, host = {'a', 'b', 'a'}, value = {0.5, 1.5, 2.5}}
+    luaunit.assertEquals(self.db:queryone("select sum(value) as s from metrics where host = 'a'").s, 3)
+end
+
+function TestClutch:testInsertColumnsRollsBackOnError()
+    local stmt = self.db:prepare("insert into p values (?, ?, ?, ?, ?)")
+    luaunit.assertError(function()
+        stmt:insertcolumns{{7, 1}, {'Washer', 'Gear'}, {'Grey', 'Black'}, {5, 30}, {'Helsinki', 'Oslo'}}
+    end)
+    assertResultCount(self.db:query("select * from p where pnum = 7"), 0)
+    luaunit.assertErrorMsgContains("different lengths", function()
+        stmt:insertcolumns{{7}, {}, {}, {}, {}}
+    end)
+end
+
+function TestClutch:testUpdatePackedBindsRecordFields()
+    local stmt = self.db:prepare("insert into p values (?, ?, ?, ?, ?)")
+    local records = "\7\0Washer\0Grey\0\0\0\160\64\8\0Helsinki" ..
+                    "\8\0Gear\0Black\0\0\0\240\65\4\0Oslo"
+    luaunit.assertEquals(stmt:updatepacked('<i2zzfs2', records), 2)
+    luaunit.assertEquals(self.db:queryall("select * from p where pnum > 6 order by pnum"), {
+        {pnum = 7, pname = 'Washer', color = 'Grey', weight = 5, city = 'Helsinki'},
+        {pnum = 8, pname = 'Gear', color = 'Black', weight = 30, city = 'Oslo'}
+    })
+end
+
+function TestClutch:testUpdatePackedRollsBackTruncatedData()
+    local stmt = self.db:prepare("insert into p values (?, ?, ?, ?, ?)")
+    luaunit.assertErrorMsgContains("data string too short", function()
+        stmt:updatepacked('>hzzfz', "\0\7Washer\0Grey\0\64\160\0\0Helsinki\0\0\8Gear\0Black\0\65")
+    end)
+    assertResultCount(self.db:query("select * from p where pnum > 6"), 0)
+    luaunit.assertErrorMsgContains("format has 4 fields but statement has 5 parameters", function()
+        stmt:updatepacked('<i2zzf', '')
+    end)
+end
+
+function TestClutch:testPackAllEncodesRows()
+    local stmt = self.db:prepare("select pnum, pname from p where pnum <= ? order by pnum")
+    luaunit.assertEquals(stmt:packall('<i2z', 2), "\1\0Nut\0\2\0Bolt\0")
+    stmt = self.db:prepare("select pnum, weight, color from p where pnum = 1")
+    luaunit.assertEquals(stmt:packall('!4 <B i4 c4'), "\1\0\0\0\12\0\0\0Red\0")
+end
+
+function TestClutch:testPackFetchReturnsChunks()
+    local stmt = self.db:prepare("select pnum from p order by pnum")
+    local chunks = {}
+    for chunk, rows in stmt:packfetch('B', 4) do
+        chunks[#chunks + 1] = {chunk, rows}
+    end
+    luaunit.assertEquals(chunks, {{"\1\2\3\4", 4}, {"\5\6", 2}})
+end
+
+function TestClutch:testPackFailsOnOverflow()
+    local stmt = self.db:prepare("select 300 as n")
+    luaunit.assertErrorMsgContains("integer overflow in column 'n'", function()
+        stmt:packall('B')
+    end)
+end
+
+function TestClutch:testWarmLoadsPagesIntoCache()
+    local path = os.tmpname()
+    local db = clutch.open(path)
+    db:update("create table p (id integer primary key, body blob)")
+    db:update("create index p_body on p (body)")
+    db:update([[
+        with recursive c(x) as (select 1 union all select x + 1 from c where x < 5000)
+        insert into p select x, randomblob(100) from c
+    ]])
+    db:close()
+
+    db = clutch.open(path)
+    local all = db:warm{tables = {'p'}, indexes = true}
+    luaunit.assertEquals(all.btrees, 2)
+    luaunit.assertTrue(all.pages > 0)
+    luaunit.assertEquals(all.bytes, all.pages * db:queryone("PRAGMA page_size").page_size)
+    luaunit.assertEquals(db:warm().pages, 0)
+    db:close()
+
+    db = clutch.open(path)
+    luaunit.assertTrue(db:warm{max_bytes = 16384}.pages < all.pages)
+    luaunit.assertErrorMsgContains("no such table: nope", function()
+        db:warm{tables = {'nope'}}
+    end)
+    db:close()
+    os.remove(path)
+end
+
+function TestClutch:testReplayRecordedWorkload()
+    local path, log = os.tmpname(), os.tmpname()
+    local db = clutch.open(path)
+    db:update("create table kv (k integer primary key, v text)")
+    db:record(log)
+    for i = 1, 100 do
+        db:update("insert into kv values (?, ?)", i, 'value ' .. i)
+    end
+    luaunit.assertEquals(#db:queryall("select * from kv where k > ?", 50), 50)
+    db:record(false)
+    db:update("delete from kv")
+
+    local result = clutch.replay(log, db)
+    luaunit.assertEquals(result.count, 101)
+    luaunit.assertEquals(result.errors, 0)
+    luaunit.assertTrue(result.latency.max >= result.latency.p50)
+    luaunit.assertTrue(result.recorded.p99 >= 0)
+    luaunit.assertEquals(db:queryone("select v from kv where k = 42").v, 'value 42')
+
+    db:update("delete from kv")
+    luaunit.assertEquals(clutch.replay(log, db, {threads = 2}).errors, 0)
+    luaunit.assertEquals(db:queryone("select count(*) as n from kv").n, 100)
+    db:close()
+    os.remove(path)
+    os.remove(log)
+end
+
+function TestClutch:testReplayFailsForInvalidLog()
+    luaunit.assertErrorMsgContains("not a clutch workload log", function()
+        clutch.replay('test.lua', self.db)
+    end)
+end
+
+function TestClutch:testMaterializeMaintainsAggregates()
+    self.db:update("create table metrics (host text, v integer)")
+    self.db:update("insert into metrics values ('a', 1), ('a', 2), ('b', 5)")
+    local summary = self.db:materialize('metrics_by_host', {
+        source = 'metrics', group = {'host'},
+        aggregates = {count = '*', sum = 'v', max = 'v'}
+    })
+    luaunit.assertEquals(tostring(summary), 'materialized: metrics_by_host')
+
+    self.db:update("insert into metrics values ('b', 7), ('c', 3)")
+    self.db:update("update metrics set host = 'c' where v = 2")
+    self.db:update("delete from metrics where v = 7")
+    local query = "select host, count, sum_v, max_v from metrics_by_host order by host"
+    local expected = {
+        {host = 'a', count = 1, sum_v = 1, max_v = 1},
+        {host = 'b', count = 1, sum_v = 5, max_v = 5},
+        {host = 'c', count = 2, sum_v = 5, max_v = 3}
+    }
+    luaunit.assertEquals(self.db:queryall(query), expected)
+
+    self.db:update("delete from metrics_by_host")
+    summary:refresh()
+    luaunit.assertEquals(self.db:queryall(query), expected)
+end
+
+function TestClutch:testMaterializeChecksExistingDefinition()
+    self.db:update("create table metrics (host text, region text, v integer)")
+    local spec = {source = 'metrics', group = {'host'}, aggregates = {sum = 'v'}}
+    self.db:materialize('summary', spec)
+    self.db:materialize('summary', spec)
+    luaunit.assertErrorMsgContains("exists with a different definition", function()
+        self.db:materialize('summary', {
+            source = 'metrics', group = {'region'}, aggregates = {sum = 'v'}
+        })
+    end)
+    luaunit.assertErrorMsgContains("group column cannot be named count", function()
+        self.db:materialize('other', {
+            source = 'metrics', group = {'count'}, aggregates = {}
+        })
+    end)
+end
+
+function TestClutch:testMaterializeFailsForUnknownAggregate()
+    luaunit.assertErrorMsgContains("unsupported aggregate: median", function()
+        self.db:materialize('s', {source = 't', aggregates = {median = 'v'}})
+    end)
+end
+
+function TestClutch:testStrictModeRejectsFullScans()
+    self.db:update("create table big (a integer, b integer)")
+    self.db:update("create index big_a on big (a)")
+    self.db:update([[
+        with recursive c(x) as (select 1 union all select x + 1 from c where x < 100)
+        insert into big select x, x % 10 from c
+    ]])
+    self.db:strict{min_rows = 50}
+    luaunit.assertErrorMsgContains("full scan of table main.big (100 rows)", function()
+        self.db:queryall("select * from big where b = 1")
+    end)
+    luaunit.assertEquals(#self.db:queryall("select * from big where a = 1"), 1)
+    luaunit.assertEquals(#self.db:queryall("select * from big where a < 5 order by b"), 4)
+
+    self.db:strict(false)
+    luaunit.assertEquals(#self.db:queryall("select * from big where b = 1"), 10)
+end
+
+function TestClutch:testStrictModeCanReportTempBTrees()
+    self.db:update("create table big (a integer, b integer)")
+    self.db:update("insert into big values (1, 2), (3, 4)")
+    local warnings = {}
+    self.db:strict{forbid = {'temp_btree'}, min_rows = 0, action = function(message)
+        table.insert(warnings, message)
+    end}
+    self.db:queryall("select * from big order by b")
+    self.db:queryall("select * from big order by b")
+    self.db:queryall("select * from big")
+    luaunit.assertEquals(#warnings, 1)
+    luaunit.assertStrContains(warnings[1], "USE TEMP B-TREE FOR ORDER BY")
+end
+
+function TestClutch:testStatementsListsLivePreparedStatements()
+    local sql = "select city from p where pnum = ?"
+    local stmt = self.db:prepare(sql)
+    stmt:queryone(1)
+    stmt:queryone(2)
+
+    local found
+    for _, s in ipairs(self.db:statements()) do
+        if s.sql == sql then
+            found = s
+        end
+    end
+    luaunit.assertEquals(found.runs, 2)
+    luaunit.assertTrue(found.memory > 0)
+    luaunit.assertTrue(found.idle_ms >= 0)
+    luaunit.assertFalse(found.busy)
+end
+
+function TestClutch:testTrimFinalizesIdleStatements()
+    local stmt = self.db:prepare("select city from p where pnum = ?")
+    local iter = self.db:prepare("select * from p"):query()
+    iter()
+    luaunit.assertTrue(self.db:trim(60000) == 0)
+    luaunit.assertTrue(self.db:trim() >= 1)
+    luaunit.assertEquals(tostring(stmt), '(closed)')
+    luaunit.assertErrorMsgContains("statement is closed", function()
+        stmt:queryone(1)
+    end)
+    luaunit.assertNotNil(iter())
+end
+
+function TestClutch:testForcedCloseFinalizesStatements()
+    local db = clutch.open("")
+    local stmt = db:prepare("select 1 as one")
+    db:close{force = true}
+    luaunit.assertEquals(tostring(stmt), '(closed)')
+end
+
+function TestClutch:testKeyValueStore()
+    local kv = self.db:kv('settings', {cache_entries = 4})
+    kv:put('a', 'one')
+    kv:put('b', 2)
+    kv:putmany({c = 'three', ab = 'four'})
+    luaunit.assertEquals(kv:get('a'), 'one')
+    luaunit.assertEquals(kv:get('b'), 2)
+    luaunit.assertNil(kv:get('missing'))
+    luaunit.assertEquals(kv:getmany({'a', 'c', 'missing'}), {a = 'one', c = 'three'})
+
+    kv:put('a', 'uno')
+    luaunit.assertEquals(kv:get('a'), 'uno')
+    kv:delete('b')
+    luaunit.assertNil(kv:get('b'))
+    kv:put('c', nil)
+    luaunit.assertNil(kv:get('c'))
+
+    local keys = {}
+    for k, v in kv:scan('a') do
+        table.insert(keys, k .. '=' .. v)
+    end
+    luaunit.assertEquals(keys, {'a=uno', 'ab=four'})
+    luaunit.assertEquals(#self.db:queryall("select * from settings"), 2)
+
+    self.db:trim()
+    luaunit.assertEquals(kv:get('ab'), 'four')
+end
+
+function TestClutch:testKeyValueRoundTripsValues()
+    local kv = self.db:kv('settings')
+    kv:putmany({int = 42, float = 1.5, text = '42'})
+    luaunit.assertEquals(kv:getmany({'int', 'float', 'text'}),
+                         {int = 42, float = 1.5, text = '42'})
+    luaunit.assertErrorMsgContains("values cannot be tables", function()
+        kv:put('list', {1, 2})
+    end)
+    luaunit.assertNil(kv:get('list'))
+end
+
+function TestClutch:testKeyValuePutManyIsAtomic()
+    local kv = self.db:kv('settings')
+    luaunit.assertErrorMsgContains("unsupported lua type", function()
+        kv:putmany({a = 'one', b = function() end})
+    end)
+    luaunit.assertNil(kv:get('a'))
+end
+
+function TestClutch:testPartitioned()
+    local dir = os.tmpname()
+    os.remove(dir)
+    os.execute("mkdir " .. dir)
+    local now = os.time()
+    local metrics = self.db:partitioned('metrics', {
+        by = 'day', dir = dir, keep = 2, columns = 'ts INTEGER, host TEXT, v REAL'
+    })
+    metrics:insert({ts = now - 3 * 86400, host = 'a', v = 1})
+    metrics:insert({ts = now - 86400, host = 'a', v = 2})
+    metrics:insert({ts = now, host = 'b', v = 3})
+    metrics:insert({ts = now, host = 'c'})
+    luaunit.assertEquals(#metrics:partitions(), 2)
+
+    luaunit.assertEquals(metrics:view(), 'metrics')
+    luaunit.assertEquals(self.db:queryone("select count(*) as n from metrics").n, 3)
+    metrics:view(now, now)
+    luaunit.assertEquals(self.db:queryall("select host from metrics order by host"),
+                         {{host = 'b'}, {host = 'c'}})
+
+    luaunit.assertEquals(metrics:retire(now + 86400), 1)
+    luaunit.assertEquals(#metrics:partitions(), 1)
+    luaunit.assertErrorMsgContains("row has no ts", function()
+        metrics:insert({host = 'd'})
+    end)
+
+    self.db:update("begin")
+    metrics:insert({ts = now, host = 'd'})
+    luaunit.assertErrorMsgContains("inside a transaction", function()
+        metrics:insert({ts = now + 86400, host = 'e'})
+    end)
+    self.db:update("rollback")
+    luaunit.assertEquals(#metrics:partitions(), 1)
+
+    for _, key in ipairs(metrics:partitions()) do
+        os.remove(dir .. '/metrics_' .. key .. '.db')
+    end
+    os.remove(dir)
+end
+
+function TestClutch:testQueryYieldsEveryRows()
+    local stmt = self.db:prepare("select * from p", {yield_every_rows = 2})
+    local rows, yields = 0, 0
+    local co = coroutine.create(function()
+        for _ in stmt:query() do
+            rows = rows + 1
+        end
+    end)
+    while coroutine.resume(co) and coroutine.status(co) == "suspended" do
+        yields = yields + 1
+    end
+    luaunit.assertEquals(rows, 6)
+    luaunit.assertEquals(yields, 3)
+end
+
+function TestClutch:testQueryYieldHook()
+    local calls = 0
+    local stmt = self.db:prepare("select * from p", {
+        yield_every_rows = 4,
+        yield = function() calls = calls + 1 end
+    })
+    assertResultCount(stmt:query(), 6)
+    luaunit.assertEquals(calls, 1)
+end
+
+function TestClutch:testRtreeLoad()
+    self.db:update("create virtual table boxes using rtree(id, minx, maxx, miny, maxy)")
+    local rows = {}
+    for i = 1, 500 do
+        local x, y = (i * 37) % 100, (i * 61) % 100
+        rows[i] = {i, x, x + 1, y, y + 1}
+    end
+    luaunit.assertEquals(self.db:rtreeload('boxes', rows), 500)
+    luaunit.assertEquals(self.db:queryone("select count(*) as n from boxes").n, 500)
+
+    local ids = self.db:rtreewithin('boxes', {0, 10, 0, 10})
+    local expected = self.db:queryall([[
+        select id from boxes where minx >= 0 and maxx <= 10 and miny >= 0 and maxy <= 10]])
+    luaunit.assertEquals(#ids, #expected)
+    luaunit.assertTrue(#ids > 0)
+    luaunit.assertErrorMsgContains("not an R*Tree table", function()
+        self.db:rtreeload('p', {})
+    end)
+end
+
+function TestClutch:testRtreeAuxiliaryColumns()
+    self.db:update("create virtual table places using rtree(id, minx, maxx, +name, +kind)")
+    luaunit.assertEquals(self.db:rtreeload('places', {
+        {1, 0, 2, 'a', 'shop'}, {2, 5, 6, 'b', 'park'}
+    }), 2)
+    luaunit.assertEquals(self.db:rtreewithin('places', {0, 3}), {1})
+    luaunit.assertEquals(self.db:queryone("select name, kind from places where id = 2"),
+                         {name = 'b', kind = 'park'})
+end
+
+function TestClutch:testUpdateManySorted()
+    self.db:update("create table seq (n integer, k text)")
+    local stmt = self.db:prepare("insert into seq values (:n, :k)")
+    local rows = {{n = 3, k = 'c'}, {n = 1, k = 'b'}, {k = 'z'}, {n = 2.5, k = 'a'}, {n = 1, k = 'a'}}
+    luaunit.assertEquals(stmt:updatemany(rows, {sort_by = {'n', 'k'}}), 5)
+    local order = {}
+    for row in self.db:query("select k from seq order by rowid") do
+        table.insert(order, row.k)
+    end
+    luaunit.assertEquals(order, {'z', 'a', 'b', 'a', 'c'})
+
+    stmt = self.db:prepare("insert into seq values (?, ?)")
+    luaunit.assertEquals(stmt:updatemany({{4, 'd'}, {5, 'e'}}), 2)
+    luaunit.assertEquals(stmt:updatemany({{7, 'g'}, {6, 'f'}}, {sort_by = 1}), 2)
+    luaunit.assertEquals(self.db:queryone("select max(rowid) as r, k from seq").k, 'g')
+end
+
+function TestClutch:testUpdateManyResetsRunningStatement()
+    self.db:update("create table seen (n integer)")
+    self.db:update("insert into seen values (1), (2)")
+    local stmt = self.db:prepare("delete from seen where n > ? returning n")
+    local iter = stmt:query(0)
+    luaunit.assertEquals(iter().n, 1)
+    luaunit.assertEquals(stmt:updatemany({{5}, {6}}), 0)
+    luaunit.assertEquals(self.db:queryone("select count(*) as n from seen").n, 0)
+end
+
+function TestClutch:testCollations()
+    self.db:createcollation('reverse', function(a, b)
+        return a < b and 1 or a > b and -1 or 0
+    end)
+    luaunit.assertEquals(self.db:queryall("select pname from p order by pname collate reverse limit 2"),
+                         {{pname = 'Screw'}, {pname = 'Screw'}})
+
+    self.db:update("create table names (name text collate unicode_nocase unique)")
+    self.db:update("insert into names values ('Äpfel')")
+    luaunit.assertErrorMsgContains("UNIQUE constraint failed", function()
+        self.db:update("insert into names values ('äPFEL')")
+    end)
+
+    self.db:update('create table files (name text collate "NATURAL")')
+    self.db:update("insert into files values ('file10'), ('file2'), ('file1')")
+    luaunit.assertEquals(self.db:queryall("select name from files order by name"),
+                         {{name = 'file1'}, {name = 'file2'}, {name = 'file10'}})
+
+    self.db:createcollation('reverse', nil)
+    luaunit.assertErrorMsgContains("no such collation sequence", function()
+        self.db:queryall("select pname from p order by pname collate reverse")
+    end)
+end
+
+function TestClutch:testCollationErrorFailsStatement()
+    local fail = false
+    self.db:createcollation('picky', function(a, b)
+        if fail then error("cannot compare " .. a) end
+        return a < b and -1 or a > b and 1 or 0
+    end)
+    self.db:update("create table tags (name text collate picky)")
+    self.db:update("create index tags_name on tags (name)")
+    self.db:update("insert into tags values ('b'), ('d')")
+
+    fail = true
+    luaunit.assertErrorMsgContains("cannot compare", function()
+        self.db:update("insert into tags values ('a'), ('c')")
+    end)
+    luaunit.assertErrorMsgContains("cannot compare", function()
+        self.db:queryall("select name from tags where name > 'a'")
+    end)
+    fail = false
+    luaunit.assertEquals(self.db:queryall("select name from tags order by name"),
+                         {{name = 'b'}, {name = 'd'}})
+end
+
+function TestClutch:testOpener()
+    local paths = {os.tmpname(), os.tmpname(), os.tmpname()}
+    local opener = clutch.opener{max_open = 2}
+    local a = opener:get(paths[1])
+    luaunit.assertIs(opener:get(paths[1]), a)
+    local b = opener:get(paths[2])
+    opener:get(paths[1])
+    opener:get(paths[3])
+    luaunit.assertEquals(tostring(opener), 'opener: 2 open')
+    luaunit.assertEquals(tostring(b), 'sqlite3: (closed)')
+    luaunit.assertIs(opener:get(paths[1]), a)
+    luaunit.assertNotIs(opener:get(paths[2]), b)
+
+    for _ in a:query("select 1 union all select 2") do
+        opener:get(paths[3])
+        luaunit.assertEquals(tostring(opener), 'opener: 2 open')
+        luaunit.assertIs(opener:get(paths[1]), a)
+        break
+    end
+
+    local small = clutch.opener{max_open = 1}
+    local c = small:get(paths[1])
+    for _ in c:query("select 1 union all select 2") do
+        small:get(paths[2])
+        luaunit.assertEquals(tostring(small), 'opener: 2 open')
+        break
+    end
+    small:close()
+
+    opener:close()
+    luaunit.assertEquals(tostring(a), 'sqlite3: (closed)')
+    luaunit.assertEquals(tostring(opener), 'opener: 0 open')
+    for _, path in ipairs(paths) do
+        os.remove(path)
+    end
+end
+
+function TestClutch:testCachedStatements()
+    local stmt = self.db:prepare("select * from p where pnum = ?", {cached = true})
+    luaunit.assertIs(self.db:prepare("select * from p where pnum = ?", {cached = true}), stmt)
+    luaunit.assertNotIs(self.db:prepare("select * from p where pnum = ?"), stmt)
+    self.db:trim()
+    local again = self.db:prepare("select * from p where pnum = ?", {cached = true})
+    luaunit.assertNotIs(again, stmt)
+    luaunit.assertEquals(again:queryone(1).pname, 'Nut')
+
+    local json = self.db:prepare("select pname from p", {cached = true, json = {'pname'}})
+    luaunit.assertIs(self.db:prepare("select pname from p", {json = {'pname'}, cached = true}), json)
+    luaunit.assertErrorMsgContains("cached with different options", function()
+        self.db:prepare("select pname from p", {cached = true})
+    end)
+end
+
+function TestClutch:testWriterThread()
+    local path = os.tmpname()
+    local db = clutch.open(path)
+    db:update("create table w(id integer primary key, name text, data text)")
+
+    local writer = clutch.writerthread(path, {batch = 10})
+    luaunit.assertEquals(tostring(writer), 'writer: ' .. db:queryone("select file from pragma_database_list where name = 'main'").file)
+    local other = clutch.writerthread(path)
+    luaunit.assertErrorMsgContains('already runs with batch 10', clutch.writerthread, path, {batch = 20})
+    local link = path .. '.link'
+    os.execute("ln -s " .. path .. " " .. link)
+    luaunit.assertErrorMsgContains('already runs with batch 10', clutch.writerthread, link, {batch = 20})
+    os.remove(link)
+    for i = 1, 100 do
+        writer:write("insert into w values (?, ?, ?)", i, 'row' .. i, {i})
+    end
+    other:write("insert into w values (?, ?, ?)", 1, 'duplicate', nil)
+    writer:flush()
+    luaunit.assertErrorMsgContains('UNIQUE constraint failed', other.flush, other)
+    other:flush()
+    other:write("commit")
+    luaunit.assertErrorMsgContains('cannot control transactions', other.flush, other)
+    other:write("delete from w where id = 1; delete from w where id = 2")
+    luaunit.assertErrorMsgContains('must be a single statement', other.flush, other)
+    other:write("insert into w values (?, ?, ?)", 101, 'row101', 'data', 'extra')
+    luaunit.assertErrorMsgContains('column index out of range', other.flush, other)
+
+    luaunit.assertEquals(db:queryone("select count(*) as n from w").n, 100)
+    luaunit.assertEquals(db:queryone("select * from w where id = 7"), {id = 7, name = 'row7', data = '[7]'})
+
+    writer:close()
+    luaunit.assertErrorMsgContains('writer is closed', writer.write, writer, "delete from w")
+    other:write("delete from w where id > 50")
+    other:close()
+    luaunit.assertEquals(db:queryone("select count(*) as n from w").n, 50)
+    luaunit.assertErrorMsgContains('in-memory', clutch.writerthread, ':memory:')
+    db:close()
+    os.remove(path)
+end
+
 function assertResultCount(iter, count)
     local i = 0
     for _ in iter do